@@ -0,0 +1,197 @@
+// Headless benchmark of MarchingCubes meshing. Synthetic volumes are meshed
+// the same way as MarchingCubesChunk::rebuild() does, but without uploading
+// anything to GPU, so no Engine or Graphics subsystem is needed.
+//
+// Build it by linking against Urho3D, for example:
+// g++ -O2 -I<urho3d>/include -I<urho3d>/include/Urho3D/ThirdParty
+//     benchmarks/marchingcubesbenchmark.cpp graphics/marchingcubes.cpp
+//     graphics/brickedweightmap.cpp debug/asciitable.cpp -L<urho3d>/lib -lUrho3D
+//
+// Usage: marchingcubesbenchmark [seconds per case] [skirts] [compact]
+
+#include "../debug/asciitable.hpp"
+#include "../graphics/marchingcubes.hpp"
+#include "../procedural/md5rng.hpp"
+
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Math/MathDefs.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace UrhoExtras;
+using namespace UrhoExtras::Graphics;
+
+// Every heap allocation of the process is counted, so
+// allocations of the meshing itself can be measured.
+std::atomic<unsigned long> allocations_count(0);
+
+void* operator new(std::size_t size)
+{
+    ++ allocations_count;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    free(ptr);
+}
+
+enum VolumeType
+{
+    VOLUME_NOISE,
+    VOLUME_SPHERE,
+    VOLUME_CAVES,
+    VOLUME_CHECKERBOARD
+};
+
+char const* const VOLUME_NAMES[] = { "noise", "sphere", "caves", "checkerboard" };
+
+unsigned const CHUNK_WIDTHS[] = { 8, 16, 32, 60 };
+
+float const CUBE_WIDTH = 0.1;
+
+// Smooth value noise between -1 and 1. Lattice values are hashed from the position.
+float getNoise(float x, float y, float z, unsigned seed)
+{
+    int x0 = Urho3D::FloorToInt(x);
+    int y0 = Urho3D::FloorToInt(y);
+    int z0 = Urho3D::FloorToInt(z);
+    float fx = Urho3D::SmoothStep(0.0f, 1.0f, x - x0);
+    float fy = Urho3D::SmoothStep(0.0f, 1.0f, y - y0);
+    float fz = Urho3D::SmoothStep(0.0f, 1.0f, z - z0);
+    float result = 0;
+    for (unsigned corner_i = 0; corner_i < 8; ++ corner_i) {
+        int cx = x0 + (corner_i & 1);
+        int cy = y0 + ((corner_i >> 1) & 1);
+        int cz = z0 + (corner_i >> 2);
+        uint32_t hash = Procedural::md5Rng(seed, uint32_t(cx), (uint64_t(uint32_t(cy)) << 32) | uint32_t(cz));
+        float value = hash / float(0xffffffff) * 2 - 1;
+        float weight = ((corner_i & 1) ? fx : 1 - fx) * ((corner_i & 2) ? fy : 1 - fy) * ((corner_i & 4) ? fz : 1 - fz);
+        result += value * weight;
+    }
+    return result;
+}
+
+// Converts signed distance in cube widths to weight. Negative is solid.
+uint8_t distanceToWeight(float distance)
+{
+    return Urho3D::Clamp(Urho3D::RoundToInt(127.5f - distance * 127.5f), 0, 255);
+}
+
+// Generates a padded weight map, that is what chunks use for meshing
+void generateVolume(MarchingCubes::WeightMap& result, VolumeType type, unsigned chunk_width)
+{
+    unsigned cwe = chunk_width + 3;
+    result.Resize(cwe * cwe * cwe);
+    float center = (cwe - 1) / 2.0f;
+    unsigned i = 0;
+    for (unsigned z = 0; z < cwe; ++ z) {
+        for (unsigned y = 0; y < cwe; ++ y) {
+            for (unsigned x = 0; x < cwe; ++ x) {
+                float distance;
+                if (type == VOLUME_NOISE) {
+                    // Rolling surface with a few octaves
+                    distance = getNoise(x / 8.0f, y / 8.0f, z / 8.0f, 1) * 6 + getNoise(x / 3.0f, y / 3.0f, z / 3.0f, 2) * 2;
+                } else if (type == VOLUME_SPHERE) {
+                    distance = Urho3D::Vector3(x - center, y - center, z - center).Length() - chunk_width * 0.4f;
+                } else if (type == VOLUME_CAVES) {
+                    // Solid rock with tunnels where two noise fields are both near zero
+                    float tunnel = Urho3D::Vector2(getNoise(x / 6.0f, y / 6.0f, z / 6.0f, 3), getNoise(x / 6.0f, y / 6.0f, z / 6.0f, 4)).Length();
+                    distance = (0.25f - tunnel) * 8;
+                } else {
+                    // Every cube is active
+                    distance = ((x + y + z) % 2) ? 1 : -1;
+                }
+                result[i ++] = distanceToWeight(distance);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    float min_secs = argc > 1 ? atof(argv[1]) : 1;
+    MarchingCubesChunk::MeshOptions options;
+    options.skirts = argc > 2 && atoi(argv[2]);
+    options.compact_vertices = argc > 3 && atoi(argv[3]);
+    unsigned vertex_floats = options.compact_vertices ? 6 : 12;
+
+    Debug::AsciiTable table;
+    table.addCell("Volume");
+    table.addCell("Width");
+    table.addCell("Meshes", Debug::AsciiTable::A_RIGHT);
+    table.addCell("Mcubes/s", Debug::AsciiTable::A_RIGHT);
+    table.addCell("Mtris/s", Debug::AsciiTable::A_RIGHT);
+    table.addCell("Triangles", Debug::AsciiTable::A_RIGHT);
+    table.addCell("Vertices", Debug::AsciiTable::A_RIGHT);
+    table.addCell("Allocs/mesh", Debug::AsciiTable::A_RIGHT);
+    table.addCell("usec/mesh", Debug::AsciiTable::A_RIGHT);
+    table.endRow();
+
+    MarchingCubes::WeightMap wmap;
+    MarchingCubes::WeightMap materials;
+    MarchingCubesChunk::MeshData mesh;
+    for (unsigned type = VOLUME_NOISE; type <= VOLUME_CHECKERBOARD; ++ type) {
+        for (unsigned chunk_width : CHUNK_WIDTHS) {
+            generateVolume(wmap, VolumeType(type), chunk_width);
+
+            // Warm up, so the tables of cube cases are ready
+            MarchingCubesChunk::buildMesh(mesh, wmap, materials, chunk_width, CUBE_WIDTH, options);
+
+            unsigned meshes = 0;
+            unsigned long allocations_begin = allocations_count;
+            Urho3D::HiresTimer timer;
+            long long usecs = 0;
+            do {
+                MarchingCubesChunk::buildMesh(mesh, wmap, materials, chunk_width, CUBE_WIDTH, options);
+                ++ meshes;
+                usecs = timer.GetUSec(false);
+            } while (usecs < min_secs * 1000000);
+            unsigned long allocations = allocations_count - allocations_begin;
+
+            float secs = usecs / 1000000.0f;
+            unsigned tris = mesh.idata.Size() / 3;
+            unsigned cubes = chunk_width * chunk_width * chunk_width;
+            table.addCell(VOLUME_NAMES[type]);
+            table.addCell(Urho3D::String(chunk_width));
+            table.addCell(Urho3D::String(meshes), Debug::AsciiTable::A_RIGHT);
+            table.addCell(Urho3D::String(double(cubes) * meshes / secs / 1000000), Debug::AsciiTable::A_RIGHT);
+            table.addCell(Urho3D::String(double(tris) * meshes / secs / 1000000), Debug::AsciiTable::A_RIGHT);
+            table.addCell(Urho3D::String(tris), Debug::AsciiTable::A_RIGHT);
+            table.addCell(Urho3D::String(mesh.vdata.Size() / vertex_floats), Debug::AsciiTable::A_RIGHT);
+            table.addCell(Urho3D::String(double(allocations) / meshes), Debug::AsciiTable::A_RIGHT);
+            table.addCell(Urho3D::String(double(usecs) / meshes), Debug::AsciiTable::A_RIGHT);
+            table.endRow();
+        }
+    }
+
+    printf("Skirts: %s, compact vertices: %s\n%s", options.skirts ? "yes" : "no", options.compact_vertices ? "yes" : "no", table.toString().CString());
+    return 0;
+}
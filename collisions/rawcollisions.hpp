@@ -41,6 +41,103 @@ inline void getRawSphereCollisionToLine(Collisions& result, Urho3D::Vector3 cons
     }
 }
 
+// Normal is the direction from the nearest point of triangle to the sphere
+inline void getRawSphereCollisionToTriangle(Collisions& result, Urho3D::Vector3 const& pos, float radius, Urho3D::Vector3 const& tri_pos1, Urho3D::Vector3 const& tri_pos2, Urho3D::Vector3 const& tri_pos3, float extra_radius, bool flip_coll_normal)
+{
+    Urho3D::Vector3 nearest = nearestPointAtTriangle(pos, tri_pos1, tri_pos2, tri_pos3);
+    Urho3D::Vector3 diff = pos - nearest;
+    float distance = diff.Length();
+    if (distance >= radius + extra_radius) {
+        return;
+    }
+    Urho3D::Vector3 coll_normal;
+    if (distance > 0) {
+        coll_normal = diff / distance;
+    } else {
+        // Sphere center is exactly at the triangle
+        coll_normal = (tri_pos2 - tri_pos1).CrossProduct(tri_pos3 - tri_pos1).Normalized();
+        if (coll_normal == Urho3D::Vector3::ZERO) {
+            return;
+        }
+    }
+    if (flip_coll_normal) {
+        coll_normal = -coll_normal;
+    }
+    result.Push(Collision(coll_normal, radius - distance));
+}
+
+// Like getRawSphereCollisionToTriangle(), but for a sphere that moves from
+// "pos1" to "pos2". If the segment goes through the triangle, then the normal
+// points to the side where the longer part of the segment is.
+inline void getRawCapsuleCollisionToTriangle(Collisions& result, Urho3D::Vector3 const& pos1, Urho3D::Vector3 const& pos2, float radius, Urho3D::Vector3 const& tri_pos1, Urho3D::Vector3 const& tri_pos2, Urho3D::Vector3 const& tri_pos3, float extra_radius, bool flip_coll_normal)
+{
+    Urho3D::Vector3 tri_normal = (tri_pos2 - tri_pos1).CrossProduct(tri_pos3 - tri_pos1).Normalized();
+
+    // Check if segment goes through the triangle
+    if (tri_normal != Urho3D::Vector3::ZERO) {
+        float dst1 = tri_normal.DotProduct(pos1 - tri_pos1);
+        float dst2 = tri_normal.DotProduct(pos2 - tri_pos1);
+        if ((dst1 < 0 && dst2 > 0) || (dst1 > 0 && dst2 < 0)) {
+            Urho3D::Vector3 pos_at_plane = pos1 + (pos2 - pos1) * (dst1 / (dst1 - dst2));
+            Urho3D::Vector3 nearest = nearestPointAtTriangle(pos_at_plane, tri_pos1, tri_pos2, tri_pos3);
+            if ((nearest - pos_at_plane).LengthSquared() < Urho3D::M_EPSILON) {
+                bool first_is_longer = Urho3D::Abs(dst1) >= Urho3D::Abs(dst2);
+                float longer_dst = first_is_longer ? dst1 : dst2;
+                float shorter_dst = first_is_longer ? dst2 : dst1;
+                Urho3D::Vector3 coll_normal = longer_dst > 0 ? tri_normal : -tri_normal;
+                if (flip_coll_normal) {
+                    coll_normal = -coll_normal;
+                }
+                result.Push(Collision(coll_normal, radius + Urho3D::Abs(shorter_dst)));
+                return;
+            }
+        }
+    }
+
+    // Find the nearest points from the ends of segment and from the edges of triangle
+    Urho3D::Vector3 nearest_at_segment = pos1;
+    Urho3D::Vector3 nearest_at_tri = nearestPointAtTriangle(pos1, tri_pos1, tri_pos2, tri_pos3);
+    float nearest_dst_sqr = (nearest_at_segment - nearest_at_tri).LengthSquared();
+
+    Urho3D::Vector3 candidate_at_tri = nearestPointAtTriangle(pos2, tri_pos1, tri_pos2, tri_pos3);
+    float candidate_dst_sqr = (pos2 - candidate_at_tri).LengthSquared();
+    if (candidate_dst_sqr < nearest_dst_sqr) {
+        nearest_at_segment = pos2;
+        nearest_at_tri = candidate_at_tri;
+        nearest_dst_sqr = candidate_dst_sqr;
+    }
+
+    Urho3D::Vector3 const* tri_poss[3] = { &tri_pos1, &tri_pos2, &tri_pos3 };
+    for (unsigned i = 0; i < 3; ++ i) {
+        Urho3D::Vector3 candidate_at_segment;
+        nearestPointsBetweenSegments(candidate_at_segment, candidate_at_tri, pos1, pos2, *tri_poss[i], *tri_poss[(i + 1) % 3]);
+        candidate_dst_sqr = (candidate_at_segment - candidate_at_tri).LengthSquared();
+        if (candidate_dst_sqr < nearest_dst_sqr) {
+            nearest_at_segment = candidate_at_segment;
+            nearest_at_tri = candidate_at_tri;
+            nearest_dst_sqr = candidate_dst_sqr;
+        }
+    }
+
+    float distance = Urho3D::Sqrt(nearest_dst_sqr);
+    if (distance >= radius + extra_radius) {
+        return;
+    }
+    Urho3D::Vector3 coll_normal;
+    if (distance > 0) {
+        coll_normal = (nearest_at_segment - nearest_at_tri) / distance;
+    } else if (tri_normal != Urho3D::Vector3::ZERO) {
+        // Segment touches the triangle. Use the side where the middle of segment is.
+        coll_normal = tri_normal.DotProduct((pos1 + pos2) / 2 - tri_pos1) >= 0 ? tri_normal : -tri_normal;
+    } else {
+        return;
+    }
+    if (flip_coll_normal) {
+        coll_normal = -coll_normal;
+    }
+    result.Push(Collision(coll_normal, radius - distance));
+}
+
 inline void getRawSphereCollisionToBox(Collisions& result, Urho3D::Vector3 const& size_half, Urho3D::Vector3 const& sphere_pos, float radius, float extra_radius, bool flip_coll_normal)
 {
     unsigned result_original_size = result.Size();
@@ -0,0 +1,303 @@
+#include "brickedweightmap.hpp"
+
+#include <cstring>
+
+namespace UrhoExtras
+{
+
+namespace Graphics
+{
+
+BrickedWeightMap::BrickedWeightMap() :
+    size(Urho3D::IntVector3::ZERO),
+    bricks_size(Urho3D::IntVector3::ZERO)
+{
+}
+
+void BrickedWeightMap::resize(Urho3D::IntVector3 const& size, uint8_t value)
+{
+    this->size = size;
+    bricks_size = Urho3D::IntVector3(
+        (size.x_ + BRICK_WIDTH - 1) / BRICK_WIDTH,
+        (size.y_ + BRICK_WIDTH - 1) / BRICK_WIDTH,
+        (size.z_ + BRICK_WIDTH - 1) / BRICK_WIDTH
+    );
+
+    Brick brick;
+    brick.value = value;
+    bricks.Clear();
+    bricks.Resize(bricks_size.x_ * bricks_size.y_ * bricks_size.z_, brick);
+}
+
+uint8_t BrickedWeightMap::get(Urho3D::IntVector3 const& pos) const
+{
+    Brick const& brick = bricks[getBrickIndex(Urho3D::IntVector3(pos.x_ >> BRICK_WIDTH_BITS, pos.y_ >> BRICK_WIDTH_BITS, pos.z_ >> BRICK_WIDTH_BITS))];
+    if (!brick.data) {
+        return brick.value;
+    }
+    return brick.data[getOffsetInBrick(pos.x_, pos.y_, pos.z_)];
+}
+
+void BrickedWeightMap::set(Urho3D::IntVector3 const& pos, uint8_t value)
+{
+    Brick& brick = bricks[getBrickIndex(Urho3D::IntVector3(pos.x_ >> BRICK_WIDTH_BITS, pos.y_ >> BRICK_WIDTH_BITS, pos.z_ >> BRICK_WIDTH_BITS))];
+    if (!brick.data && brick.value == value) {
+        return;
+    }
+    getWritableData(brick)[getOffsetInBrick(pos.x_, pos.y_, pos.z_)] = value;
+}
+
+void BrickedWeightMap::getBlock(Urho3D::PODVector<unsigned char>& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, uint8_t outside_value) const
+{
+    Urho3D::IntVector3 result_size = end - begin;
+    result.Resize(result_size.x_ * result_size.y_ * result_size.z_);
+
+    // Part of the box that is inside the map
+    Urho3D::IntVector3 inside_begin(Urho3D::Max(0, begin.x_), Urho3D::Max(0, begin.y_), Urho3D::Max(0, begin.z_));
+    Urho3D::IntVector3 inside_end(Urho3D::Min(size.x_, end.x_), Urho3D::Min(size.y_, end.y_), Urho3D::Min(size.z_, end.z_));
+    if (inside_begin.x_ >= inside_end.x_ || inside_begin.y_ >= inside_end.y_ || inside_begin.z_ >= inside_end.z_) {
+        memset(result.Buffer(), outside_value, result.Size());
+        return;
+    }
+    if (inside_begin != begin || inside_end != end) {
+        memset(result.Buffer(), outside_value, result.Size());
+    }
+
+    // Go brick by brick, and copy rows of them
+    Urho3D::IntVector3 bricks_begin(inside_begin.x_ >> BRICK_WIDTH_BITS, inside_begin.y_ >> BRICK_WIDTH_BITS, inside_begin.z_ >> BRICK_WIDTH_BITS);
+    Urho3D::IntVector3 bricks_end(((inside_end.x_ - 1) >> BRICK_WIDTH_BITS) + 1, ((inside_end.y_ - 1) >> BRICK_WIDTH_BITS) + 1, ((inside_end.z_ - 1) >> BRICK_WIDTH_BITS) + 1);
+    Urho3D::IntVector3 brick_pos;
+    for (brick_pos.z_ = bricks_begin.z_; brick_pos.z_ < bricks_end.z_; ++ brick_pos.z_) {
+        int z_begin = Urho3D::Max<int>(inside_begin.z_, brick_pos.z_ * BRICK_WIDTH);
+        int z_end = Urho3D::Min<int>(inside_end.z_, (brick_pos.z_ + 1) * BRICK_WIDTH);
+        for (brick_pos.y_ = bricks_begin.y_; brick_pos.y_ < bricks_end.y_; ++ brick_pos.y_) {
+            int y_begin = Urho3D::Max<int>(inside_begin.y_, brick_pos.y_ * BRICK_WIDTH);
+            int y_end = Urho3D::Min<int>(inside_end.y_, (brick_pos.y_ + 1) * BRICK_WIDTH);
+            for (brick_pos.x_ = bricks_begin.x_; brick_pos.x_ < bricks_end.x_; ++ brick_pos.x_) {
+                int x_begin = Urho3D::Max<int>(inside_begin.x_, brick_pos.x_ * BRICK_WIDTH);
+                int x_end = Urho3D::Min<int>(inside_end.x_, (brick_pos.x_ + 1) * BRICK_WIDTH);
+                unsigned row_size = x_end - x_begin;
+
+                Brick const& brick = bricks[getBrickIndex(brick_pos)];
+                for (int z = z_begin; z < z_end; ++ z) {
+                    for (int y = y_begin; y < y_end; ++ y) {
+                        unsigned char* dest = &result[(x_begin - begin.x_) + (y - begin.y_) * result_size.x_ + (z - begin.z_) * result_size.x_ * result_size.y_];
+                        if (brick.data) {
+                            memcpy(dest, &brick.data[getOffsetInBrick(x_begin, y, z)], row_size);
+                        } else {
+                            memset(dest, brick.value, row_size);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void BrickedWeightMap::setBlock(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, unsigned char const* data)
+{
+    Urho3D::IntVector3 data_size = end - begin;
+
+    // Part of the box that is inside the map
+    Urho3D::IntVector3 inside_begin(Urho3D::Max(0, begin.x_), Urho3D::Max(0, begin.y_), Urho3D::Max(0, begin.z_));
+    Urho3D::IntVector3 inside_end(Urho3D::Min(size.x_, end.x_), Urho3D::Min(size.y_, end.y_), Urho3D::Min(size.z_, end.z_));
+    if (inside_begin.x_ >= inside_end.x_ || inside_begin.y_ >= inside_end.y_ || inside_begin.z_ >= inside_end.z_) {
+        return;
+    }
+
+    // Go brick by brick, and copy rows to them
+    Urho3D::IntVector3 bricks_begin(inside_begin.x_ >> BRICK_WIDTH_BITS, inside_begin.y_ >> BRICK_WIDTH_BITS, inside_begin.z_ >> BRICK_WIDTH_BITS);
+    Urho3D::IntVector3 bricks_end(((inside_end.x_ - 1) >> BRICK_WIDTH_BITS) + 1, ((inside_end.y_ - 1) >> BRICK_WIDTH_BITS) + 1, ((inside_end.z_ - 1) >> BRICK_WIDTH_BITS) + 1);
+    Urho3D::IntVector3 brick_pos;
+    for (brick_pos.z_ = bricks_begin.z_; brick_pos.z_ < bricks_end.z_; ++ brick_pos.z_) {
+        int z_begin = Urho3D::Max<int>(inside_begin.z_, brick_pos.z_ * BRICK_WIDTH);
+        int z_end = Urho3D::Min<int>(inside_end.z_, (brick_pos.z_ + 1) * BRICK_WIDTH);
+        for (brick_pos.y_ = bricks_begin.y_; brick_pos.y_ < bricks_end.y_; ++ brick_pos.y_) {
+            int y_begin = Urho3D::Max<int>(inside_begin.y_, brick_pos.y_ * BRICK_WIDTH);
+            int y_end = Urho3D::Min<int>(inside_end.y_, (brick_pos.y_ + 1) * BRICK_WIDTH);
+            for (brick_pos.x_ = bricks_begin.x_; brick_pos.x_ < bricks_end.x_; ++ brick_pos.x_) {
+                int x_begin = Urho3D::Max<int>(inside_begin.x_, brick_pos.x_ * BRICK_WIDTH);
+                int x_end = Urho3D::Min<int>(inside_end.x_, (brick_pos.x_ + 1) * BRICK_WIDTH);
+                unsigned row_size = x_end - x_begin;
+
+                uint8_t* brick_data = getWritableData(bricks[getBrickIndex(brick_pos)]);
+                for (int z = z_begin; z < z_end; ++ z) {
+                    for (int y = y_begin; y < y_end; ++ y) {
+                        unsigned char const* src = &data[(x_begin - begin.x_) + (y - begin.y_) * data_size.x_ + (z - begin.z_) * data_size.x_ * data_size.y_];
+                        memcpy(&brick_data[getOffsetInBrick(x_begin, y, z)], src, row_size);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void BrickedWeightMap::fill(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, uint8_t value)
+{
+    Urho3D::IntVector3 inside_begin(Urho3D::Max(0, begin.x_), Urho3D::Max(0, begin.y_), Urho3D::Max(0, begin.z_));
+    Urho3D::IntVector3 inside_end(Urho3D::Min(size.x_, end.x_), Urho3D::Min(size.y_, end.y_), Urho3D::Min(size.z_, end.z_));
+    if (inside_begin.x_ >= inside_end.x_ || inside_begin.y_ >= inside_end.y_ || inside_begin.z_ >= inside_end.z_) {
+        return;
+    }
+
+    Urho3D::IntVector3 bricks_begin(inside_begin.x_ >> BRICK_WIDTH_BITS, inside_begin.y_ >> BRICK_WIDTH_BITS, inside_begin.z_ >> BRICK_WIDTH_BITS);
+    Urho3D::IntVector3 bricks_end(((inside_end.x_ - 1) >> BRICK_WIDTH_BITS) + 1, ((inside_end.y_ - 1) >> BRICK_WIDTH_BITS) + 1, ((inside_end.z_ - 1) >> BRICK_WIDTH_BITS) + 1);
+    Urho3D::IntVector3 brick_pos;
+    for (brick_pos.z_ = bricks_begin.z_; brick_pos.z_ < bricks_end.z_; ++ brick_pos.z_) {
+        for (brick_pos.y_ = bricks_begin.y_; brick_pos.y_ < bricks_end.y_; ++ brick_pos.y_) {
+            for (brick_pos.x_ = bricks_begin.x_; brick_pos.x_ < bricks_end.x_; ++ brick_pos.x_) {
+                Urho3D::IntVector3 brick_begin = brick_pos * BRICK_WIDTH;
+                Urho3D::IntVector3 brick_end = brick_begin + getBrickUsedSize(brick_pos);
+                Urho3D::IntVector3 fill_begin(Urho3D::Max(inside_begin.x_, brick_begin.x_), Urho3D::Max(inside_begin.y_, brick_begin.y_), Urho3D::Max(inside_begin.z_, brick_begin.z_));
+                Urho3D::IntVector3 fill_end(Urho3D::Min(inside_end.x_, brick_end.x_), Urho3D::Min(inside_end.y_, brick_end.y_), Urho3D::Min(inside_end.z_, brick_end.z_));
+
+                // If the whole brick is covered, then it becomes uniform
+                Brick& brick = bricks[getBrickIndex(brick_pos)];
+                if (fill_begin == brick_begin && fill_end == brick_end) {
+                    brick.data.Reset();
+                    brick.value = value;
+                    continue;
+                }
+
+                uint8_t* brick_data = getWritableData(brick);
+                for (int z = fill_begin.z_; z < fill_end.z_; ++ z) {
+                    for (int y = fill_begin.y_; y < fill_end.y_; ++ y) {
+                        memset(&brick_data[getOffsetInBrick(fill_begin.x_, y, z)], value, fill_end.x_ - fill_begin.x_);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void BrickedWeightMap::getDense(Urho3D::PODVector<unsigned char>& result) const
+{
+    getBlock(result, Urho3D::IntVector3::ZERO, size, 0);
+}
+
+void BrickedWeightMap::setDense(unsigned char const* data)
+{
+    Urho3D::IntVector3 brick_pos;
+    for (brick_pos.z_ = 0; brick_pos.z_ < bricks_size.z_; ++ brick_pos.z_) {
+        for (brick_pos.y_ = 0; brick_pos.y_ < bricks_size.y_; ++ brick_pos.y_) {
+            for (brick_pos.x_ = 0; brick_pos.x_ < bricks_size.x_; ++ brick_pos.x_) {
+                Brick& brick = bricks[getBrickIndex(brick_pos)];
+                Urho3D::IntVector3 used_size = getBrickUsedSize(brick_pos);
+                Urho3D::IntVector3 origin = brick_pos * BRICK_WIDTH;
+
+                // Check if brick is uniform, and if not, then copy its data
+                uint8_t value = data[origin.x_ + origin.y_ * size.x_ + origin.z_ * size.x_ * size.y_];
+                bool uniform = true;
+                for (int z = 0; z < used_size.z_ && uniform; ++ z) {
+                    for (int y = 0; y < used_size.y_ && uniform; ++ y) {
+                        unsigned char const* row = &data[origin.x_ + (origin.y_ + y) * size.x_ + (origin.z_ + z) * size.x_ * size.y_];
+                        for (int x = 0; x < used_size.x_; ++ x) {
+                            if (row[x] != value) {
+                                uniform = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+                if (uniform) {
+                    brick.data.Reset();
+                    brick.value = value;
+                    continue;
+                }
+
+                brick.data = Urho3D::SharedArrayPtr<uint8_t>(new uint8_t[BRICK_VOLUME]);
+                memset(brick.data.Get(), 0, BRICK_VOLUME);
+                for (int z = 0; z < used_size.z_; ++ z) {
+                    for (int y = 0; y < used_size.y_; ++ y) {
+                        unsigned char const* row = &data[origin.x_ + (origin.y_ + y) * size.x_ + (origin.z_ + z) * size.x_ * size.y_];
+                        memcpy(&brick.data[getOffsetInBrick(0, y, z)], row, used_size.x_);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void BrickedWeightMap::compact(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end)
+{
+    Urho3D::IntVector3 bricks_begin(
+        Urho3D::Max(0, begin.x_ >> BRICK_WIDTH_BITS),
+        Urho3D::Max(0, begin.y_ >> BRICK_WIDTH_BITS),
+        Urho3D::Max(0, begin.z_ >> BRICK_WIDTH_BITS)
+    );
+    Urho3D::IntVector3 bricks_end(
+        Urho3D::Min(bricks_size.x_, ((end.x_ - 1) >> BRICK_WIDTH_BITS) + 1),
+        Urho3D::Min(bricks_size.y_, ((end.y_ - 1) >> BRICK_WIDTH_BITS) + 1),
+        Urho3D::Min(bricks_size.z_, ((end.z_ - 1) >> BRICK_WIDTH_BITS) + 1)
+    );
+    Urho3D::IntVector3 brick_pos;
+    for (brick_pos.z_ = bricks_begin.z_; brick_pos.z_ < bricks_end.z_; ++ brick_pos.z_) {
+        for (brick_pos.y_ = bricks_begin.y_; brick_pos.y_ < bricks_end.y_; ++ brick_pos.y_) {
+            for (brick_pos.x_ = bricks_begin.x_; brick_pos.x_ < bricks_end.x_; ++ brick_pos.x_) {
+                Brick& brick = bricks[getBrickIndex(brick_pos)];
+                if (!brick.data) {
+                    continue;
+                }
+                // Only the used part of brick matters
+                Urho3D::IntVector3 used_size = getBrickUsedSize(brick_pos);
+                uint8_t value = brick.data[0];
+                bool uniform = true;
+                for (int z = 0; z < used_size.z_ && uniform; ++ z) {
+                    for (int y = 0; y < used_size.y_ && uniform; ++ y) {
+                        uint8_t const* row = &brick.data[getOffsetInBrick(0, y, z)];
+                        for (int x = 0; x < used_size.x_; ++ x) {
+                            if (row[x] != value) {
+                                uniform = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+                if (uniform) {
+                    brick.data.Reset();
+                    brick.value = value;
+                }
+            }
+        }
+    }
+}
+
+unsigned BrickedWeightMap::getAllocatedBricksCount() const
+{
+    unsigned result = 0;
+    for (Brick const& brick : bricks) {
+        if (brick.data) {
+            ++ result;
+        }
+    }
+    return result;
+}
+
+uint8_t* BrickedWeightMap::getWritableData(Brick& brick)
+{
+    // Uniform brick
+    if (!brick.data) {
+        brick.data = Urho3D::SharedArrayPtr<uint8_t>(new uint8_t[BRICK_VOLUME]);
+        memset(brick.data.Get(), brick.value, BRICK_VOLUME);
+    }
+    // Brick that is shared with some other map
+    else if (brick.data.Refs() > 1) {
+        Urho3D::SharedArrayPtr<uint8_t> data_copy(new uint8_t[BRICK_VOLUME]);
+        memcpy(data_copy.Get(), brick.data.Get(), BRICK_VOLUME);
+        brick.data = data_copy;
+    }
+    return brick.data.Get();
+}
+
+Urho3D::IntVector3 BrickedWeightMap::getBrickUsedSize(Urho3D::IntVector3 const& brick_pos) const
+{
+    return Urho3D::IntVector3(
+        Urho3D::Min<int>(BRICK_WIDTH, size.x_ - brick_pos.x_ * BRICK_WIDTH),
+        Urho3D::Min<int>(BRICK_WIDTH, size.y_ - brick_pos.y_ * BRICK_WIDTH),
+        Urho3D::Min<int>(BRICK_WIDTH, size.z_ - brick_pos.z_ * BRICK_WIDTH)
+    );
+}
+
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef URHOEXTRAS_GRAPHICS_BRICKEDWEIGHTMAP_HPP
+#define URHOEXTRAS_GRAPHICS_BRICKEDWEIGHTMAP_HPP
+
+#include <Urho3D/Container/ArrayPtr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+namespace UrhoExtras
+{
+
+namespace Graphics
+{
+
+// Three dimensional map of weights that is stored as small cubic bricks.
+// Bricks that have the same value everywhere are stored as a single value.
+// Brick data is shared between copies and only copied when modified, so
+// copying the whole map is cheap.
+class BrickedWeightMap
+{
+
+public:
+
+    static unsigned const BRICK_WIDTH_BITS = 3;
+    static unsigned const BRICK_WIDTH = 1 << BRICK_WIDTH_BITS;
+    static unsigned const BRICK_VOLUME = BRICK_WIDTH * BRICK_WIDTH * BRICK_WIDTH;
+
+    BrickedWeightMap();
+
+    // Resets the whole map to given value
+    void resize(Urho3D::IntVector3 const& size, uint8_t value);
+
+    inline Urho3D::IntVector3 getSize() const { return size; }
+
+    // Position must be inside the map
+    uint8_t get(Urho3D::IntVector3 const& pos) const;
+    void set(Urho3D::IntVector3 const& pos, uint8_t value);
+
+    // Copies box [begin, end) to a dense array where X changes fastest.
+    // Parts of the box that are outside the map are set to "outside_value".
+    void getBlock(Urho3D::PODVector<unsigned char>& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, uint8_t outside_value) const;
+    // Opposite of getBlock(). Parts outside the map are ignored.
+    void setBlock(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, unsigned char const* data);
+
+    // Sets every point in box [begin, end) to the value. Bricks that
+    // are fully inside the box become uniform and free their data.
+    void fill(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, uint8_t value);
+
+    // Dense data is the whole map in same order as in getBlock().
+    void getDense(Urho3D::PODVector<unsigned char>& result) const;
+    void setDense(unsigned char const* data);
+
+    // Frees the data of those bricks in box [begin, end) that have become uniform
+    void compact(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end);
+
+    unsigned getAllocatedBricksCount() const;
+
+private:
+
+    struct Brick
+    {
+        // If null, then every point in brick has "value"
+        Urho3D::SharedArrayPtr<uint8_t> data;
+        uint8_t value;
+    };
+    typedef Urho3D::Vector<Brick> Bricks;
+
+    Urho3D::IntVector3 size;
+    Urho3D::IntVector3 bricks_size;
+    Bricks bricks;
+
+    inline unsigned getBrickIndex(Urho3D::IntVector3 const& brick_pos) const
+    {
+        return brick_pos.x_ + brick_pos.y_ * bricks_size.x_ + brick_pos.z_ * bricks_size.x_ * bricks_size.y_;
+    }
+
+    static inline unsigned getOffsetInBrick(int x, int y, int z)
+    {
+        unsigned const mask = BRICK_WIDTH - 1;
+        return (x & mask) + ((y & mask) << BRICK_WIDTH_BITS) + ((z & mask) << (BRICK_WIDTH_BITS * 2));
+    }
+
+    // Makes sure brick has its own data that can be modified
+    static uint8_t* getWritableData(Brick& brick);
+
+    // Returns the part of brick that is inside the map. Bricks at the far
+    // edges of the map might be only partially used.
+    Urho3D::IntVector3 getBrickUsedSize(Urho3D::IntVector3 const& brick_pos) const;
+};
+
+}
+
+}
+
+#endif
@@ -1,6 +1,11 @@
 #include "marchingcubes.hpp"
 
+#include "../collisions/capsule.hpp"
+
 #include <Urho3D/Core/Context.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Graphics/Renderer.h>
+#include <Urho3D/Graphics/Viewport.h>
 #include <Urho3D/IO/Compression.h>
 #include <Urho3D/IO/Log.h>
 #include <Urho3D/IO/MemoryBuffer.h>
@@ -8,13 +13,60 @@
 #include <Urho3D/Resource/ResourceCache.h>
 #include <Urho3D/Scene/Node.h>
 #include <Urho3D/Scene/ReplicationState.h>
+#include <Urho3D/Scene/Scene.h>
+#include <Urho3D/Scene/SceneEvents.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__AVX2__)
+#define URHOEXTRAS_MARCHINGCUBES_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define URHOEXTRAS_MARCHINGCUBES_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 float const DEFAULT_CUBE_WIDTH = 0.1;
 unsigned const DEFAULT_CHUNK_WIDTH = 10;
 Urho3D::IntVector3 const DEFAULT_CHUNKS_SIZE(10, 10, 10);
 
-float const MERGE_VERTEX_THRESHOLD = 0.001;
-float const MERGE_VERTEX_THRESHOLD_TO_2 = MERGE_VERTEX_THRESHOLD * MERGE_VERTEX_THRESHOLD;
+// When compressed chunks that have changed after the network base
+// take more than this many bytes, a new base is sent instead.
+unsigned const NETWORK_DELTA_MAX_SIZE = 32 * 1024;
+
+// When rebuilding with a budget, chunks that are not visible are treated
+// as if they were this many times farther. Every second of waiting moves
+// a chunk this many chunk widths closer.
+float const REBUILD_INVISIBLE_DISTANCE_MULTIPLIER = 4;
+float const REBUILD_AGE_CHUNKS_PER_SECOND = 2;
+
+// Every level of detail halves the resolution
+unsigned const MAX_LOD = 3;
+// How far past the limit distance must go before the level of detail is changed
+float const LOD_HYSTERESIS = 0.1;
+
+// Points at least this heavy are solid, so the surface is between this and the previous weight
+float const SURFACE_WEIGHT = 127.5;
+// Raycasts sample every cube a few times, and then find the exact hit by halving the range
+unsigned const RAYCAST_CUBE_SAMPLES = 4;
+unsigned const RAYCAST_REFINE_STEPS = 10;
+
+// Volume file has a header, then an index of all chunks, and then compressed chunks and meshes
+char const* const VOLUME_FILE_ID = "MCVF";
+unsigned const VOLUME_VERSION = 2;
+unsigned const VOLUME_HEADER_SIZE = 4 + 4 + 12 + 4 + 4 + 1 + 1;
+unsigned const VOLUME_INDEX_ENTRY_SIZE = 4 + 4 + 4 + 1 + 4 + 4 + 4 + 4;
+// Enough for all chunks around a query at the corner of a chunk, for both points and materials
+unsigned const DECODED_VOLUME_CHUNKS_CACHE_SIZE = 16;
+
+float const WELD_VERTEX_THRESHOLD = 0.0001;
+// Cells are a little bigger than the threshold, so vertices
+// that can be welded are never more than one cell apart.
+float const WELD_VERTEX_CELL_WIDTH = WELD_VERTEX_THRESHOLD * 2;
 
 namespace UrhoExtras
 {
@@ -86,11 +138,27 @@ MarchingCubes::MarchingCubes(Urho3D::Context* context) :
     cube_width(DEFAULT_CUBE_WIDTH),
     chunk_width(DEFAULT_CHUNK_WIDTH),
     chunks_size(DEFAULT_CHUNKS_SIZE),
-    mat(nullptr),
     some_chunks_dirty(false),
-    all_chunks_dirty(true)
+    all_chunks_dirty(true),
+    background_rebuilding(false),
+    rebuild_budget(0),
+    region_width(0),
+    lod_distance(0),
+    compact_vertices(false),
+    keep_collision_triangles(false),
+    network_base_dirty(true),
+    volume_file_begin(0),
+    decoded_volume_chunks_use_counter(0),
+    volume_cube_width(0),
+    volume_meshes_skirts(false),
+    volume_meshes_compact(false),
+    streaming_radius(0)
 {
-    wmap.Resize(chunks_size.x_ * chunks_size.y_ * chunks_size.z_ * chunk_width * chunk_width * chunk_width, 0);
+    mats.Push(nullptr);
+    wmap.resize(chunks_size * chunk_width, 0);
+    point_materials.resize(chunks_size * chunk_width, 0);
+    updateChunksSolidCounts();
+    resetChunksVersions();
 }
 
 float MarchingCubes::getCubeWidth() const
@@ -117,7 +185,72 @@ uint8_t MarchingCubes::getPoint(Urho3D::IntVector3 const& pos) const
         URHO3D_LOGWARNING("Trying to get point outside the marching cubes region!");
         return 0xff;
     }
-    return wmap[pos.x_ + pos.y_ * total_size.x_ + pos.z_ * total_size.x_ * total_size.y_];
+
+    // Point might be only in the volume file
+    unsigned chunk_i = getChunkIndex(pos / chunk_width);
+    if (volume_file && !volume_chunks[chunk_i].resident) {
+        WeightMap const& chunk_wmap = getDecodedVolumeChunk(chunk_i, false);
+        Urho3D::IntVector3 pos_in_chunk = pos - getChunkPosition(chunk_i) * chunk_width;
+        return chunk_wmap[pos_in_chunk.x_ + (pos_in_chunk.y_ + pos_in_chunk.z_ * chunk_width) * chunk_width];
+    }
+
+    return wmap.get(pos);
+}
+
+uint8_t MarchingCubes::getPointMaterial(Urho3D::IntVector3 const& pos) const
+{
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    if (pos.x_ < 0 || pos.x_ >= total_size.x_ ||
+        pos.y_ < 0 || pos.y_ >= total_size.y_ ||
+        pos.z_ < 0 || pos.z_ >= total_size.z_) {
+        URHO3D_LOGWARNING("Trying to get point material outside the marching cubes region!");
+        return 0;
+    }
+
+    // Point might be only in the volume file
+    unsigned chunk_i = getChunkIndex(pos / chunk_width);
+    if (volume_file && !volume_chunks[chunk_i].resident) {
+        WeightMap const& chunk_materials = getDecodedVolumeChunk(chunk_i, true);
+        Urho3D::IntVector3 pos_in_chunk = pos - getChunkPosition(chunk_i) * chunk_width;
+        return chunk_materials[pos_in_chunk.x_ + (pos_in_chunk.y_ + pos_in_chunk.z_ * chunk_width) * chunk_width];
+    }
+
+    return point_materials.get(pos);
+}
+
+bool MarchingCubes::isBackgroundRebuilding() const
+{
+    return background_rebuilding;
+}
+
+float MarchingCubes::getRebuildBudget() const
+{
+    return rebuild_budget;
+}
+
+unsigned MarchingCubes::getRegionWidth() const
+{
+    return region_width;
+}
+
+float MarchingCubes::getLodDistance() const
+{
+    return lod_distance;
+}
+
+bool MarchingCubes::getCompactVertices() const
+{
+    return compact_vertices;
+}
+
+MarchingCubesMeshCache* MarchingCubes::getMeshCache() const
+{
+    return mesh_cache;
+}
+
+bool MarchingCubes::getKeepCollisionTriangles() const
+{
+    return keep_collision_triangles;
 }
 
 void MarchingCubes::setCubeWidth(float width)
@@ -135,7 +268,11 @@ void MarchingCubes::setChunkWidth(unsigned width)
 {
     if (chunk_width != width) {
         chunk_width = width;
-        wmap.Resize(chunks_size.x_ * chunks_size.y_ * chunks_size.z_ * chunk_width * chunk_width * chunk_width, 0);
+        closeVolume();
+        wmap.resize(chunks_size * chunk_width, 0);
+        point_materials.resize(chunks_size * chunk_width, 0);
+        updateChunksSolidCounts();
+        resetChunksVersions();
         all_chunks_dirty = true;
 // TODO: Try not to rebuild immediately!
         rebuildChunksIfNeeded();
@@ -147,7 +284,11 @@ void MarchingCubes::setChunksSize(Urho3D::IntVector3 const& size)
 {
     if (chunks_size != size) {
         chunks_size = size;
-        wmap.Resize(chunks_size.x_ * chunks_size.y_ * chunks_size.z_ * chunk_width * chunk_width * chunk_width, 0);
+        closeVolume();
+        wmap.resize(chunks_size * chunk_width, 0);
+        point_materials.resize(chunks_size * chunk_width, 0);
+        updateChunksSolidCounts();
+        resetChunksVersions();
         all_chunks_dirty = true;
 // TODO: Try not to rebuild immediately!
         rebuildChunksIfNeeded();
@@ -157,1131 +298,2609 @@ void MarchingCubes::setChunksSize(Urho3D::IntVector3 const& size)
 
 void MarchingCubes::setMaterial(Urho3D::Material* mat)
 {
-    if (this->mat != mat) {
-        this->mat = mat;
+    setMaterial(0, mat);
+}
 
-        // Set material to chunks
-        for (auto i = chunks.Begin(); i != chunks.End(); ++ i) {
-            i->second_->setMaterial(mat);
-        }
+void MarchingCubes::setMaterial(unsigned material_i, Urho3D::Material* mat)
+{
+    if (material_i < mats.Size() && mats[material_i] == mat) {
+        return;
+    }
+    if (material_i >= mats.Size()) {
+        mats.Resize(material_i + 1, nullptr);
+    }
+    mats[material_i] = mat;
 
-        MarkNetworkUpdate();
+    // Set materials to chunks
+    for (auto i = chunks.Begin(); i != chunks.End(); ++ i) {
+        i->second_->setMaterials(mats);
     }
+
+    MarkNetworkUpdate();
 }
 
 void MarchingCubes::setPoint(Urho3D::IntVector3 const& pos, uint8_t value)
 {
-    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    pageInPoints(pos, pos + Urho3D::IntVector3::ONE);
+
+    uint8_t old_value = wmap.get(pos);
+    if (old_value == value) {
+        return;
+    }
+
+    onPointChanged(pos, old_value, value);
+    wmap.set(pos, value);
+
+    // Mark dirty all chunks that use this point
+    Urho3D::IntVector3 chunks_begin;
+    Urho3D::IntVector3 chunks_end;
+    getChunksUsingPoint(chunks_begin, chunks_end, pos);
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = chunks_begin.z_; chunk_pos.z_ < chunks_end.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+                markChunkDirty(chunk_pos);
+            }
+        }
+    }
 
-    wmap[pos.x_ + pos.y_ * total_size.x_ + pos.z_ * total_size.x_ * total_size.y_] = value;
-// TODO: Only invalidate some of the chunks!
-    all_chunks_dirty = true;
     MarkNetworkUpdate();
 }
 
-void MarchingCubes::registerObject(Urho3D::Context* context)
+void MarchingCubes::setPointMaterial(Urho3D::IntVector3 const& pos, uint8_t material)
 {
-    context->RegisterFactory<MarchingCubes>();
-    context->RegisterFactory<MarchingCubesChunk>();
+    pageInPoints(pos, pos + Urho3D::IntVector3::ONE);
 
-    URHO3D_ATTRIBUTE("Cube width", float, cube_width, DEFAULT_CUBE_WIDTH, Urho3D::AM_DEFAULT);
-    URHO3D_ATTRIBUTE("Chunk width", unsigned, chunk_width, DEFAULT_CHUNK_WIDTH, Urho3D::AM_DEFAULT);
-    URHO3D_ATTRIBUTE("Size in chunks", Urho3D::IntVector3, chunks_size, DEFAULT_CHUNKS_SIZE, Urho3D::AM_DEFAULT);
-    URHO3D_ACCESSOR_ATTRIBUTE("Weightmap", getWeightmapAttr, setWeightmapAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_DEFAULT);
-    URHO3D_ACCESSOR_ATTRIBUTE("Material", getMaterialAttr, setMaterialAttr, Urho3D::ResourceRef, Urho3D::ResourceRef(Urho3D::Material::GetTypeStatic()), Urho3D::AM_DEFAULT);
-    URHO3D_COPY_BASE_ATTRIBUTES(Urho3D::Drawable);
-}
+    if (point_materials.get(pos) == material) {
+        return;
+    }
 
-void MarchingCubes::ApplyAttributes()
-{
-    rebuildChunksIfNeeded();
+    ++ chunks_versions[getChunkIndex(pos / chunk_width)];
+    point_materials.set(pos, material);
+
+    // Mark dirty all chunks that use this point
+    Urho3D::IntVector3 chunks_begin;
+    Urho3D::IntVector3 chunks_end;
+    getChunksUsingPoint(chunks_begin, chunks_end, pos);
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = chunks_begin.z_; chunk_pos.z_ < chunks_end.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+                markChunkDirty(chunk_pos);
+            }
+        }
+    }
+
+    MarkNetworkUpdate();
 }
 
-void MarchingCubes::rebuildChunksIfNeeded()
+void MarchingCubes::applyBrush(MarchingCubesBrush const& brush, BrushMode mode, float strength, uint8_t material)
 {
-    if (!some_chunks_dirty && !all_chunks_dirty) return;
-
-    if (!node_) {
-        some_chunks_dirty = false;
-        all_chunks_dirty = false;
+    // Get the range of points that brush might affect. Weights
+    // change gradually, so include one extra point on each side.
+    Urho3D::BoundingBox bb = brush.getBoundingBox();
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    Urho3D::IntVector3 begin(
+        Urho3D::Max(0, Urho3D::FloorToInt(bb.min_.x_ / cube_width) - 1),
+        Urho3D::Max(0, Urho3D::FloorToInt(bb.min_.y_ / cube_width) - 1),
+        Urho3D::Max(0, Urho3D::FloorToInt(bb.min_.z_ / cube_width) - 1)
+    );
+    Urho3D::IntVector3 end(
+        Urho3D::Min(total_size.x_, Urho3D::CeilToInt(bb.max_.x_ / cube_width) + 2),
+        Urho3D::Min(total_size.y_, Urho3D::CeilToInt(bb.max_.y_ / cube_width) + 2),
+        Urho3D::Min(total_size.z_, Urho3D::CeilToInt(bb.max_.z_ / cube_width) + 2)
+    );
+    if (begin.x_ >= end.x_ || begin.y_ >= end.y_ || begin.z_ >= end.z_) {
         return;
     }
 
-    // Build chunks
-    WeightMap chunk_wmap;
-    Urho3D::IntVector3 chunk_pos;
-    for (chunk_pos.z_ = 0; chunk_pos.z_ < chunks_size.z_; ++ chunk_pos.z_) {
-        for (chunk_pos.y_ = 0; chunk_pos.y_ < chunks_size.y_; ++ chunk_pos.y_) {
-            for (chunk_pos.x_ = 0; chunk_pos.x_ < chunks_size.x_; ++ chunk_pos.x_) {
-                // Get or create chunk and chunk node
-                Urho3D::Node* chunk_node = nullptr;
-                MarchingCubesChunk* chunk = nullptr;
-                bool new_node = false;
-                auto chunks_find = chunks.Find(chunk_pos);
-                if (chunks_find != chunks.End()) {
-                    chunk = chunks_find->second_;
-                    chunk_node = chunk->GetNode();
+    // Read the old weights. Smoothing needs neighbors, so include them too.
+    WeightMap block;
+    getPoints(block, begin - Urho3D::IntVector3::ONE, end + Urho3D::IntVector3::ONE);
+    pageInPoints(begin, end);
+    Urho3D::IntVector3 block_size = end - begin + Urho3D::IntVector3::ONE * 2;
+    int const block_ofs_y = block_size.x_;
+    int const block_ofs_z = block_size.x_ * block_size.y_;
+
+    // Keep track of what chunks are affected
+    Urho3D::IntVector3 affected_begin;
+    Urho3D::IntVector3 affected_end;
+    Urho3D::IntVector3 unused;
+    getChunksUsingPoint(affected_begin, unused, begin);
+    getChunksUsingPoint(unused, affected_end, end - Urho3D::IntVector3::ONE);
+    Urho3D::IntVector3 affected_size = affected_end - affected_begin;
+    Urho3D::PODVector<bool> affected;
+    affected.Resize(affected_size.x_ * affected_size.y_ * affected_size.z_, false);
+
+    Urho3D::IntVector3 pos;
+    for (pos.z_ = begin.z_; pos.z_ < end.z_; ++ pos.z_) {
+        for (pos.y_ = begin.y_; pos.y_ < end.y_; ++ pos.y_) {
+            for (pos.x_ = begin.x_; pos.x_ < end.x_; ++ pos.x_) {
+                int block_ofs = (pos.x_ - begin.x_ + 1) + (pos.y_ - begin.y_ + 1) * block_ofs_y + (pos.z_ - begin.z_ + 1) * block_ofs_z;
+                uint8_t old_value = block[block_ofs];
+
+                // Convert distance to weight of the shape. Weight goes from
+                // empty to solid during one cube width around the surface.
+                float distance = brush.getDistance(Urho3D::Vector3(pos.x_, pos.y_, pos.z_) * cube_width);
+                float shape_weight = Urho3D::Clamp(0.5f - distance / cube_width, 0.0f, 1.0f);
+
+                float target;
+                if (mode == BRUSH_ADD) {
+                    target = Urho3D::Max<float>(old_value, shape_weight * 255);
+                } else if (mode == BRUSH_SUBTRACT) {
+                    target = Urho3D::Min<float>(old_value, (1 - shape_weight) * 255);
+                } else if (mode == BRUSH_PAINT) {
+                    target = old_value;
+                } else {
+                    if (shape_weight <= 0) {
+                        continue;
+                    }
+                    float average = (
+                        block[block_ofs - 1] + block[block_ofs + 1] +
+                        block[block_ofs - block_ofs_y] + block[block_ofs + block_ofs_y] +
+                        block[block_ofs - block_ofs_z] + block[block_ofs + block_ofs_z]
+                    ) / 6.0f;
+                    target = Urho3D::Lerp<float>(old_value, average, shape_weight);
+                }
+                uint8_t new_value = Urho3D::Clamp(Urho3D::RoundToInt(Urho3D::Lerp<float>(old_value, target, strength)), 0, 255);
+                bool paint;
+                if (mode == BRUSH_PAINT) {
+                    paint = shape_weight >= 0.5f;
                 } else {
-                    new_node = true;
-                    // Create child as local and temporary, so it won't be serialized to network nor to disk.
-                    chunk_node = node_->CreateTemporaryChild(Urho3D::String::EMPTY, Urho3D::LOCAL);
-                    // Create the actual Chunk
-                    chunk = chunk_node->CreateComponent<MarchingCubesChunk>();
-                    chunk->setMaterial(mat);
-                    chunks[chunk_pos] = chunk;
+                    paint = mode == BRUSH_ADD && new_value > old_value;
+                }
+                paint = paint && point_materials.get(pos) != material;
+                if (new_value == old_value && !paint) {
+                    continue;
                 }
 
-                // Set position, if needed
-                if (new_node || all_chunks_dirty) {
-                    chunk_node->SetPosition(Urho3D::Vector3(
-                        chunk_pos.x_ * chunk_width * cube_width,
-                        chunk_pos.y_ * chunk_width * cube_width,
-                        chunk_pos.z_ * chunk_width * cube_width
-                    ));
+                onPointChanged(pos, old_value, new_value);
+                wmap.set(pos, new_value);
+                if (paint) {
+                    point_materials.set(pos, material);
                 }
 
-                if (all_chunks_dirty || chunk->isRebuildNeeded()) {
-                    // Get a chunk of data from weightmap. This is a little bit more than
-                    // the chunk volume, because it needs neighbor cubes for smooth surface.
-                    Urho3D::IntVector3 begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE;
-                    Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * (chunk_width + 3);
-                    getWeightMapChunk(chunk_wmap, begin, end, wmap);
+                // Mark chunks that use this point
+                Urho3D::IntVector3 chunks_begin;
+                Urho3D::IntVector3 chunks_end;
+                getChunksUsingPoint(chunks_begin, chunks_end, pos);
+                Urho3D::IntVector3 chunk_pos;
+                for (chunk_pos.z_ = chunks_begin.z_; chunk_pos.z_ < chunks_end.z_; ++ chunk_pos.z_) {
+                    for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+                        for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+                            Urho3D::IntVector3 affected_pos = chunk_pos - affected_begin;
+                            affected[affected_pos.x_ + affected_pos.y_ * affected_size.x_ + affected_pos.z_ * affected_size.x_ * affected_size.y_] = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
 
-                    // Do the rebuilding
-                    chunk->rebuild(chunk_wmap, chunk_width, cube_width);
+    // Mark affected chunks dirty
+    bool changed = false;
+    Urho3D::IntVector3 affected_pos;
+    for (affected_pos.z_ = 0; affected_pos.z_ < affected_size.z_; ++ affected_pos.z_) {
+        for (affected_pos.y_ = 0; affected_pos.y_ < affected_size.y_; ++ affected_pos.y_) {
+            for (affected_pos.x_ = 0; affected_pos.x_ < affected_size.x_; ++ affected_pos.x_) {
+                if (affected[affected_pos.x_ + affected_pos.y_ * affected_size.x_ + affected_pos.z_ * affected_size.x_ * affected_size.y_]) {
+                    markChunkDirty(affected_begin + affected_pos);
+                    changed = true;
                 }
             }
         }
     }
 
-    some_chunks_dirty = false;
-    all_chunks_dirty = false;
+    if (changed) {
+        MarkNetworkUpdate();
+    }
 }
 
-Urho3D::PODVector<unsigned char> MarchingCubes::getWeightmapAttr() const
+bool MarchingCubes::raycast(RaycastResult& result, Urho3D::Ray const& ray, float max_distance) const
 {
-    Urho3D::MemoryBuffer wmap_buf(wmap);
-    Urho3D::VectorBuffer wmap_compressed_vbuf;
-    if (!Urho3D::CompressStream(wmap_compressed_vbuf, wmap_buf)) {
-        throw std::runtime_error("Unable to compress MarchingCubes.wmap for attribute serialization!");
+    // Work in units of cube width, so points are at integer positions
+    Urho3D::Vector3 origin = ray.origin_ / cube_width;
+    Urho3D::Vector3 const& dir = ray.direction_;
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    float t_min = 0;
+    float t_max = max_distance / cube_width;
+    if (!clipRay(t_min, t_max, origin, dir, Urho3D::Vector3::ZERO, Urho3D::Vector3(total_size.x_ - 1, total_size.y_ - 1, total_size.z_ - 1))) {
+        return false;
     }
-    return wmap_compressed_vbuf.GetBuffer();
+
+    // Go through chunks, and skip those that have no solid points
+    Urho3D::IntVector3 cubes_end = total_size - Urho3D::IntVector3::ONE;
+    Urho3D::IntVector3 block_size = Urho3D::IntVector3::ONE * (chunk_width + 3);
+    WeightMap block;
+    uint8_t corners[8];
+    GridWalk chunk_walk(origin, dir, t_min, chunk_width, Urho3D::IntVector3::ZERO, chunks_size);
+    do {
+        float t_chunk_end = Urho3D::Min(chunk_walk.getCellEnd(), t_max);
+        Urho3D::IntVector3 chunk_pos(chunk_walk.cell[0], chunk_walk.cell[1], chunk_walk.cell[2]);
+
+        // Cubes of a chunk use the points of the next chunks too
+        if (!areChunksEmpty(chunk_pos, chunk_pos + Urho3D::IntVector3::ONE * 2)) {
+            // Read the points of chunk, and their neighbors for normals
+            Urho3D::IntVector3 block_begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE;
+            getPoints(block, block_begin, block_begin + block_size);
+
+            Urho3D::IntVector3 chunk_cubes_begin = chunk_pos * chunk_width;
+            Urho3D::IntVector3 chunk_cubes_end(
+                Urho3D::Min<int>(chunk_cubes_begin.x_ + chunk_width, cubes_end.x_),
+                Urho3D::Min<int>(chunk_cubes_begin.y_ + chunk_width, cubes_end.y_),
+                Urho3D::Min<int>(chunk_cubes_begin.z_ + chunk_width, cubes_end.z_)
+            );
+            GridWalk cube_walk(origin, dir, chunk_walk.t, 1, chunk_cubes_begin, chunk_cubes_end);
+            do {
+                float t_cube_end = Urho3D::Min(cube_walk.getCellEnd(), t_chunk_end);
+                Urho3D::IntVector3 cube_pos(cube_walk.cell[0], cube_walk.cell[1], cube_walk.cell[2]);
+                Urho3D::IntVector3 cube_pos_in_block = cube_pos - block_begin;
+                for (unsigned corner_i = 0; corner_i < 8; ++ corner_i) {
+                    int x = cube_pos_in_block.x_ + (corner_i & 1);
+                    int y = cube_pos_in_block.y_ + ((corner_i >> 1) & 1);
+                    int z = cube_pos_in_block.z_ + (corner_i >> 2);
+                    corners[corner_i] = block[x + (y + z * block_size.y_) * block_size.x_];
+                }
+
+                float t_hit;
+                if (raycastCube(t_hit, corners, origin - Urho3D::Vector3(cube_pos.x_, cube_pos.y_, cube_pos.z_), dir, cube_walk.t, t_cube_end)) {
+                    Urho3D::Vector3 hit_pos = origin + dir * t_hit;
+                    result.pos = hit_pos * cube_width;
+                    result.normal = getBlockNormal(block, block_begin, block_size, hit_pos);
+                    if (result.normal == Urho3D::Vector3::ZERO) {
+                        result.normal = -dir;
+                    }
+                    result.distance = t_hit * cube_width;
+                    return true;
+                }
+
+                if (t_cube_end >= t_chunk_end) {
+                    break;
+                }
+            } while (cube_walk.next());
+        }
+
+        if (t_chunk_end >= t_max) {
+            break;
+        }
+    } while (chunk_walk.next());
+
+    return false;
 }
 
-void MarchingCubes::setWeightmapAttr(Urho3D::PODVector<unsigned char> const& value)
+bool MarchingCubes::sphereCast(RaycastResult& result, Urho3D::Ray const& ray, float radius, float max_distance) const
 {
-    // Store old weightmap, so it is possible to compare what changed
-    WeightMap wmap_old;
-    wmap.Swap(wmap_old);
+    // Work in units of cube width. Surface is about half way
+    // between solid and empty points, so reach a bit further.
+    Urho3D::Vector3 origin = ray.origin_ / cube_width;
+    Urho3D::Vector3 const& dir = ray.direction_;
+    float reach = radius / cube_width + 0.5f;
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    float t_min = 0;
+    float t_max = max_distance / cube_width;
+    Urho3D::Vector3 box_min = -Urho3D::Vector3::ONE * reach;
+    Urho3D::Vector3 box_max = Urho3D::Vector3(total_size.x_ - 1, total_size.y_ - 1, total_size.z_ - 1) + Urho3D::Vector3::ONE * reach;
+    if (!clipRay(t_min, t_max, origin, dir, box_min, box_max)) {
+        return false;
+    }
 
-    // Decompress the new weightmap
-    Urho3D::MemoryBuffer wmap_compressed_buf(value);
-    Urho3D::VectorBuffer wmap_vbuf;
-    if (!Urho3D::DecompressStream(wmap_vbuf, wmap_compressed_buf)) {
-        throw std::runtime_error("Unable to decompress MarchingCubes.wmap for attribute deserialization!");
+    // Step is so small that sphere cannot pass a point without touching it. If
+    // there are no solid points within one chunk, then sphere can move a whole
+    // chunk width along every axis.
+    float step = Urho3D::Min(reach * 0.5f, 1.0f);
+    float max_dir = Urho3D::Max(Urho3D::Abs(dir.x_), Urho3D::Max(Urho3D::Abs(dir.y_), Urho3D::Abs(dir.z_)));
+    float chunk_step = chunk_width / max_dir;
+    float chunk_reach = reach + chunk_width;
+
+    float t_free = t_min;
+    float t = t_min;
+    Urho3D::Vector3 normal;
+    WeightMap block;
+    while (true) {
+        Urho3D::Vector3 center = origin + dir * t;
+        Urho3D::IntVector3 chunks_begin(
+            Urho3D::FloorToInt((center.x_ - chunk_reach) / chunk_width),
+            Urho3D::FloorToInt((center.y_ - chunk_reach) / chunk_width),
+            Urho3D::FloorToInt((center.z_ - chunk_reach) / chunk_width)
+        );
+        Urho3D::IntVector3 chunks_end(
+            Urho3D::FloorToInt((center.x_ + chunk_reach) / chunk_width) + 1,
+            Urho3D::FloorToInt((center.y_ + chunk_reach) / chunk_width) + 1,
+            Urho3D::FloorToInt((center.z_ + chunk_reach) / chunk_width) + 1
+        );
+        if (areChunksEmpty(chunks_begin, chunks_end)) {
+            if (t >= t_max) {
+                return false;
+            }
+            t_free = t;
+            t = Urho3D::Min(t + chunk_step, t_max);
+            continue;
+        }
+
+        if (isSphereTouchingSolid(normal, block, center, reach)) {
+            // Find the exact position between the last free position and this one
+            if (t > t_min) {
+                for (unsigned i = 0; i < RAYCAST_REFINE_STEPS; ++ i) {
+                    float t_middle = (t_free + t) / 2;
+                    Urho3D::Vector3 middle_normal;
+                    if (isSphereTouchingSolid(middle_normal, block, origin + dir * t_middle, reach)) {
+                        t = t_middle;
+                        normal = middle_normal;
+                    } else {
+                        t_free = t_middle;
+                    }
+                }
+            }
+            result.pos = (origin + dir * t) * cube_width;
+            result.normal = normal == Urho3D::Vector3::ZERO ? -dir : normal;
+            result.distance = t * cube_width;
+            return true;
+        }
+
+        if (t >= t_max) {
+            return false;
+        }
+        t_free = t;
+        t = Urho3D::Min(t + step, t_max);
     }
-// TODO: Make some kind of fast memory copy!
-    wmap_vbuf.Seek(0);
-    while (!wmap_vbuf.IsEof()) {
-        wmap.Push(wmap_vbuf.ReadUByte());
+}
+
+void MarchingCubes::getCollisions(Collisions::Collisions& result, Collisions::Shape const* shape, float extra_radius) const
+{
+    // Spheres are handled as capsules that have zero length
+    Urho3D::Vector3 pos1, pos2;
+    float radius;
+    Collisions::Sphere const* sphere = dynamic_cast<Collisions::Sphere const*>(shape);
+    Collisions::Capsule const* capsule = dynamic_cast<Collisions::Capsule const*>(shape);
+    if (sphere) {
+        pos1 = pos2 = sphere->getPosition();
+        radius = sphere->getRadius();
+    } else if (capsule) {
+        pos1 = capsule->getPosition1();
+        pos2 = capsule->getPosition2();
+        radius = capsule->getRadius();
+    } else {
+        throw std::runtime_error("Only spheres and capsules can collide with MarchingCubes!");
     }
 
-    // Now compare old and new weightmap, and check what chunks need rebuiding.
-    // However, if all chunks are marked as dirty, then this can be skipped.
-    if (all_chunks_dirty) {
-        return;
+    // Skirts of chunks might reach a little bit outside of them
+    Urho3D::BoundingBox bb = shape->getBoundingBox(extra_radius);
+    if (lod_distance > 0) {
+        float skirt_width = cube_width * (1 << getMaxLod());
+        bb.min_ -= Urho3D::Vector3::ONE * skirt_width;
+        bb.max_ += Urho3D::Vector3::ONE * skirt_width;
     }
-    WeightMap chunk_wmap_old;
-    WeightMap chunk_wmap_new;
+
+    float chunk_total_width = chunk_width * cube_width;
+    Urho3D::IntVector3 begin(
+        Urho3D::Max(0, Urho3D::FloorToInt(bb.min_.x_ / chunk_total_width)),
+        Urho3D::Max(0, Urho3D::FloorToInt(bb.min_.y_ / chunk_total_width)),
+        Urho3D::Max(0, Urho3D::FloorToInt(bb.min_.z_ / chunk_total_width))
+    );
+    Urho3D::IntVector3 end(
+        Urho3D::Min(chunks_size.x_, Urho3D::FloorToInt(bb.max_.x_ / chunk_total_width) + 1),
+        Urho3D::Min(chunks_size.y_, Urho3D::FloorToInt(bb.max_.y_ / chunk_total_width) + 1),
+        Urho3D::Min(chunks_size.z_, Urho3D::FloorToInt(bb.max_.z_ / chunk_total_width) + 1)
+    );
+
     Urho3D::IntVector3 chunk_pos;
-    for (chunk_pos.z_ = 0; chunk_pos.z_ < chunks_size.z_; ++ chunk_pos.z_) {
-        for (chunk_pos.y_ = 0; chunk_pos.y_ < chunks_size.y_; ++ chunk_pos.y_) {
-            for (chunk_pos.x_ = 0; chunk_pos.x_ < chunks_size.x_; ++ chunk_pos.x_) {
-                // Get chunk. If rebuilding is already needed for it, then skip it
-                MarchingCubesChunk* chunk = chunks.Find(chunk_pos)->second_;
-                if (chunk->isRebuildNeeded()) {
+    for (chunk_pos.z_ = begin.z_; chunk_pos.z_ < end.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = begin.y_; chunk_pos.y_ < end.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = begin.x_; chunk_pos.x_ < end.x_; ++ chunk_pos.x_) {
+                auto chunks_find = chunks.Find(chunk_pos);
+                if (chunks_find == chunks.End()) {
                     continue;
                 }
+                Urho3D::Vector3 chunk_offset = Urho3D::Vector3(chunk_pos) * chunk_total_width;
+                chunks_find->second_->getCollisions(result, pos1 - chunk_offset, pos2 - chunk_offset, radius, extra_radius);
+            }
+        }
+    }
+}
 
-                // Get a chunk of data from both old and new weightmaps. If they differ, then rebuilding is needed.
-                Urho3D::IntVector3 begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE;
-                Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * (chunk_width + 3);
-                getWeightMapChunk(chunk_wmap_old, begin, end, wmap_old);
-                getWeightMapChunk(chunk_wmap_new, begin, end, wmap);
-                if (chunk_wmap_new != chunk_wmap_old) {
-                    chunk->markRebuildingNeeded();
-                    some_chunks_dirty = true;
-                }
+void MarchingCubes::setBackgroundRebuilding(bool enabled)
+{
+    if (background_rebuilding == enabled) {
+        return;
+    }
+    background_rebuilding = enabled;
+
+    updateSubscriptions(GetScene());
+    if (!background_rebuilding) {
+        // Finish unfinished rebuilds immediately
+        applyReadyBackgroundRebuilds();
+        for (Urho3D::IntVector3 const& chunk_pos : chunks_rebuilding) {
+            if (chunks.Contains(chunk_pos)) {
+                markChunkDirty(chunk_pos);
             }
         }
+        chunks_rebuilding.Clear();
+        rebuildChunksIfNeeded();
     }
 }
 
-Urho3D::ResourceRef MarchingCubes::getMaterialAttr() const
+void MarchingCubes::setRebuildBudget(float msecs)
 {
-    return GetResourceRef(mat, Urho3D::Material::GetTypeStatic());
+    if (rebuild_budget == msecs) {
+        return;
+    }
+    rebuild_budget = msecs;
+    updateSubscriptions(GetScene());
+    // Without a limit, everything that was left is rebuilt now
+    if (rebuild_budget <= 0) {
+        rebuildChunksIfNeeded();
+    }
 }
 
-void MarchingCubes::setMaterialAttr(Urho3D::ResourceRef const& value)
+void MarchingCubes::setRegionWidth(unsigned width)
 {
-    Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
-    setMaterial(resources->GetResource<Urho3D::Material>(value.name_));
+    if (region_width == width) {
+        return;
+    }
+    for (auto i = chunks.Begin(); i != chunks.End(); ++ i) {
+        removeChunkFromRegion(i->first_, i->second_);
+    }
+    region_width = width;
+    for (auto i = chunks.Begin(); i != chunks.End(); ++ i) {
+        addChunkToRegion(i->first_, i->second_);
+    }
 }
 
-void MarchingCubes::getWeightMapChunk(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, WeightMap const& source) const
+void MarchingCubes::setLodDistance(float distance)
 {
-// TODO: It would be nice to handle also situation when chunk is totally out of volume!
-    Urho3D::IntVector3 size = end - begin;
+    if (lod_distance == distance) {
+        return;
+    }
+    // Skirts are needed only when level of detail is used
+    if ((lod_distance > 0) != (distance > 0)) {
+        all_chunks_dirty = true;
+    }
+    lod_distance = distance;
+    updateSubscriptions(GetScene());
+}
 
-    result.Clear();
-    result.Reserve(size.x_ * size.y_ * size.z_);
+void MarchingCubes::setCompactVertices(bool compact)
+{
+    if (compact_vertices != compact) {
+        compact_vertices = compact;
+        all_chunks_dirty = true;
+    }
+}
 
-    Urho3D::IntVector3 cubes_size = chunks_size * chunk_width;
+void MarchingCubes::setMeshCache(MarchingCubesMeshCache* cache)
+{
+    mesh_cache = cache;
+}
 
-    // If begin.z is negative, then skip some squares
-    if (begin.z_ < 0) {
-        for (int i = 0; i < size.x_ * size.y_ * -begin.z_; ++ i) {
-            result.Push(255);
-        }
+void MarchingCubes::setKeepCollisionTriangles(bool keep)
+{
+    if (keep_collision_triangles == keep) {
+        return;
+    }
+    keep_collision_triangles = keep;
+    for (auto& i : chunks) {
+        i.second_->setKeepCollisionTriangles(keep);
     }
+    // Current meshes must be built again to get their triangles
+    if (keep) {
+        all_chunks_dirty = true;
+    }
+}
 
-    // Loop
-    for (int z = Urho3D::Max(0, begin.z_); z < Urho3D::Min(cubes_size.z_, end.z_); ++ z) {
+void MarchingCubes::saveVolume(Urho3D::Serializer& dest, bool include_meshes) const
+{
+    unsigned chunks_count = chunks_versions.Size();
+    unsigned chunk_volume = chunk_width * chunk_width * chunk_width;
 
-        // If begin.y is negative, then skip some lines
-        if (begin.y_ < 0) {
-            for (int i = 0; i < size.x_ * -begin.y_; ++ i) {
-                result.Push(255);
-            }
-        }
+    MarchingCubesChunk::MeshOptions options;
+    options.skirts = lod_distance > 0;
+    options.compact_vertices = compact_vertices;
 
-        // Loop
-        for (int y = Urho3D::Max(0, begin.y_); y < Urho3D::Min(cubes_size.y_, end.y_); ++ y) {
+    // Compress chunks and meshes first, so their offsets are known when the index is written
+    VolumeChunks index;
+    index.Resize(chunks_count);
+    Urho3D::VectorBuffer blobs;
+    unsigned blobs_begin = VOLUME_HEADER_SIZE + chunks_count * VOLUME_INDEX_ENTRY_SIZE;
+    WeightMap chunk_wmap;
+    WeightMap chunk_materials;
+    Urho3D::PODVector<unsigned char> blob;
+    for (unsigned chunk_i = 0; chunk_i < chunks_count; ++ chunk_i) {
+        Urho3D::IntVector3 chunk_pos = getChunkPosition(chunk_i);
+        VolumeChunk& volume_chunk = index[chunk_i];
+        volume_chunk.data_offset = 0;
+        volume_chunk.data_size = 0;
+        volume_chunk.mesh_offset = 0;
+        volume_chunk.mesh_size = 0;
+        volume_chunk.materials_offset = 0;
+        volume_chunk.materials_size = 0;
+        volume_chunk.resident = true;
 
-            // If begin.x is negative, then skip some values
-            if (begin.x_ < 0) {
-                for (int i = 0; i < -begin.x_; ++ i) {
-                    result.Push(255);
+        // Chunks that are only in the current volume file are copied as they are
+        if (volume_file && !volume_chunks[chunk_i].resident) {
+            VolumeChunk const& old_volume_chunk = volume_chunks[chunk_i];
+            volume_chunk.uniform_value = old_volume_chunk.uniform_value;
+            if (old_volume_chunk.data_size > 0) {
+                readVolumeBlob(blob, old_volume_chunk.data_offset, old_volume_chunk.data_size);
+                volume_chunk.data_offset = blobs_begin + blobs.GetSize();
+                volume_chunk.data_size = blob.Size();
+                blobs.Write(blob.Buffer(), blob.Size());
+            }
+            if (old_volume_chunk.materials_size > 0) {
+                readVolumeBlob(blob, old_volume_chunk.materials_offset, old_volume_chunk.materials_size);
+                volume_chunk.materials_offset = blobs_begin + blobs.GetSize();
+                volume_chunk.materials_size = blob.Size();
+                blobs.Write(blob.Buffer(), blob.Size());
+            }
+        } else {
+            Urho3D::IntVector3 begin = chunk_pos * chunk_width;
+            wmap.getBlock(chunk_wmap, begin, begin + Urho3D::IntVector3::ONE * chunk_width, 255);
+            volume_chunk.uniform_value = chunk_wmap[0];
+            bool uniform = true;
+            for (unsigned i = 1; i < chunk_volume; ++ i) {
+                if (chunk_wmap[i] != volume_chunk.uniform_value) {
+                    uniform = false;
+                    break;
                 }
             }
-
-            // Loop
-            unsigned ofs = Urho3D::Max(0, begin.x_) + y * cubes_size.x_ + z * cubes_size.x_ * cubes_size.y_;
-            unsigned copy_amount = Urho3D::Min(cubes_size.x_, end.x_) - Urho3D::Max(0, begin.x_);
-            result.Insert(result.End(), source.Begin() + ofs, source.Begin() + ofs + copy_amount);
-
-            // If end.x was too big, then skip some values
-            if (end.x_ > cubes_size.x_) {
-                for (int i = 0; i < end.x_ - cubes_size.x_; ++ i) {
-                    result.Push(255);
+            if (!uniform) {
+                unsigned offset = blobs.GetSize();
+                Urho3D::MemoryBuffer chunk_buf(chunk_wmap);
+                if (!Urho3D::CompressStream(blobs, chunk_buf)) {
+                    throw std::runtime_error("Unable to compress MarchingCubes volume chunk!");
                 }
+                volume_chunk.data_offset = blobs_begin + offset;
+                volume_chunk.data_size = blobs.GetSize() - offset;
             }
 
+            // Materials are stored only if some point has other than the first material
+            point_materials.getBlock(chunk_materials, begin, begin + Urho3D::IntVector3::ONE * chunk_width, 0);
+            if (areMaterialsUsed(chunk_materials)) {
+                unsigned offset = blobs.GetSize();
+                Urho3D::MemoryBuffer materials_buf(chunk_materials);
+                if (!Urho3D::CompressStream(blobs, materials_buf)) {
+                    throw std::runtime_error("Unable to compress MarchingCubes volume chunk materials!");
+                }
+                volume_chunk.materials_offset = blobs_begin + offset;
+                volume_chunk.materials_size = blobs.GetSize() - offset;
+            }
         }
 
-        // If end.y was too big, then skip some lines
-        if (end.y_ > cubes_size.y_) {
-            for (int i = 0; i < size.x_ * (end.y_ - cubes_size.y_); ++ i) {
-                result.Push(255);
+        // Chunks without surface do not need meshes
+        if (include_meshes && !isChunkUniform(chunk_pos)) {
+            unsigned offset = blobs.GetSize();
+            if (isVolumeMeshValid(chunk_pos)) {
+                VolumeChunk const& old_volume_chunk = volume_chunks[chunk_i];
+                readVolumeBlob(blob, old_volume_chunk.mesh_offset, old_volume_chunk.mesh_size);
+                blobs.Write(blob.Buffer(), blob.Size());
+            } else {
+                Urho3D::IntVector3 begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE;
+                getPoints(chunk_wmap, begin, begin + Urho3D::IntVector3::ONE * (chunk_width + 3));
+                getPointMaterials(chunk_materials, begin, begin + Urho3D::IntVector3::ONE * (chunk_width + 3));
+                if (!areMaterialsUsed(chunk_materials)) {
+                    chunk_materials.Clear();
+                }
+                MarchingCubesChunk::MeshData mesh;
+                MarchingCubesChunk::buildMesh(mesh, chunk_wmap, chunk_materials, chunk_width, cube_width, options);
+                MarchingCubesChunk::writeMesh(blobs, mesh);
             }
+            volume_chunk.mesh_offset = blobs_begin + offset;
+            volume_chunk.mesh_size = blobs.GetSize() - offset;
         }
-
     }
 
-    // If end.z was too big, then skip some squares
-    if (end.z_ > cubes_size.z_) {
-        for (int i = 0; i < size.x_ * size.y_ * (end.z_ - cubes_size.z_); ++ i) {
-            result.Push(255);
-        }
+    // Header
+    dest.WriteFileID(VOLUME_FILE_ID);
+    dest.WriteUInt(VOLUME_VERSION);
+    dest.WriteIntVector3(chunks_size);
+    dest.WriteUInt(chunk_width);
+    dest.WriteFloat(cube_width);
+    dest.WriteBool(options.skirts);
+    dest.WriteBool(options.compact_vertices);
+
+    // Index
+    for (unsigned chunk_i = 0; chunk_i < chunks_count; ++ chunk_i) {
+        VolumeChunk const& volume_chunk = index[chunk_i];
+        dest.WriteUInt(volume_chunk.data_offset);
+        dest.WriteUInt(volume_chunk.data_size);
+        dest.WriteUInt(chunks_solid_counts[chunk_i]);
+        dest.WriteUByte(volume_chunk.uniform_value);
+        dest.WriteUInt(volume_chunk.mesh_offset);
+        dest.WriteUInt(volume_chunk.mesh_size);
+        dest.WriteUInt(volume_chunk.materials_offset);
+        dest.WriteUInt(volume_chunk.materials_size);
     }
 
-    assert(int(result.Size()) == size.x_ * size.y_ * size.z_);
+    // Chunks and meshes
+    if (dest.Write(blobs.GetData(), blobs.GetSize()) != blobs.GetSize()) {
+        throw std::runtime_error("Unable to write MarchingCubes volume!");
+    }
 }
 
-MarchingCubesChunk::MarchingCubesChunk(Urho3D::Context* context) :
-    Urho3D::Drawable(context, Urho3D::DRAWABLE_GEOMETRY),
-    geometry(new Urho3D::Geometry(context)),
-    vbuf(new Urho3D::VertexBuffer(context)),
-    ibuf(new Urho3D::IndexBuffer(context)),
-    rebuild_needed(true),
-    total_width(0)
+bool MarchingCubes::loadVolume(Urho3D::File* file)
 {
-    geometry->SetVertexBuffer(0, vbuf);
-    geometry->SetIndexBuffer(ibuf);
-    batches_.Resize(1);
-    batches_[0].geometry_ = geometry;
-    batches_[0].geometryType_ = Urho3D::GEOM_STATIC_NOINSTANCING;
-}
+    unsigned file_begin = file->GetPosition();
 
-void MarchingCubesChunk::setMaterial(Urho3D::Material* mat)
-{
-    batches_[0].material_ = mat;
-}
+    // Header
+    if (file->ReadFileID() != VOLUME_FILE_ID) {
+        URHO3D_LOGWARNING("File is not a MarchingCubes volume!");
+        return false;
+    }
+    if (file->ReadUInt() != VOLUME_VERSION) {
+        URHO3D_LOGWARNING("MarchingCubes volume has unsupported version!");
+        return false;
+    }
+    Urho3D::IntVector3 new_chunks_size = file->ReadIntVector3();
+    unsigned new_chunk_width = file->ReadUInt();
+    float new_cube_width = file->ReadFloat();
+    bool meshes_skirts = file->ReadBool();
+    bool meshes_compact = file->ReadBool();
+    if (new_chunks_size.x_ < 0 || new_chunks_size.y_ < 0 || new_chunks_size.z_ < 0 || new_chunk_width == 0) {
+        URHO3D_LOGWARNING("MarchingCubes volume has invalid size!");
+        return false;
+    }
 
-void MarchingCubesChunk::markRebuildingNeeded()
-{
-    rebuild_needed = true;
-}
+    // Index
+    unsigned volume_size = file->GetSize() - file_begin;
+    unsigned new_chunks_count = new_chunks_size.x_ * new_chunks_size.y_ * new_chunks_size.z_;
+    if (volume_size < VOLUME_HEADER_SIZE + new_chunks_count * VOLUME_INDEX_ENTRY_SIZE) {
+        URHO3D_LOGWARNING("MarchingCubes volume is truncated!");
+        return false;
+    }
+    unsigned chunk_volume = new_chunk_width * new_chunk_width * new_chunk_width;
+    VolumeChunks new_volume_chunks;
+    new_volume_chunks.Resize(new_chunks_count);
+    ChunkSolidCounts new_solid_counts;
+    new_solid_counts.Resize(new_chunks_count);
+    for (unsigned chunk_i = 0; chunk_i < new_chunks_count; ++ chunk_i) {
+        VolumeChunk& volume_chunk = new_volume_chunks[chunk_i];
+        volume_chunk.data_offset = file->ReadUInt();
+        volume_chunk.data_size = file->ReadUInt();
+        unsigned solid_count = file->ReadUInt();
+        volume_chunk.uniform_value = file->ReadUByte();
+        volume_chunk.mesh_offset = file->ReadUInt();
+        volume_chunk.mesh_size = file->ReadUInt();
+        volume_chunk.materials_offset = file->ReadUInt();
+        volume_chunk.materials_size = file->ReadUInt();
+        volume_chunk.resident = false;
+        if (volume_chunk.data_offset > volume_size || volume_chunk.data_size > volume_size - volume_chunk.data_offset ||
+            volume_chunk.mesh_offset > volume_size || volume_chunk.mesh_size > volume_size - volume_chunk.mesh_offset ||
+            volume_chunk.materials_offset > volume_size || volume_chunk.materials_size > volume_size - volume_chunk.materials_offset ||
+            solid_count > chunk_volume ||
+            (volume_chunk.data_size == 0 && solid_count != (volume_chunk.uniform_value >= 128 ? chunk_volume : 0))) {
+            URHO3D_LOGWARNING("MarchingCubes volume has invalid chunk!");
+            return false;
+        }
+        new_solid_counts[chunk_i] = solid_count;
+    }
 
-bool MarchingCubesChunk::isRebuildNeeded() const
-{
-    return rebuild_needed;
+    // Take the volume into use. Points stay in the file until they are needed.
+    closeVolume();
+    chunks_size = new_chunks_size;
+    chunk_width = new_chunk_width;
+    cube_width = new_cube_width;
+    wmap.resize(chunks_size * chunk_width, 0);
+    point_materials.resize(chunks_size * chunk_width, 0);
+    chunks_solid_counts.Swap(new_solid_counts);
+    resetChunksVersions();
+    volume_file = file;
+    volume_file_begin = file_begin;
+    volume_chunks.Swap(new_volume_chunks);
+    volume_cube_width = new_cube_width;
+    volume_meshes_skirts = meshes_skirts;
+    volume_meshes_compact = meshes_compact;
+
+    // Only chunks within the streaming focus are paged in and built
+    all_chunks_dirty = true;
+    rebuildChunksIfNeeded();
+    MarkNetworkUpdate();
+    return true;
 }
 
-void MarchingCubesChunk::rebuild(MarchingCubes::WeightMap const& wmap, unsigned chunk_width, float cube_width)
+void MarchingCubes::setStreamingFocus(Urho3D::Vector3 const& pos, float radius)
 {
-    total_width = chunk_width * cube_width;
+    Urho3D::Vector3 old_focus = streaming_focus;
+    float old_radius = streaming_radius;
+    streaming_focus = pos;
+    streaming_radius = radius;
 
-    // Chunk width with the extra margin
-    unsigned cwe = chunk_width + 3;
-    assert(wmap.Size() == cwe * cwe * cwe);
+    // Only chunks near the old and the new range can change. One extra chunk is
+    // checked on every side, because meshing pages in the neighbor chunks too.
+    Urho3D::IntVector3 chunks_begin = Urho3D::IntVector3::ZERO;
+    Urho3D::IntVector3 chunks_end = chunks_size;
+    if (old_radius > 0 && radius > 0) {
+        Urho3D::BoundingBox range(old_focus - Urho3D::Vector3::ONE * old_radius, old_focus + Urho3D::Vector3::ONE * old_radius);
+        range.Merge(Urho3D::BoundingBox(pos - Urho3D::Vector3::ONE * radius, pos + Urho3D::Vector3::ONE * radius));
+        float chunk_total_width = chunk_width * cube_width;
+        chunks_begin = Urho3D::IntVector3(
+            Urho3D::Max(0, Urho3D::FloorToInt(range.min_.x_ / chunk_total_width) - 1),
+            Urho3D::Max(0, Urho3D::FloorToInt(range.min_.y_ / chunk_total_width) - 1),
+            Urho3D::Max(0, Urho3D::FloorToInt(range.min_.z_ / chunk_total_width) - 1)
+        );
+        chunks_end = Urho3D::IntVector3(
+            Urho3D::Min(chunks_size.x_, Urho3D::FloorToInt(range.max_.x_ / chunk_total_width) + 2),
+            Urho3D::Min(chunks_size.y_, Urho3D::FloorToInt(range.max_.y_ / chunk_total_width) + 2),
+            Urho3D::Min(chunks_size.z_, Urho3D::FloorToInt(range.max_.z_ / chunk_total_width) + 2)
+        );
+    }
 
-    Triangles tris;
-    // Start by building all cubes. This also includes the extra cubes at edges,
-    // that will only be used for smooth shading and are later discarded.
-    unsigned ofs = 0;
-    for (int z = -1; z < int(cwe - 2); z ++) {
-        for (int y = -1; y < int(cwe - 2); y ++) {
-            for (int x = -1; x < int(cwe - 2); x ++) {
-                bool temporary = (x == -1 || y == -1 || z == -1 || x >= int(chunk_width) || y >= int(chunk_width) || z >= int(chunk_width));
-
-                // Get corner values
-                uint8_t corners[8] = {
-                    wmap[ofs],
-                    wmap[ofs + 1],
-                    wmap[ofs + cwe],
-                    wmap[ofs + 1 + cwe],
-                    wmap[ofs + cwe * cwe],
-                    wmap[ofs + 1 + cwe * cwe],
-                    wmap[ofs + cwe + cwe * cwe],
-                    wmap[ofs + 1 + cwe + cwe * cwe]
-                };
-
-                uint8_t mask = 0;
-                for (unsigned i = 0; i < 8; ++ i) {
-                    mask += int(corners[i] >= 128) << i;
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = chunks_begin.z_; chunk_pos.z_ < chunks_end.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+                if (isChunkInRange(chunk_pos, pos, radius)) {
+                    if (!isChunkInRange(chunk_pos, old_focus, old_radius)) {
+                        markChunkDirty(chunk_pos);
+                    }
+                    continue;
                 }
-                switch (mask) {
-                case 0x00:
-                    // Empty
-                    break;
-                case 0x01:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeOneCorner, corners);
-                    break;
-                case 0x02:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makeOneCorner, corners);
-                    break;
-                case 0x03:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeOneEdge, corners);
-                    break;
-                case 0x04:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makeOneCorner, corners);
-                    break;
-                case 0x05:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makeOneEdge, corners);
-                    break;
-                case 0x06:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0x07:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x08:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_180, makeOneCorner, corners);
-                    break;
-                case 0x09:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeTwoCorners, corners);
-                    break;
-                case 0x0A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makeOneEdge, corners);
-                    break;
-                case 0x0B:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x0C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_180, makeOneEdge, corners);
-                    break;
-                case 0x0D:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x0E:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x0F:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90, makePlane, corners);
-                    break;
-                case 0x10:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeOneCorner, corners);
-                    break;
-                case 0x11:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeOneEdge, corners);
-                    break;
-                case 0x12:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makeTwoCorners, corners);
-                    break;
-                case 0x13:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x14:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeTwoCorners, corners);
-                    break;
-                case 0x15:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x16:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_180, makeThreeCorners, corners);
-                    break;
-                case 0x17:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeHexagon, corners);
-                    break;
-                case 0x18:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeOpposingCorners, corners);
-                    break;
-                case 0x19:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x1A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x1B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90, makeZigZag1, corners);
-                    break;
-                case 0x1C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_180, makeCornerAndEdge, corners);
-                    break;
-                case 0x1D:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeZigZag2, corners);
-                    break;
-                case 0x1E:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x1F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x20:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeOneCorner, corners);
-                    break;
-                case 0x21:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeTwoCorners, corners);
-                    break;
-                case 0x22:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeOneEdge, corners);
-                    break;
-                case 0x23:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x24:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeOpposingCorners, corners);
-                    break;
-                case 0x25:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x26:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x27:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeZigZag2, corners);
-                    break;
-                case 0x28:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0x29:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makeThreeCorners, corners);
-                    break;
-                case 0x2A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x2B:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeHexagon, corners);
-                    break;
-                case 0x2C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x2D:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x2E:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeZigZag1, corners);
-                    break;
-                case 0x2F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x30:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeOneEdge, corners);
-                    break;
-                case 0x31:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x32:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeBigHalfCorner, corners);
-                    break;
-                case 0x33:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makePlane, corners);
-                    break;
-                case 0x34:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeCornerAndEdge, corners);
-                    break;
-                case 0x35:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeZigZag1, corners);
-                    break;
-                case 0x36:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x37:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x38:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x39:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x3A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeZigZag2, corners);
-                    break;
-                case 0x3B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x3C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makeTwoEdges, corners);
-                    break;
-                case 0x3D:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180, makeCornerAndEdge, corners);
-                    break;
-                case 0x3E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_180, makeCornerAndEdge, corners);
-                    break;
-                case 0x3F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180, makeOneEdge, corners);
-                    break;
-                case 0x40:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makeOneCorner, corners);
-                    break;
-                case 0x41:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0x42:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeOpposingCorners, corners);
-                    break;
-                case 0x43:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_180, makeCornerAndEdge, corners);
-                    break;
-                case 0x44:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeOneEdge, corners);
-                    break;
-                case 0x45:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x46:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x47:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_NEG90, makeZigZag1, corners);
-                    break;
-                case 0x48:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeTwoCorners, corners);
-                    break;
-                case 0x49:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeThreeCorners, corners);
-                    break;
-                case 0x4A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x4B:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x4C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x4D:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makeHexagon, corners);
-                    break;
-                case 0x4E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeZigZag2, corners);
-                    break;
-                case 0x4F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x50:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_NEG90, makeOneEdge, corners);
-                    break;
-                case 0x51:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x52:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x53:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeZigZag2, corners);
-                    break;
-                case 0x54:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x55:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makePlane, corners);
-                    break;
-                case 0x56:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x57:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x58:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x59:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x5A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeTwoEdges, corners);
-                    break;
-                case 0x5B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x5C:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeZigZag1, corners);
-                    break;
-                case 0x5D:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0x5E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x5F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeOneEdge, corners);
-                    break;
-                case 0x60:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeTwoCorners, corners);
-                    break;
-                case 0x61:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_UP_NEG90, makeThreeCorners, corners);
-                    break;
-                case 0x62:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x63:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x64:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x65:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x66:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90, makeTwoEdges, corners);
-                    break;
-                case 0x67:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x68:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeThreeCorners, corners);
-                    break;
-                case 0x69:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeFourCorners, corners);
-                    break;
-                case 0x6A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x6B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeThreeCorners, corners);
-                    break;
-                case 0x6C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_UP_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x6D:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180, makeThreeCorners, corners);
-                    break;
-                case 0x6E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x6F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0x70:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x71:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeHexagon, corners);
-                    break;
-                case 0x72:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeZigZag1, corners);
-                    break;
-                case 0x73:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x74:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeZigZag2, corners);
-                    break;
-                case 0x75:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x76:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x77:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_NEG90, makeOneEdge, corners);
-                    break;
-                case 0x78:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x79:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeThreeCorners, corners);
-                    break;
-                case 0x7A:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x7B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90, makeTwoCorners, corners);
-                    break;
-                case 0x7C:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeCornerAndEdge, corners);
-                    break;
-                case 0x7D:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeTwoCorners, corners);
-                    break;
-                case 0x7E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeOpposingCorners, corners);
-                    break;
-                case 0x7F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_180, makeOneCorner, corners);
-                    break;
-                case 0x80:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_180, makeOneCorner, corners);
-                    break;
-                case 0x81:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeOpposingCorners, corners);
-                    break;
-                case 0x82:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_NEG90, makeTwoCorners, corners);
-                    break;
-                case 0x83:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeCornerAndEdge, corners);
-                    break;
-                case 0x84:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90, makeTwoCorners, corners);
-                    break;
-                case 0x85:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x86:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeThreeCorners, corners);
-                    break;
-                case 0x87:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x88:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_NEG90, makeOneEdge, corners);
-                    break;
-                case 0x89:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0x8A:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0x8B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeZigZag2, corners);
-                    break;
-                case 0x8C:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x8D:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeZigZag1, corners);
-                    break;
-                case 0x8E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeHexagon, corners);
-                    break;
-                case 0x8F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCorner, corners);
-                    break;
-                case 0x90:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0x91:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x92:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makeThreeCorners, corners);
-                    break;
-                case 0x93:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_UP_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x94:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_180, makeThreeCorners, corners);
-                    break;
-                case 0x95:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x96:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeFourCorners, corners);
-                    break;
-                case 0x97:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeThreeCorners, corners);
-                    break;
-                case 0x98:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x99:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makeTwoEdges, corners);
-                    break;
-                case 0x9A:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x9B:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x9C:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0x9D:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0x9E:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_UP_NEG90, makeThreeCorners, corners);
-                    break;
-                case 0x9F:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeTwoCorners, corners);
-                    break;
-                case 0xA0:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeOneEdge, corners);
-                    break;
-                case 0xA1:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0xA2:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xA3:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_UP_90, makeZigZag1, corners);
-                    break;
-                case 0xA4:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xA5:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeTwoEdges, corners);
-                    break;
-                case 0xA6:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xA7:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xA8:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xA9:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xAA:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makePlane, corners);
-                    break;
-                case 0xAB:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xAC:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeZigZag2, corners);
-                    break;
-                case 0xAD:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0xAE:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xAF:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_NEG90, makeOneEdge, corners);
-                    break;
-                case 0xB0:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xB1:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_NOTHING, makeZigZag2, corners);
-                    break;
-                case 0xB2:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180, makeHexagon, corners);
-                    break;
-                case 0xB3:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xB4:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xB5:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xB6:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeThreeCorners, corners);
-                    break;
-                case 0xB7:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeTwoCorners, corners);
-                    break;
-                case 0xB8:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_NEG90, makeZigZag1, corners);
-                    break;
-                case 0xB9:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xBA:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xBB:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeOneEdge, corners);
-                    break;
-                case 0xBC:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_180, makeCornerAndEdge, corners);
-                    break;
-                case 0xBD:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeOpposingCorners, corners);
-                    break;
-                case 0xBE:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0xBF:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180, makeOneCorner, corners);
-                    break;
-                case 0xC0:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makeOneEdge, corners);
-                    break;
-                case 0xC1:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_90_UP_180, makeCornerAndEdge, corners);
-                    break;
-                case 0xC2:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makeCornerAndEdge, corners);
-                    break;
-                case 0xC3:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_90, makeTwoEdges, corners);
-                    break;
-                case 0xC4:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_FORWARD_180, makeBigHalfCorner, corners);
-                    break;
-                case 0xC5:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeZigZag2, corners);
-                    break;
-                case 0xC6:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xC7:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0xC8:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xC9:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xCA:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeZigZag1, corners);
-                    break;
-                case 0xCB:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeCornerAndEdge, corners);
-                    break;
-                case 0xCC:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_180, makePlane, corners);
-                    break;
-                case 0xCD:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeBigHalfCorner, corners);
-                    break;
-                case 0xCE:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xCF:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeOneEdge, corners);
-                    break;
-                case 0xD0:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xD1:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeZigZag1, corners);
-                    break;
-                case 0xD2:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xD3:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xD4:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeHexagon, corners);
-                    break;
-                case 0xD5:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xD6:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90, makeThreeCorners, corners);
-                    break;
-                case 0xD7:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0xD8:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeZigZag2, corners);
-                    break;
-                case 0xD9:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xDA:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0xDB:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeOpposingCorners, corners);
-                    break;
-                case 0xDC:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xDD:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeOneEdge, corners);
-                    break;
-                case 0xDE:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90_UP_NEG90, makeTwoCorners, corners);
-                    break;
-                case 0xDF:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeOneCorner, corners);
-                    break;
-                case 0xE0:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xE1:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeBigHalfCornerAndCorner, corners);
-                    break;
-                case 0xE2:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_180_FORWARD_90, makeZigZag2, corners);
-                    break;
-                case 0xE3:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_180, makeCornerAndEdge, corners);
-                    break;
-                case 0xE4:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makeZigZag1, corners);
-                    break;
-                case 0xE5:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_NEG90, makeCornerAndEdge, corners);
-                    break;
-                case 0xE6:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeCornerAndEdge, corners);
-                    break;
-                case 0xE7:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeOpposingCorners, corners);
-                    break;
-                case 0xE8:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_NEG90, makeHexagon, corners);
-                    break;
-                case 0xE9:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_180, makeThreeCorners, corners);
-                    break;
-                case 0xEA:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_UP_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xEB:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeTwoCorners, corners);
-                    break;
-                case 0xEC:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_180, makeBigHalfCorner, corners);
-                    break;
-                case 0xED:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_NEG90, makeTwoCorners, corners);
-                    break;
-                case 0xEE:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeOneEdge, corners);
-                    break;
-                case 0xEF:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_UP_90, makeOneCorner, corners);
-                    break;
-                case 0xF0:
-                    tris += finalizeTriangles(temporary, false, cube_width, x, y, z, ROT_RIGHT_NEG90, makePlane, corners);
-                    break;
-                case 0xF1:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xF2:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_180, makeBigHalfCorner, corners);
-                    break;
-                case 0xF3:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_180, makeOneEdge, corners);
-                    break;
-                case 0xF4:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90, makeBigHalfCorner, corners);
-                    break;
-                case 0xF5:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_90, makeOneEdge, corners);
-                    break;
-                case 0xF6:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeTwoCorners, corners);
-                    break;
-                case 0xF7:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_180, makeOneCorner, corners);
-                    break;
-                case 0xF8:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_RIGHT_90_FORWARD_NEG90, makeBigHalfCorner, corners);
-                    break;
-                case 0xF9:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_90, makeTwoCorners, corners);
-                    break;
-                case 0xFA:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_NEG90, makeOneEdge, corners);
-                    break;
-                case 0xFB:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_NEG90, makeOneCorner, corners);
-                    break;
-                case 0xFC:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeOneEdge, corners);
-                    break;
-                case 0xFD:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_FORWARD_90, makeOneCorner, corners);
-                    break;
-                case 0xFE:
-                    tris += finalizeTriangles(temporary, true, cube_width, x, y, z, ROT_NOTHING, makeOneCorner, corners);
-                    break;
-                case 0xFF:
-                    // Full
-                    break;
+
+                auto chunks_find = chunks.Find(chunk_pos);
+                if (chunks_find != chunks.End()) {
+                    removeChunk(chunks_find);
+                }
+
+                // If points have not been modified, they can be read again from the file
+                unsigned chunk_i = getChunkIndex(chunk_pos);
+                if (volume_file && volume_chunks[chunk_i].resident && chunks_versions[chunk_i] == 0) {
+                    pageOutChunk(chunk_i);
+                }
+            }
+        }
+    }
+
+    // Chunks that came into the range are built now, or within the rebuild budget
+    rebuildChunksIfNeeded();
+}
+
+void MarchingCubes::registerObject(Urho3D::Context* context)
+{
+    context->RegisterFactory<MarchingCubes>();
+    context->RegisterFactory<MarchingCubesChunk>();
+    context->RegisterFactory<MarchingCubesRegion>();
+
+    URHO3D_ATTRIBUTE("Cube width", float, cube_width, DEFAULT_CUBE_WIDTH, Urho3D::AM_DEFAULT);
+    URHO3D_ATTRIBUTE("Chunk width", unsigned, chunk_width, DEFAULT_CHUNK_WIDTH, Urho3D::AM_DEFAULT);
+    URHO3D_ATTRIBUTE("Size in chunks", Urho3D::IntVector3, chunks_size, DEFAULT_CHUNKS_SIZE, Urho3D::AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Weightmap", getWeightmapAttr, setWeightmapAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_FILE);
+    URHO3D_ACCESSOR_ATTRIBUTE("Point materials", getPointMaterialsAttr, setPointMaterialsAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_FILE);
+    URHO3D_ACCESSOR_ATTRIBUTE("Network weightmap base", getNetworkBaseAttr, setNetworkBaseAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_NET | Urho3D::AM_NOEDIT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Network weightmap delta", getNetworkDeltaAttr, setNetworkDeltaAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_NET | Urho3D::AM_NOEDIT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Material", getMaterialAttr, setMaterialAttr, Urho3D::ResourceRef, Urho3D::ResourceRef(Urho3D::Material::GetTypeStatic()), Urho3D::AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Materials", getMaterialsAttr, setMaterialsAttr, Urho3D::ResourceRefList, Urho3D::ResourceRefList(Urho3D::Material::GetTypeStatic()), Urho3D::AM_DEFAULT);
+    URHO3D_COPY_BASE_ATTRIBUTES(Urho3D::Drawable);
+}
+
+void MarchingCubes::ApplyAttributes()
+{
+    rebuildChunksIfNeeded();
+}
+
+void MarchingCubes::OnSceneSet(Urho3D::Scene* scene)
+{
+    Urho3D::Component::OnSceneSet(scene);
+
+    updateSubscriptions(scene);
+}
+
+void MarchingCubes::rebuildChunksIfNeeded()
+{
+    if (!some_chunks_dirty && !all_chunks_dirty) return;
+
+    if (!node_) {
+        some_chunks_dirty = false;
+        all_chunks_dirty = false;
+        chunks_dirty.Clear();
+        return;
+    }
+
+    // In background mode, meshes are built in WorkQueue threads
+    Urho3D::WorkQueue* workqueue = nullptr;
+    if (background_rebuilding) {
+        workqueue = GetSubsystem<Urho3D::WorkQueue>();
+    }
+
+    WeightMap chunk_wmap;
+    if (all_chunks_dirty) {
+        // Remove chunks that are no longer inside the volume
+        for (auto i = chunks.Begin(); i != chunks.End(); ) {
+            Urho3D::IntVector3 const& chunk_pos = i->first_;
+            if (!isChunkInsideVolume(chunk_pos)) {
+                i = removeChunk(i);
+            } else {
+                ++ i;
+            }
+        }
+        // Queued chunks keep their waiting time, unless they are outside the volume
+        for (auto i = chunks_dirty.Begin(); i != chunks_dirty.End(); ) {
+            if (isChunkInsideVolume(i->first_)) {
+                ++ i;
+            } else {
+                i = chunks_dirty.Erase(i);
+            }
+        }
+
+        // Build all chunks. If there is a budget, they are queued instead.
+        Urho3D::IntVector3 chunk_pos;
+        for (chunk_pos.z_ = 0; chunk_pos.z_ < chunks_size.z_; ++ chunk_pos.z_) {
+            for (chunk_pos.y_ = 0; chunk_pos.y_ < chunks_size.y_; ++ chunk_pos.y_) {
+                for (chunk_pos.x_ = 0; chunk_pos.x_ < chunks_size.x_; ++ chunk_pos.x_) {
+                    if (rebuild_budget > 0) {
+                        markChunkDirty(chunk_pos);
+                    } else {
+                        rebuildChunk(chunk_pos, true, chunk_wmap, workqueue);
+                    }
+                }
+            }
+        }
+        all_chunks_dirty = false;
+        // Separately dirty chunks were built too
+        if (rebuild_budget <= 0) {
+            chunks_dirty.Clear();
+        }
+    }
+
+    if (rebuild_budget > 0) {
+        rebuildChunksWithinBudget(chunk_wmap, workqueue);
+        return;
+    }
+
+    for (auto i = chunks_dirty.Begin(); i != chunks_dirty.End(); ++ i) {
+        rebuildChunk(i->first_, false, chunk_wmap, workqueue);
+    }
+
+    chunks_dirty.Clear();
+    some_chunks_dirty = false;
+    all_chunks_dirty = false;
+}
+
+MarchingCubes::Chunks::Iterator MarchingCubes::removeChunk(Chunks::Iterator chunks_find)
+{
+    removeChunkFromRegion(chunks_find->first_, chunks_find->second_);
+    chunks_find->second_->GetNode()->Remove();
+    return chunks.Erase(chunks_find);
+}
+
+void MarchingCubes::addChunkToRegion(Urho3D::IntVector3 const& chunk_pos, MarchingCubesChunk* chunk)
+{
+    if (region_width == 0) {
+        return;
+    }
+    Urho3D::IntVector3 region_pos = chunk_pos / int(region_width);
+    MarchingCubesRegion* region;
+    auto regions_find = regions.Find(region_pos);
+    if (regions_find != regions.End()) {
+        region = regions_find->second_;
+    } else {
+        // Region is at origin, because its batches use the transforms of the chunks
+        Urho3D::Node* region_node = node_->CreateTemporaryChild(Urho3D::String::EMPTY, Urho3D::LOCAL);
+        region = region_node->CreateComponent<MarchingCubesRegion>();
+        regions[region_pos] = region;
+    }
+    chunk->setRegion(region);
+    region->addChunk(chunk);
+}
+
+void MarchingCubes::removeChunkFromRegion(Urho3D::IntVector3 const& chunk_pos, MarchingCubesChunk* chunk)
+{
+    if (region_width == 0) {
+        return;
+    }
+    Urho3D::IntVector3 region_pos = chunk_pos / int(region_width);
+    auto regions_find = regions.Find(region_pos);
+    if (regions_find == regions.End()) {
+        return;
+    }
+    MarchingCubesRegion* region = regions_find->second_;
+    region->removeChunk(chunk);
+    chunk->setRegion(nullptr);
+    if (region->isEmpty()) {
+        region->GetNode()->Remove();
+        regions.Erase(regions_find);
+    }
+}
+
+void MarchingCubes::rebuildChunk(Urho3D::IntVector3 const& chunk_pos, bool reposition, WeightMap& chunk_wmap, Urho3D::WorkQueue* workqueue)
+{
+    auto chunks_find = chunks.Find(chunk_pos);
+
+    // If there is no surface, then there is no need for the chunk at
+    // all. Also chunks outside the streaming range are not shown.
+    if (!isChunkInsideVolume(chunk_pos) || isChunkUniform(chunk_pos) || !isChunkInRange(chunk_pos, streaming_focus, streaming_radius)) {
+        if (chunks_find != chunks.End()) {
+            removeChunk(chunks_find);
+        }
+        return;
+    }
+
+    // Get or create chunk and chunk node
+    Urho3D::Node* chunk_node = nullptr;
+    MarchingCubesChunk* chunk = nullptr;
+    bool new_node = false;
+    if (chunks_find != chunks.End()) {
+        chunk = chunks_find->second_;
+        chunk_node = chunk->GetNode();
+    } else {
+        new_node = true;
+        // Create child as local and temporary, so it won't be serialized to network nor to disk.
+        chunk_node = node_->CreateTemporaryChild(Urho3D::String::EMPTY, Urho3D::LOCAL);
+        // Create the actual Chunk
+        chunk = chunk_node->CreateComponent<MarchingCubesChunk>();
+        chunk->setMaterials(mats);
+        chunk->setKeepCollisionTriangles(keep_collision_triangles);
+        chunks[chunk_pos] = chunk;
+        addChunkToRegion(chunk_pos, chunk);
+    }
+
+    // Set position, if needed
+    if (new_node || reposition) {
+        chunk_node->SetPosition(Urho3D::Vector3(
+            chunk_pos.x_ * chunk_width * cube_width,
+            chunk_pos.y_ * chunk_width * cube_width,
+            chunk_pos.z_ * chunk_width * cube_width
+        ));
+    }
+
+    // Pick level of detail
+    unsigned lod = 0;
+    if (lod_distance > 0) {
+        Urho3D::PODVector<Urho3D::Camera*> cameras;
+        getCameras(cameras);
+        lod = getLodForDistance(getChunkLodDistance(chunk_pos, cameras), chunk->getLod());
+    }
+    chunk->setLod(lod);
+    unsigned stride = 1 << lod;
+    unsigned lod_chunk_width = chunk_width / stride;
+
+    // If the volume file has an up to date mesh, then there is no need to build it
+    if (lod == 0 && isVolumeMeshValid(chunk_pos)) {
+        VolumeChunk const& volume_chunk = volume_chunks[getChunkIndex(chunk_pos)];
+        Urho3D::PODVector<unsigned char> mesh_compressed;
+        readVolumeBlob(mesh_compressed, volume_chunk.mesh_offset, volume_chunk.mesh_size);
+        Urho3D::MemoryBuffer mesh_compressed_buf(mesh_compressed);
+        MarchingCubesChunk::MeshData mesh;
+        if (MarchingCubesChunk::readMesh(mesh, mesh_compressed_buf)) {
+            chunk->setMesh(mesh, chunk_width * cube_width);
+            return;
+        }
+        URHO3D_LOGWARNING("MarchingCubes volume has invalid mesh!");
+    }
+
+    // Get a chunk of data from weightmap. This is a little bit more than
+    // the chunk volume, because normals need the neighbors of the corners.
+    Urho3D::IntVector3 begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE * stride;
+    Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * ((lod_chunk_width + 2) * stride + 1);
+    pageInPoints(begin, end);
+
+    // Bricks that were modified might have become uniform
+    wmap.compact(chunk_pos * chunk_width, (chunk_pos + Urho3D::IntVector3::ONE) * chunk_width);
+    point_materials.compact(chunk_pos * chunk_width, (chunk_pos + Urho3D::IntVector3::ONE) * chunk_width);
+
+    WeightMap chunk_materials;
+    if (stride == 1) {
+        wmap.getBlock(chunk_wmap, begin, end, 255);
+        point_materials.getBlock(chunk_materials, begin, end, 0);
+    } else {
+        // Pick every nth point
+        WeightMap lod_source;
+        wmap.getBlock(lod_source, begin, end, 255);
+        pickEveryNthPoint(chunk_wmap, lod_source, end.x_ - begin.x_, lod_chunk_width + 3, stride);
+        point_materials.getBlock(lod_source, begin, end, 0);
+        pickEveryNthPoint(chunk_materials, lod_source, end.x_ - begin.x_, lod_chunk_width + 3, stride);
+    }
+    // If every point has the first material, then materials are not needed
+    if (!areMaterialsUsed(chunk_materials)) {
+        chunk_materials.Clear();
+    }
+
+    // Do the rebuilding
+    MarchingCubesChunk::MeshOptions options;
+    options.skirts = lod_distance > 0;
+    options.compact_vertices = compact_vertices;
+    if (workqueue) {
+        chunk->startBackgroundRebuild(chunk_wmap, chunk_materials, lod_chunk_width, cube_width * stride, options, mesh_cache);
+        chunks_rebuilding.Insert(chunk_pos);
+    } else {
+        chunk->rebuild(chunk_wmap, chunk_materials, lod_chunk_width, cube_width * stride, options, mesh_cache);
+    }
+}
+
+MarchingCubes::GridWalk::GridWalk(Urho3D::Vector3 const& origin, Urho3D::Vector3 const& dir, float t, int cell_width, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) :
+    t(t)
+{
+    Urho3D::Vector3 pos = origin + dir * t;
+    for (unsigned axis = 0; axis < 3; ++ axis) {
+        float o = origin.Data()[axis];
+        float d = dir.Data()[axis];
+        this->begin[axis] = begin.Data()[axis];
+        this->end[axis] = end.Data()[axis];
+        cell[axis] = Urho3D::Clamp(Urho3D::FloorToInt(pos.Data()[axis] / cell_width), this->begin[axis], this->end[axis] - 1);
+        if (d > 0) {
+            step[axis] = 1;
+            t_next[axis] = ((cell[axis] + 1) * cell_width - o) / d;
+            t_delta[axis] = cell_width / d;
+        } else if (d < 0) {
+            step[axis] = -1;
+            t_next[axis] = (cell[axis] * cell_width - o) / d;
+            t_delta[axis] = -cell_width / d;
+        } else {
+            step[axis] = 0;
+            t_next[axis] = Urho3D::M_INFINITY;
+            t_delta[axis] = Urho3D::M_INFINITY;
+        }
+    }
+}
+
+float MarchingCubes::GridWalk::getCellEnd() const
+{
+    return Urho3D::Min(t_next[0], Urho3D::Min(t_next[1], t_next[2]));
+}
+
+bool MarchingCubes::GridWalk::next()
+{
+    unsigned axis = 0;
+    if (t_next[1] < t_next[axis]) {
+        axis = 1;
+    }
+    if (t_next[2] < t_next[axis]) {
+        axis = 2;
+    }
+    if (step[axis] == 0) {
+        return false;
+    }
+    t = t_next[axis];
+    t_next[axis] += t_delta[axis];
+    cell[axis] += step[axis];
+    return cell[axis] >= begin[axis] && cell[axis] < end[axis];
+}
+
+void MarchingCubes::rebuildChunksWithinBudget(WeightMap& chunk_wmap, Urho3D::WorkQueue* workqueue)
+{
+    Urho3D::HiresTimer timer;
+
+    Urho3D::PODVector<Urho3D::Camera*> cameras;
+    getCameras(cameras);
+
+    // Sort dirty chunks so that the most urgent ones are first
+    struct QueuedChunk
+    {
+        float priority;
+        Urho3D::IntVector3 pos;
+    };
+    Urho3D::PODVector<QueuedChunk> queue;
+    queue.Reserve(chunks_dirty.Size());
+    unsigned now = Urho3D::Time::GetSystemTime();
+    for (auto i = chunks_dirty.Begin(); i != chunks_dirty.End(); ++ i) {
+        QueuedChunk queued;
+        queued.priority = getRebuildPriority(i->first_, i->second_, now, cameras);
+        queued.pos = i->first_;
+        queue.Push(queued);
+    }
+    std::sort(queue.Buffer(), queue.Buffer() + queue.Size(), [](QueuedChunk const& chunk1, QueuedChunk const& chunk2) {
+        return chunk1.priority < chunk2.priority;
+    });
+
+    // At least one chunk is rebuilt every time, so the queue never gets
+    // stuck. Chunks are repositioned, because cube width or chunk width
+    // might have changed after the chunk was queued.
+    long long budget_usecs = rebuild_budget * 1000;
+    for (QueuedChunk const& queued : queue) {
+        rebuildChunk(queued.pos, true, chunk_wmap, workqueue);
+        chunks_dirty.Erase(queued.pos);
+        if (timer.GetUSec(false) >= budget_usecs) {
+            break;
+        }
+    }
+
+    some_chunks_dirty = !chunks_dirty.Empty();
+}
+
+void MarchingCubes::getCameras(Urho3D::PODVector<Urho3D::Camera*>& result) const
+{
+    result.Clear();
+    Urho3D::Renderer* renderer = GetSubsystem<Urho3D::Renderer>();
+    if (renderer) {
+        for (unsigned i = 0; i < renderer->GetNumViewports(); ++ i) {
+            Urho3D::Viewport* viewport = renderer->GetViewport(i);
+            if (viewport && viewport->GetScene() == GetScene() && viewport->GetCamera()) {
+                result.Push(viewport->GetCamera());
+            }
+        }
+    }
+}
+
+Urho3D::BoundingBox MarchingCubes::getChunkWorldBoundingBox(Urho3D::IntVector3 const& chunk_pos) const
+{
+    float chunk_total_width = chunk_width * cube_width;
+    Urho3D::BoundingBox bb(Urho3D::Vector3(chunk_pos.x_, chunk_pos.y_, chunk_pos.z_) * chunk_total_width, Urho3D::Vector3(chunk_pos.x_ + 1, chunk_pos.y_ + 1, chunk_pos.z_ + 1) * chunk_total_width);
+    return bb.Transformed(node_->GetWorldTransform());
+}
+
+float MarchingCubes::getChunkLodDistance(Urho3D::IntVector3 const& chunk_pos, Urho3D::PODVector<Urho3D::Camera*> const& cameras) const
+{
+    if (cameras.Empty()) {
+        return 0;
+    }
+    // Same as what drawables get when they are rendered, but from the nearest camera
+    Urho3D::BoundingBox world_bb = getChunkWorldBoundingBox(chunk_pos);
+    float scale = world_bb.Size().DotProduct(Urho3D::DOT_SCALE);
+    float result = Urho3D::M_INFINITY;
+    for (Urho3D::Camera* camera : cameras) {
+        result = Urho3D::Min(result, camera->GetLodDistance(camera->GetDistance(world_bb.Center()), scale, 1.0f));
+    }
+    return result;
+}
+
+float MarchingCubes::getRebuildPriority(Urho3D::IntVector3 const& chunk_pos, unsigned dirty_time, unsigned now, Urho3D::PODVector<Urho3D::Camera*> const& cameras) const
+{
+    Urho3D::BoundingBox world_bb = getChunkWorldBoundingBox(chunk_pos);
+    float world_chunk_width = chunk_width * cube_width * node_->GetWorldScale().x_;
+
+    // Distance is measured in chunks from the nearest camera
+    float distance = 0;
+    bool visible = cameras.Empty();
+    if (!cameras.Empty()) {
+        distance = Urho3D::M_INFINITY;
+        for (Urho3D::Camera* camera : cameras) {
+            distance = Urho3D::Min(distance, (world_bb.Center() - camera->GetNode()->GetWorldPosition()).Length() / world_chunk_width);
+            if (camera->GetFrustum().IsInsideFast(world_bb) != Urho3D::OUTSIDE) {
+                visible = true;
+            }
+        }
+    }
+    if (!visible) {
+        distance *= REBUILD_INVISIBLE_DISTANCE_MULTIPLIER;
+    }
+
+    // Waiting makes chunks more urgent
+    float age_secs = (now - dirty_time) / 1000.0f;
+    return distance - age_secs * REBUILD_AGE_CHUNKS_PER_SECOND;
+}
+
+void MarchingCubes::markChunkDirty(Urho3D::IntVector3 const& chunk_pos)
+{
+    // Keep the original time, so waiting chunks do not lose their place
+    if (!chunks_dirty.Contains(chunk_pos)) {
+        chunks_dirty[chunk_pos] = Urho3D::Time::GetSystemTime();
+    }
+    auto chunks_find = chunks.Find(chunk_pos);
+    if (chunks_find != chunks.End()) {
+        chunks_find->second_->markRebuildingNeeded();
+    }
+    some_chunks_dirty = true;
+}
+
+bool MarchingCubes::isChunkInsideVolume(Urho3D::IntVector3 const& chunk_pos) const
+{
+    return chunk_pos.x_ >= 0 && chunk_pos.y_ >= 0 && chunk_pos.z_ >= 0 &&
+           chunk_pos.x_ < chunks_size.x_ && chunk_pos.y_ < chunks_size.y_ && chunk_pos.z_ < chunks_size.z_;
+}
+
+bool MarchingCubes::isChunkInRange(Urho3D::IntVector3 const& chunk_pos, Urho3D::Vector3 const& focus, float radius) const
+{
+    if (radius <= 0) {
+        return true;
+    }
+    // Check distance to the closest point of chunk
+    float chunk_total_width = chunk_width * cube_width;
+    Urho3D::Vector3 chunk_min = Urho3D::Vector3(chunk_pos.x_, chunk_pos.y_, chunk_pos.z_) * chunk_total_width;
+    Urho3D::Vector3 closest(
+        Urho3D::Clamp(focus.x_, chunk_min.x_, chunk_min.x_ + chunk_total_width),
+        Urho3D::Clamp(focus.y_, chunk_min.y_, chunk_min.y_ + chunk_total_width),
+        Urho3D::Clamp(focus.z_, chunk_min.z_, chunk_min.z_ + chunk_total_width)
+    );
+    return (closest - focus).LengthSquared() <= radius * radius;
+}
+
+bool MarchingCubes::isVolumeMeshValid(Urho3D::IntVector3 const& chunk_pos) const
+{
+    if (!volume_file || volume_chunks[getChunkIndex(chunk_pos)].mesh_size == 0) {
+        return false;
+    }
+    if (volume_cube_width != cube_width || volume_meshes_skirts != (lod_distance > 0) || volume_meshes_compact != compact_vertices) {
+        return false;
+    }
+    // Mesh uses the points of neighbor chunks too
+    Urho3D::IntVector3 neighbor;
+    for (neighbor.z_ = Urho3D::Max(0, chunk_pos.z_ - 1); neighbor.z_ <= Urho3D::Min(chunks_size.z_ - 1, chunk_pos.z_ + 1); ++ neighbor.z_) {
+        for (neighbor.y_ = Urho3D::Max(0, chunk_pos.y_ - 1); neighbor.y_ <= Urho3D::Min(chunks_size.y_ - 1, chunk_pos.y_ + 1); ++ neighbor.y_) {
+            for (neighbor.x_ = Urho3D::Max(0, chunk_pos.x_ - 1); neighbor.x_ <= Urho3D::Min(chunks_size.x_ - 1, chunk_pos.x_ + 1); ++ neighbor.x_) {
+                if (chunks_versions[getChunkIndex(neighbor)] != 0) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool MarchingCubes::isChunkUniform(Urho3D::IntVector3 const& chunk_pos) const
+{
+    // Chunk mesh depends only on the points of chunk and the neighbor
+    // padding, so if the chunk and all its neighbors are fully solid or
+    // fully empty, then there cannot be any surface. Points outside
+    // the volume are considered solid.
+    unsigned chunk_volume = chunk_width * chunk_width * chunk_width;
+    bool solid_found = false;
+    bool empty_found = false;
+    Urho3D::IntVector3 neighbor;
+    for (neighbor.z_ = chunk_pos.z_ - 1; neighbor.z_ <= chunk_pos.z_ + 1; ++ neighbor.z_) {
+        for (neighbor.y_ = chunk_pos.y_ - 1; neighbor.y_ <= chunk_pos.y_ + 1; ++ neighbor.y_) {
+            for (neighbor.x_ = chunk_pos.x_ - 1; neighbor.x_ <= chunk_pos.x_ + 1; ++ neighbor.x_) {
+                if (neighbor.x_ < 0 || neighbor.x_ >= chunks_size.x_ ||
+                    neighbor.y_ < 0 || neighbor.y_ >= chunks_size.y_ ||
+                    neighbor.z_ < 0 || neighbor.z_ >= chunks_size.z_) {
+                    solid_found = true;
+                } else {
+                    unsigned solid_count = chunks_solid_counts[getChunkIndex(neighbor)];
+                    if (solid_count == 0) {
+                        empty_found = true;
+                    } else if (solid_count == chunk_volume) {
+                        solid_found = true;
+                    } else {
+                        return false;
+                    }
+                }
+                if (solid_found && empty_found) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+unsigned MarchingCubes::getChunkIndex(Urho3D::IntVector3 const& chunk_pos) const
+{
+    return chunk_pos.x_ + chunk_pos.y_ * chunks_size.x_ + chunk_pos.z_ * chunks_size.x_ * chunks_size.y_;
+}
+
+bool MarchingCubes::areChunksEmpty(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) const
+{
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = Urho3D::Max(0, begin.z_); chunk_pos.z_ < Urho3D::Min(chunks_size.z_, end.z_); ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = Urho3D::Max(0, begin.y_); chunk_pos.y_ < Urho3D::Min(chunks_size.y_, end.y_); ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = Urho3D::Max(0, begin.x_); chunk_pos.x_ < Urho3D::Min(chunks_size.x_, end.x_); ++ chunk_pos.x_) {
+                if (chunks_solid_counts[getChunkIndex(chunk_pos)] > 0) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool MarchingCubes::isSphereTouchingSolid(Urho3D::Vector3& result_normal, WeightMap& block, Urho3D::Vector3 const& center, float reach) const
+{
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    Urho3D::IntVector3 begin(
+        Urho3D::Max(0, Urho3D::CeilToInt(center.x_ - reach)),
+        Urho3D::Max(0, Urho3D::CeilToInt(center.y_ - reach)),
+        Urho3D::Max(0, Urho3D::CeilToInt(center.z_ - reach))
+    );
+    Urho3D::IntVector3 end(
+        Urho3D::Min(total_size.x_, Urho3D::FloorToInt(center.x_ + reach) + 1),
+        Urho3D::Min(total_size.y_, Urho3D::FloorToInt(center.y_ + reach) + 1),
+        Urho3D::Min(total_size.z_, Urho3D::FloorToInt(center.z_ + reach) + 1)
+    );
+    if (begin.x_ >= end.x_ || begin.y_ >= end.y_ || begin.z_ >= end.z_) {
+        return false;
+    }
+
+    getPoints(block, begin, end);
+
+    // Normal is the average direction from solid points to the center,
+    // and the points that are deeper inside the sphere weigh more.
+    bool touching = false;
+    result_normal = Urho3D::Vector3::ZERO;
+    unsigned char const* block_ptr = block.Buffer();
+    Urho3D::IntVector3 pos;
+    for (pos.z_ = begin.z_; pos.z_ < end.z_; ++ pos.z_) {
+        for (pos.y_ = begin.y_; pos.y_ < end.y_; ++ pos.y_) {
+            for (pos.x_ = begin.x_; pos.x_ < end.x_; ++ pos.x_) {
+                if (*block_ptr ++ < 128) {
+                    continue;
+                }
+                Urho3D::Vector3 diff = center - Urho3D::Vector3(pos.x_, pos.y_, pos.z_);
+                float distance = diff.Length();
+                if (distance > reach) {
+                    continue;
+                }
+                touching = true;
+                if (distance > Urho3D::M_EPSILON) {
+                    result_normal += diff * ((reach - distance) / distance);
+                }
+            }
+        }
+    }
+    if (result_normal != Urho3D::Vector3::ZERO) {
+        result_normal.Normalize();
+    }
+    return touching;
+}
+
+bool MarchingCubes::clipRay(float& t_min, float& t_max, Urho3D::Vector3 const& origin, Urho3D::Vector3 const& dir, Urho3D::Vector3 const& box_min, Urho3D::Vector3 const& box_max)
+{
+    for (unsigned axis = 0; axis < 3; ++ axis) {
+        float o = origin.Data()[axis];
+        float d = dir.Data()[axis];
+        float box_begin = box_min.Data()[axis];
+        float box_end = box_max.Data()[axis];
+        if (d == 0) {
+            if (o < box_begin || o > box_end) {
+                return false;
+            }
+            continue;
+        }
+        float t_begin = (box_begin - o) / d;
+        float t_end = (box_end - o) / d;
+        if (t_begin > t_end) {
+            Urho3D::Swap(t_begin, t_end);
+        }
+        t_min = Urho3D::Max(t_min, t_begin);
+        t_max = Urho3D::Min(t_max, t_end);
+    }
+    return t_min <= t_max;
+}
+
+bool MarchingCubes::raycastCube(float& result_t, uint8_t const* corners, Urho3D::Vector3 const& origin, Urho3D::Vector3 const& dir, float t_begin, float t_end)
+{
+    // Interpolated weight cannot be heavier than the corners
+    bool solid_found = false;
+    for (unsigned corner_i = 0; corner_i < 8; ++ corner_i) {
+        if (corners[corner_i] >= 128) {
+            solid_found = true;
+            break;
+        }
+    }
+    if (!solid_found) {
+        return false;
+    }
+
+    // Find the first solid sample, and then the exact position between it and the previous sample
+    float t_empty = t_begin;
+    for (unsigned sample_i = 0; sample_i <= RAYCAST_CUBE_SAMPLES; ++ sample_i) {
+        float t = t_begin + (t_end - t_begin) * sample_i / RAYCAST_CUBE_SAMPLES;
+        if (getCubeWeight(corners, origin + dir * t) < SURFACE_WEIGHT) {
+            t_empty = t;
+            continue;
+        }
+        if (sample_i > 0) {
+            for (unsigned i = 0; i < RAYCAST_REFINE_STEPS; ++ i) {
+                float t_middle = (t_empty + t) / 2;
+                if (getCubeWeight(corners, origin + dir * t_middle) < SURFACE_WEIGHT) {
+                    t_empty = t_middle;
+                } else {
+                    t = t_middle;
+                }
+            }
+        }
+        result_t = t;
+        return true;
+    }
+    return false;
+}
+
+float MarchingCubes::getCubeWeight(uint8_t const* corners, Urho3D::Vector3 const& pos)
+{
+    float x = Urho3D::Clamp(pos.x_, 0.0f, 1.0f);
+    float y = Urho3D::Clamp(pos.y_, 0.0f, 1.0f);
+    float z = Urho3D::Clamp(pos.z_, 0.0f, 1.0f);
+    float y0 = Urho3D::Lerp<float>(corners[0], corners[1], x) * (1 - y) + Urho3D::Lerp<float>(corners[2], corners[3], x) * y;
+    float y1 = Urho3D::Lerp<float>(corners[4], corners[5], x) * (1 - y) + Urho3D::Lerp<float>(corners[6], corners[7], x) * y;
+    return y0 * (1 - z) + y1 * z;
+}
+
+Urho3D::Vector3 MarchingCubes::getBlockNormal(WeightMap const& block, Urho3D::IntVector3 const& block_begin, Urho3D::IntVector3 const& block_size, Urho3D::Vector3 const& pos)
+{
+    // Pick the cube so that the neighbors of its corners are inside the block
+    Urho3D::IntVector3 cube_pos(
+        Urho3D::Clamp(Urho3D::FloorToInt(pos.x_), block_begin.x_ + 1, block_begin.x_ + block_size.x_ - 3),
+        Urho3D::Clamp(Urho3D::FloorToInt(pos.y_), block_begin.y_ + 1, block_begin.y_ + block_size.y_ - 3),
+        Urho3D::Clamp(Urho3D::FloorToInt(pos.z_), block_begin.z_ + 1, block_begin.z_ + block_size.z_ - 3)
+    );
+    float x = Urho3D::Clamp(pos.x_ - cube_pos.x_, 0.0f, 1.0f);
+    float y = Urho3D::Clamp(pos.y_ - cube_pos.y_, 0.0f, 1.0f);
+    float z = Urho3D::Clamp(pos.z_ - cube_pos.z_, 0.0f, 1.0f);
+
+    // Calculate gradients at corners, and interpolate them
+    int const ofs_y = block_size.x_;
+    int const ofs_z = block_size.x_ * block_size.y_;
+    Urho3D::IntVector3 cube_pos_in_block = cube_pos - block_begin;
+    Urho3D::Vector3 gradient = Urho3D::Vector3::ZERO;
+    for (unsigned corner_i = 0; corner_i < 8; ++ corner_i) {
+        int corner_x = cube_pos_in_block.x_ + (corner_i & 1);
+        int corner_y = cube_pos_in_block.y_ + ((corner_i >> 1) & 1);
+        int corner_z = cube_pos_in_block.z_ + (corner_i >> 2);
+        int ofs = corner_x + corner_y * ofs_y + corner_z * ofs_z;
+        Urho3D::Vector3 corner_gradient(
+            block[ofs + 1] - block[ofs - 1],
+            block[ofs + ofs_y] - block[ofs - ofs_y],
+            block[ofs + ofs_z] - block[ofs - ofs_z]
+        );
+        float weight = ((corner_i & 1) ? x : 1 - x) * ((corner_i & 2) ? y : 1 - y) * ((corner_i & 4) ? z : 1 - z);
+        gradient += corner_gradient * weight;
+    }
+
+    // Weights grow towards solid, so normal points to the other direction
+    if (gradient.LengthSquared() < Urho3D::M_EPSILON) {
+        return Urho3D::Vector3::ZERO;
+    }
+    return -gradient.Normalized();
+}
+
+void MarchingCubes::getChunksUsingPoint(Urho3D::IntVector3& result_begin, Urho3D::IntVector3& result_end, Urho3D::IntVector3 const& pos) const
+{
+    // Weightmap chunk of a chunk starts one point before the chunk and ends two points after it
+    int chunk_width_i = chunk_width;
+    result_begin = Urho3D::IntVector3(
+        Urho3D::Max(0, (pos.x_ + chunk_width_i - 2) / chunk_width_i - 1),
+        Urho3D::Max(0, (pos.y_ + chunk_width_i - 2) / chunk_width_i - 1),
+        Urho3D::Max(0, (pos.z_ + chunk_width_i - 2) / chunk_width_i - 1)
+    );
+    result_end = Urho3D::IntVector3(
+        Urho3D::Min(chunks_size.x_, (pos.x_ + 1) / chunk_width_i + 1),
+        Urho3D::Min(chunks_size.y_, (pos.y_ + 1) / chunk_width_i + 1),
+        Urho3D::Min(chunks_size.z_, (pos.z_ + 1) / chunk_width_i + 1)
+    );
+}
+
+void MarchingCubes::onPointChanged(Urho3D::IntVector3 const& pos, uint8_t old_value, uint8_t new_value)
+{
+    unsigned chunk_i = getChunkIndex(pos / chunk_width);
+    ++ chunks_versions[chunk_i];
+    if ((old_value >= 128) != (new_value >= 128)) {
+        unsigned& solid_count = chunks_solid_counts[chunk_i];
+        if (new_value >= 128) {
+            ++ solid_count;
+        } else {
+            -- solid_count;
+        }
+    }
+}
+
+void MarchingCubes::resetChunksVersions()
+{
+    chunks_versions.Clear();
+    chunks_versions.Resize(chunks_size.x_ * chunks_size.y_ * chunks_size.z_, 0);
+    network_base_dirty = true;
+}
+
+void MarchingCubes::closeVolume()
+{
+    volume_file.Reset();
+    volume_chunks.Clear();
+    decoded_volume_chunks.Clear();
+}
+
+void MarchingCubes::readVolumeChunk(WeightMap& result, unsigned chunk_i, bool materials) const
+{
+    VolumeChunk const& volume_chunk = volume_chunks[chunk_i];
+    unsigned chunk_volume = chunk_width * chunk_width * chunk_width;
+    unsigned offset = materials ? volume_chunk.materials_offset : volume_chunk.data_offset;
+    unsigned size = materials ? volume_chunk.materials_size : volume_chunk.data_size;
+    if (size == 0) {
+        result.Resize(chunk_volume);
+        memset(result.Buffer(), materials ? 0 : volume_chunk.uniform_value, chunk_volume);
+        return;
+    }
+
+    Urho3D::PODVector<unsigned char> chunk_compressed;
+    readVolumeBlob(chunk_compressed, offset, size);
+    Urho3D::MemoryBuffer chunk_compressed_buf(chunk_compressed);
+    Urho3D::VectorBuffer chunk_vbuf;
+    if (!Urho3D::DecompressStream(chunk_vbuf, chunk_compressed_buf) || chunk_vbuf.GetSize() != chunk_volume) {
+        throw std::runtime_error("Unable to decompress MarchingCubes volume chunk!");
+    }
+    result = chunk_vbuf.GetBuffer();
+}
+
+MarchingCubes::WeightMap const& MarchingCubes::getDecodedVolumeChunk(unsigned chunk_i, bool materials) const
+{
+    ++ decoded_volume_chunks_use_counter;
+    DecodedVolumeChunk* oldest = nullptr;
+    for (DecodedVolumeChunk& decoded : decoded_volume_chunks) {
+        if (decoded.chunk_i == chunk_i && decoded.materials == materials) {
+            decoded.last_used = decoded_volume_chunks_use_counter;
+            return decoded.data;
+        }
+        if (!oldest || decoded.last_used < oldest->last_used) {
+            oldest = &decoded;
+        }
+    }
+
+    // Reuse the buffer of the least recently used chunk, if the cache is full
+    if (decoded_volume_chunks.Size() < DECODED_VOLUME_CHUNKS_CACHE_SIZE) {
+        decoded_volume_chunks.Resize(decoded_volume_chunks.Size() + 1);
+        oldest = &decoded_volume_chunks.Back();
+    }
+    // Entry is not valid if reading fails
+    oldest->chunk_i = volume_chunks.Size();
+    readVolumeChunk(oldest->data, chunk_i, materials);
+    oldest->chunk_i = chunk_i;
+    oldest->materials = materials;
+    oldest->last_used = decoded_volume_chunks_use_counter;
+    return oldest->data;
+}
+
+void MarchingCubes::readVolumeBlob(Urho3D::PODVector<unsigned char>& result, unsigned offset, unsigned size) const
+{
+    volume_file->Seek(volume_file_begin + offset);
+    result.Resize(size);
+    if (volume_file->Read(result.Buffer(), size) != size) {
+        throw std::runtime_error("Unable to read MarchingCubes volume!");
+    }
+}
+
+void MarchingCubes::pageInPoints(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end)
+{
+    if (!volume_file) {
+        return;
+    }
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    Urho3D::IntVector3 inside_begin(Urho3D::Max(0, begin.x_), Urho3D::Max(0, begin.y_), Urho3D::Max(0, begin.z_));
+    Urho3D::IntVector3 inside_end(Urho3D::Min(total_size.x_, end.x_), Urho3D::Min(total_size.y_, end.y_), Urho3D::Min(total_size.z_, end.z_));
+    if (inside_begin.x_ >= inside_end.x_ || inside_begin.y_ >= inside_end.y_ || inside_begin.z_ >= inside_end.z_) {
+        return;
+    }
+    Urho3D::IntVector3 chunks_begin = inside_begin / chunk_width;
+    Urho3D::IntVector3 chunks_end = (inside_end - Urho3D::IntVector3::ONE) / chunk_width + Urho3D::IntVector3::ONE;
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = chunks_begin.z_; chunk_pos.z_ < chunks_end.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+                pageInChunk(getChunkIndex(chunk_pos));
+            }
+        }
+    }
+}
+
+void MarchingCubes::pageInChunk(unsigned chunk_i)
+{
+    VolumeChunk& volume_chunk = volume_chunks[chunk_i];
+    if (volume_chunk.resident) {
+        return;
+    }
+    Urho3D::IntVector3 begin = getChunkPosition(chunk_i) * chunk_width;
+    Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * chunk_width;
+    if (volume_chunk.data_size == 0) {
+        wmap.fill(begin, end, volume_chunk.uniform_value);
+    } else {
+        wmap.setBlock(begin, end, getDecodedVolumeChunk(chunk_i, false).Buffer());
+    }
+    wmap.compact(begin, end);
+    if (volume_chunk.materials_size == 0) {
+        point_materials.fill(begin, end, 0);
+    } else {
+        point_materials.setBlock(begin, end, getDecodedVolumeChunk(chunk_i, true).Buffer());
+    }
+    point_materials.compact(begin, end);
+    volume_chunk.resident = true;
+}
+
+void MarchingCubes::pageOutChunk(unsigned chunk_i)
+{
+    // Make the points uniform, so their bricks can be freed
+    Urho3D::IntVector3 begin = getChunkPosition(chunk_i) * chunk_width;
+    Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * chunk_width;
+    wmap.fill(begin, end, 0);
+    wmap.compact(begin, end);
+    point_materials.fill(begin, end, 0);
+    point_materials.compact(begin, end);
+    volume_chunks[chunk_i].resident = false;
+}
+
+void MarchingCubes::getPoints(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) const
+{
+    getPointsOrMaterials(result, begin, end, false);
+}
+
+void MarchingCubes::getPointMaterials(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) const
+{
+    getPointsOrMaterials(result, begin, end, true);
+}
+
+void MarchingCubes::getPointsOrMaterials(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, bool materials) const
+{
+    if (materials) {
+        point_materials.getBlock(result, begin, end, 0);
+    } else {
+        wmap.getBlock(result, begin, end, 255);
+    }
+    if (!volume_file) {
+        return;
+    }
+
+    // Replace the points of those chunks that are only in the volume file
+    Urho3D::IntVector3 size = end - begin;
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    Urho3D::IntVector3 inside_begin(Urho3D::Max(0, begin.x_), Urho3D::Max(0, begin.y_), Urho3D::Max(0, begin.z_));
+    Urho3D::IntVector3 inside_end(Urho3D::Min(total_size.x_, end.x_), Urho3D::Min(total_size.y_, end.y_), Urho3D::Min(total_size.z_, end.z_));
+    if (inside_begin.x_ >= inside_end.x_ || inside_begin.y_ >= inside_end.y_ || inside_begin.z_ >= inside_end.z_) {
+        return;
+    }
+    Urho3D::IntVector3 chunks_begin = inside_begin / chunk_width;
+    Urho3D::IntVector3 chunks_end = (inside_end - Urho3D::IntVector3::ONE) / chunk_width + Urho3D::IntVector3::ONE;
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = chunks_begin.z_; chunk_pos.z_ < chunks_end.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+                unsigned chunk_i = getChunkIndex(chunk_pos);
+                if (volume_chunks[chunk_i].resident) {
+                    continue;
+                }
+                WeightMap const& chunk_wmap = getDecodedVolumeChunk(chunk_i, materials);
+
+                // Copy the part that overlaps the box
+                Urho3D::IntVector3 chunk_begin = chunk_pos * chunk_width;
+                Urho3D::IntVector3 copy_begin(Urho3D::Max(inside_begin.x_, chunk_begin.x_), Urho3D::Max(inside_begin.y_, chunk_begin.y_), Urho3D::Max(inside_begin.z_, chunk_begin.z_));
+                Urho3D::IntVector3 copy_end(Urho3D::Min<int>(inside_end.x_, chunk_begin.x_ + chunk_width), Urho3D::Min<int>(inside_end.y_, chunk_begin.y_ + chunk_width), Urho3D::Min<int>(inside_end.z_, chunk_begin.z_ + chunk_width));
+                for (int z = copy_begin.z_; z < copy_end.z_; ++ z) {
+                    for (int y = copy_begin.y_; y < copy_end.y_; ++ y) {
+                        unsigned char const* src = &chunk_wmap[(copy_begin.x_ - chunk_begin.x_) + ((y - chunk_begin.y_) + (z - chunk_begin.z_) * chunk_width) * chunk_width];
+                        memcpy(&result[(copy_begin.x_ - begin.x_) + (y - begin.y_) * size.x_ + (z - begin.z_) * size.x_ * size.y_], src, copy_end.x_ - copy_begin.x_);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void MarchingCubes::pickEveryNthPoint(WeightMap& result, WeightMap const& source, unsigned source_width, unsigned result_width, unsigned stride)
+{
+    result.Resize(result_width * result_width * result_width);
+    unsigned char* result_ptr = result.Buffer();
+    for (unsigned z = 0; z < result_width; ++ z) {
+        for (unsigned y = 0; y < result_width; ++ y) {
+            unsigned char const* source_row = &source[(y + z * source_width) * source_width * stride];
+            for (unsigned x = 0; x < result_width; ++ x) {
+                *result_ptr ++ = source_row[x * stride];
+            }
+        }
+    }
+}
+
+bool MarchingCubes::areMaterialsUsed(WeightMap const& materials)
+{
+    for (unsigned char material : materials) {
+        if (material != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Urho3D::IntVector3 MarchingCubes::getChunkPosition(unsigned chunk_i) const
+{
+    return Urho3D::IntVector3(
+        chunk_i % chunks_size.x_,
+        chunk_i / chunks_size.x_ % chunks_size.y_,
+        chunk_i / chunks_size.x_ / chunks_size.y_
+    );
+}
+
+unsigned MarchingCubes::updateNetworkDeltaChunks() const
+{
+    unsigned total_size = 0;
+    WeightMap chunk_wmap;
+    WeightMap chunk_materials;
+    for (unsigned chunk_i = 0; chunk_i < chunks_versions.Size(); ++ chunk_i) {
+        if (chunks_versions[chunk_i] == network_base_versions[chunk_i]) {
+            continue;
+        }
+        // Compress the chunk again, if it has changed
+        NetworkDeltaChunk& delta_chunk = network_delta_chunks[chunk_i];
+        if (delta_chunk.data.Empty() || delta_chunk.version != chunks_versions[chunk_i]) {
+            Urho3D::IntVector3 begin = getChunkPosition(chunk_i) * chunk_width;
+            wmap.getBlock(chunk_wmap, begin, begin + Urho3D::IntVector3::ONE * chunk_width, 255);
+            point_materials.getBlock(chunk_materials, begin, begin + Urho3D::IntVector3::ONE * chunk_width, 0);
+            // Weights are followed by materials
+            chunk_wmap += chunk_materials;
+            Urho3D::MemoryBuffer chunk_buf(chunk_wmap);
+            Urho3D::VectorBuffer chunk_compressed_vbuf;
+            if (!Urho3D::CompressStream(chunk_compressed_vbuf, chunk_buf)) {
+                throw std::runtime_error("Unable to compress MarchingCubes network delta!");
+            }
+            delta_chunk.version = chunks_versions[chunk_i];
+            delta_chunk.data = chunk_compressed_vbuf.GetBuffer();
+        }
+        total_size += delta_chunk.data.Size();
+    }
+    return total_size;
+}
+
+void MarchingCubes::updateChunksSolidCounts()
+{
+    chunks_solid_counts.Clear();
+    chunks_solid_counts.Resize(chunks_size.x_ * chunks_size.y_ * chunks_size.z_, 0);
+
+    WeightMap chunk_wmap;
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = 0; chunk_pos.z_ < chunks_size.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = 0; chunk_pos.y_ < chunks_size.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = 0; chunk_pos.x_ < chunks_size.x_; ++ chunk_pos.x_) {
+                Urho3D::IntVector3 begin = chunk_pos * chunk_width;
+                wmap.getBlock(chunk_wmap, begin, begin + Urho3D::IntVector3::ONE * chunk_width, 255);
+                unsigned& solid_count = chunks_solid_counts[getChunkIndex(chunk_pos)];
+                for (unsigned char point : chunk_wmap) {
+                    if (point >= 128) {
+                        ++ solid_count;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void MarchingCubes::applyReadyBackgroundRebuilds()
+{
+    for (auto i = chunks_rebuilding.Begin(); i != chunks_rebuilding.End(); ) {
+        auto chunks_find = chunks.Find(*i);
+        if (chunks_find == chunks.End()) {
+            i = chunks_rebuilding.Erase(i);
+            continue;
+        }
+        // If rebuilding was cancelled, then chunk is
+        // marked dirty and will be restarted later.
+        MarchingCubesChunk* chunk = chunks_find->second_;
+        if (chunk->applyBackgroundRebuildIfReady(mesh_cache) || !chunk->isBackgroundRebuildPending()) {
+            i = chunks_rebuilding.Erase(i);
+        } else {
+            ++ i;
+        }
+    }
+}
+
+void MarchingCubes::updateLods()
+{
+    Urho3D::PODVector<Urho3D::Camera*> cameras;
+    getCameras(cameras);
+    for (auto i = chunks.Begin(); i != chunks.End(); ++ i) {
+        MarchingCubesChunk* chunk = i->second_;
+        if (getLodForDistance(getChunkLodDistance(i->first_, cameras), chunk->getLod()) != chunk->getLod()) {
+            markChunkDirty(i->first_);
+        }
+    }
+}
+
+unsigned MarchingCubes::getMaxLod() const
+{
+    unsigned max_lod = 0;
+    while (max_lod < MAX_LOD && chunk_width % (2 << max_lod) == 0) {
+        ++ max_lod;
+    }
+    return max_lod;
+}
+
+unsigned MarchingCubes::getLodForDistance(float distance, unsigned current_lod) const
+{
+    unsigned max_lod = getMaxLod();
+    unsigned lod = 0;
+    float lod_end = lod_distance;
+    while (lod < max_lod && distance >= lod_end) {
+        ++ lod;
+        lod_end *= 2;
+    }
+
+    // Do not switch back and forth near the limit
+    if (lod > current_lod && distance < lod_distance * (1 << current_lod) * (1 + LOD_HYSTERESIS)) {
+        return current_lod;
+    }
+    if (lod < current_lod && current_lod <= max_lod && distance > lod_distance * (1 << (current_lod - 1)) * (1 - LOD_HYSTERESIS)) {
+        return current_lod;
+    }
+    return lod;
+}
+
+void MarchingCubes::updateSubscriptions(Urho3D::Scene* scene)
+{
+    if (scene && (background_rebuilding || lod_distance > 0 || rebuild_budget > 0)) {
+        SubscribeToEvent(scene, Urho3D::E_SCENEPOSTUPDATE, URHO3D_HANDLER(MarchingCubes, handleScenePostUpdate));
+    } else {
+        UnsubscribeFromEvent(Urho3D::E_SCENEPOSTUPDATE);
+    }
+}
+
+void MarchingCubes::handleScenePostUpdate(Urho3D::StringHash event_type, Urho3D::VariantMap& event_data)
+{
+    (void)event_type;
+    (void)event_data;
+    if (lod_distance > 0) {
+        updateLods();
+    }
+    rebuildChunksIfNeeded();
+    applyReadyBackgroundRebuilds();
+}
+
+Urho3D::PODVector<unsigned char> MarchingCubes::getWeightmapAttr() const
+{
+    WeightMap wmap_dense;
+    getPoints(wmap_dense, Urho3D::IntVector3::ZERO, chunks_size * chunk_width);
+    Urho3D::MemoryBuffer wmap_buf(wmap_dense);
+    Urho3D::VectorBuffer wmap_compressed_vbuf;
+    if (!Urho3D::CompressStream(wmap_compressed_vbuf, wmap_buf)) {
+        throw std::runtime_error("Unable to compress MarchingCubes.wmap for attribute serialization!");
+    }
+    return wmap_compressed_vbuf.GetBuffer();
+}
+
+void MarchingCubes::setWeightmapAttr(Urho3D::PODVector<unsigned char> const& value)
+{
+    // Decompress the new weightmap
+    Urho3D::MemoryBuffer wmap_compressed_buf(value);
+    Urho3D::VectorBuffer wmap_vbuf;
+    if (!Urho3D::DecompressStream(wmap_vbuf, wmap_compressed_buf)) {
+        throw std::runtime_error("Unable to decompress MarchingCubes.wmap for attribute deserialization!");
+    }
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    if (wmap_vbuf.GetSize() != unsigned(total_size.x_ * total_size.y_ * total_size.z_)) {
+        URHO3D_LOGWARNING("MarchingCubes.wmap has invalid size!");
+        return;
+    }
+
+    setWeightmap(wmap_vbuf.GetData());
+
+    // Network base needs to be sent again
+    network_base_dirty = true;
+}
+
+Urho3D::PODVector<unsigned char> MarchingCubes::getPointMaterialsAttr() const
+{
+    WeightMap materials_dense;
+    getPointMaterials(materials_dense, Urho3D::IntVector3::ZERO, chunks_size * chunk_width);
+    // If every point has the first material, then nothing needs to be stored
+    if (!areMaterialsUsed(materials_dense)) {
+        return Urho3D::PODVector<unsigned char>();
+    }
+    Urho3D::MemoryBuffer materials_buf(materials_dense);
+    Urho3D::VectorBuffer materials_compressed_vbuf;
+    if (!Urho3D::CompressStream(materials_compressed_vbuf, materials_buf)) {
+        throw std::runtime_error("Unable to compress MarchingCubes.point_materials for attribute serialization!");
+    }
+    return materials_compressed_vbuf.GetBuffer();
+}
+
+void MarchingCubes::setPointMaterialsAttr(Urho3D::PODVector<unsigned char> const& value)
+{
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    unsigned total_volume = total_size.x_ * total_size.y_ * total_size.z_;
+    if (value.Empty()) {
+        WeightMap materials_dense;
+        materials_dense.Resize(total_volume, 0);
+        setPointMaterials(materials_dense.Buffer());
+    } else {
+        Urho3D::MemoryBuffer materials_compressed_buf(value);
+        Urho3D::VectorBuffer materials_vbuf;
+        if (!Urho3D::DecompressStream(materials_vbuf, materials_compressed_buf)) {
+            throw std::runtime_error("Unable to decompress MarchingCubes.point_materials for attribute deserialization!");
+        }
+        if (materials_vbuf.GetSize() != total_volume) {
+            URHO3D_LOGWARNING("MarchingCubes.point_materials has invalid size!");
+            return;
+        }
+        setPointMaterials(materials_vbuf.GetData());
+    }
+
+    // Network base needs to be sent again
+    network_base_dirty = true;
+}
+
+Urho3D::PODVector<unsigned char> MarchingCubes::getNetworkBaseAttr() const
+{
+    // If so much has changed after the base that the delta
+    // would be big, then it is better to send a new base.
+    if (!network_base_dirty && updateNetworkDeltaChunks() > NETWORK_DELTA_MAX_SIZE) {
+        network_base_dirty = true;
+    }
+
+    if (network_base_dirty) {
+        Urho3D::VectorBuffer base_vbuf;
+        base_vbuf.WriteVLE(chunks_versions.Size());
+        for (unsigned version : chunks_versions) {
+            base_vbuf.WriteUInt(version);
+        }
+        WeightMap wmap_dense;
+        getPoints(wmap_dense, Urho3D::IntVector3::ZERO, chunks_size * chunk_width);
+        base_vbuf.Write(wmap_dense.Buffer(), wmap_dense.Size());
+        getPointMaterials(wmap_dense, Urho3D::IntVector3::ZERO, chunks_size * chunk_width);
+        base_vbuf.Write(wmap_dense.Buffer(), wmap_dense.Size());
+        base_vbuf.Seek(0);
+
+        Urho3D::VectorBuffer base_compressed_vbuf;
+        if (!Urho3D::CompressStream(base_compressed_vbuf, base_vbuf)) {
+            throw std::runtime_error("Unable to compress MarchingCubes network base!");
+        }
+        network_base = base_compressed_vbuf.GetBuffer();
+        network_base_versions = chunks_versions;
+        network_delta_chunks.Clear();
+        network_base_dirty = false;
+    }
+
+    return network_base;
+}
+
+void MarchingCubes::setNetworkBaseAttr(Urho3D::PODVector<unsigned char> const& value)
+{
+    if (value.Empty() || value == network_base) {
+        return;
+    }
+
+    Urho3D::MemoryBuffer base_compressed_buf(value);
+    Urho3D::VectorBuffer base_vbuf;
+    if (!Urho3D::DecompressStream(base_vbuf, base_compressed_buf)) {
+        throw std::runtime_error("Unable to decompress MarchingCubes network base!");
+    }
+    base_vbuf.Seek(0);
+
+    // Validate sizes
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    unsigned total_volume = total_size.x_ * total_size.y_ * total_size.z_;
+    unsigned versions_size = base_vbuf.ReadVLE();
+    if (versions_size != chunks_versions.Size() || base_vbuf.GetSize() - base_vbuf.GetPosition() != versions_size * 4 + total_volume * 2) {
+        URHO3D_LOGWARNING("MarchingCubes network base has invalid size!");
+        return;
+    }
+
+    for (unsigned& version : chunks_versions) {
+        version = base_vbuf.ReadUInt();
+    }
+    setWeightmap(base_vbuf.GetData() + base_vbuf.GetPosition());
+    setPointMaterials(base_vbuf.GetData() + base_vbuf.GetPosition() + total_volume);
+
+    network_base = value;
+    network_base_versions = chunks_versions;
+    network_delta_chunks.Clear();
+    network_base_dirty = false;
+}
+
+Urho3D::PODVector<unsigned char> MarchingCubes::getNetworkDeltaAttr() const
+{
+    // Delta is relative to base, so make sure base is up to date
+    if (network_base_dirty) {
+        getNetworkBaseAttr();
+    }
+    updateNetworkDeltaChunks();
+
+    Urho3D::VectorBuffer delta_vbuf;
+    delta_vbuf.WriteVLE(network_delta_chunks.Size());
+    for (auto i = network_delta_chunks.Begin(); i != network_delta_chunks.End(); ++ i) {
+        delta_vbuf.WriteVLE(i->first_);
+        delta_vbuf.WriteUInt(i->second_.version);
+        delta_vbuf.WriteBuffer(i->second_.data);
+    }
+    return delta_vbuf.GetBuffer();
+}
+
+void MarchingCubes::setNetworkDeltaAttr(Urho3D::PODVector<unsigned char> const& value)
+{
+    if (value.Empty()) {
+        return;
+    }
+
+    Urho3D::MemoryBuffer delta_buf(value);
+    unsigned delta_chunks_size = delta_buf.ReadVLE();
+    WeightMap chunk_wmap;
+    for (unsigned delta_chunk_i = 0; delta_chunk_i < delta_chunks_size; ++ delta_chunk_i) {
+        unsigned chunk_i = delta_buf.ReadVLE();
+        unsigned version = delta_buf.ReadUInt();
+        Urho3D::PODVector<unsigned char> chunk_compressed = delta_buf.ReadBuffer();
+        if (chunk_i >= chunks_versions.Size()) {
+            URHO3D_LOGWARNING("MarchingCubes network delta has invalid chunk!");
+            return;
+        }
+
+        // Skip chunks that are already up to date
+        if (version <= chunks_versions[chunk_i]) {
+            continue;
+        }
+
+        Urho3D::MemoryBuffer chunk_compressed_buf(chunk_compressed);
+        Urho3D::VectorBuffer chunk_vbuf;
+        if (!Urho3D::DecompressStream(chunk_vbuf, chunk_compressed_buf)) {
+            throw std::runtime_error("Unable to decompress MarchingCubes network delta!");
+        }
+        unsigned chunk_volume = chunk_width * chunk_width * chunk_width;
+        if (chunk_vbuf.GetSize() != chunk_volume * 2) {
+            URHO3D_LOGWARNING("MarchingCubes network delta has invalid chunk size!");
+            return;
+        }
+
+        // Apply new data of chunk
+        Urho3D::IntVector3 begin = getChunkPosition(chunk_i) * chunk_width;
+        Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * chunk_width;
+        wmap.setBlock(begin, end, chunk_vbuf.GetData());
+        point_materials.setBlock(begin, end, chunk_vbuf.GetData() + chunk_volume);
+        chunks_versions[chunk_i] = version;
+        if (volume_file) {
+            volume_chunks[chunk_i].resident = true;
+        }
+
+        // Update solid count
+        unsigned& solid_count = chunks_solid_counts[chunk_i];
+        solid_count = 0;
+        for (unsigned i = 0; i < chunk_volume; ++ i) {
+            if (chunk_vbuf.GetData()[i] >= 128) {
+                ++ solid_count;
+            }
+        }
+
+        // Mark all chunks dirty that use the points of this chunk
+        Urho3D::IntVector3 chunks_begin;
+        Urho3D::IntVector3 chunks_end;
+        Urho3D::IntVector3 unused;
+        getChunksUsingPoint(chunks_begin, unused, begin);
+        getChunksUsingPoint(unused, chunks_end, end - Urho3D::IntVector3::ONE);
+        Urho3D::IntVector3 dirty_chunk_pos;
+        for (dirty_chunk_pos.z_ = chunks_begin.z_; dirty_chunk_pos.z_ < chunks_end.z_; ++ dirty_chunk_pos.z_) {
+            for (dirty_chunk_pos.y_ = chunks_begin.y_; dirty_chunk_pos.y_ < chunks_end.y_; ++ dirty_chunk_pos.y_) {
+                for (dirty_chunk_pos.x_ = chunks_begin.x_; dirty_chunk_pos.x_ < chunks_end.x_; ++ dirty_chunk_pos.x_) {
+                    markChunkDirty(dirty_chunk_pos);
+                }
+            }
+        }
+    }
+}
+
+void MarchingCubes::setWeightmap(unsigned char const* data)
+{
+    // Store old weightmap, so it is possible to compare what changed.
+    // This is cheap, because bricks are shared until they are modified.
+    BrickedWeightMap wmap_old = wmap;
+
+    // Points that are only in the volume file cannot be compared
+    if (volume_file) {
+        closeVolume();
+        all_chunks_dirty = true;
+    }
+
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    if (wmap.getSize() != total_size) {
+        wmap.resize(total_size, 0);
+    }
+    wmap.setDense(data);
+    updateChunksSolidCounts();
+
+    // Now compare old and new weightmap, and check what chunks need rebuiding.
+    // However, if all chunks are marked as dirty, then this can be skipped.
+    if (all_chunks_dirty) {
+        return;
+    }
+    WeightMap chunk_wmap_old;
+    WeightMap chunk_wmap_new;
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = 0; chunk_pos.z_ < chunks_size.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = 0; chunk_pos.y_ < chunks_size.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = 0; chunk_pos.x_ < chunks_size.x_; ++ chunk_pos.x_) {
+                // If rebuilding is already needed, then skip the chunk
+                if (chunks_dirty.Contains(chunk_pos)) {
+                    continue;
+                }
+
+                // Get a chunk of data from both old and new weightmaps. If they differ, then rebuilding is needed.
+                Urho3D::IntVector3 begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE;
+                Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * (chunk_width + 3);
+                wmap_old.getBlock(chunk_wmap_old, begin, end, 255);
+                wmap.getBlock(chunk_wmap_new, begin, end, 255);
+                if (chunk_wmap_new != chunk_wmap_old) {
+                    markChunkDirty(chunk_pos);
+                }
+            }
+        }
+    }
+}
+
+void MarchingCubes::setPointMaterials(unsigned char const* data)
+{
+    BrickedWeightMap materials_old = point_materials;
+
+    // Meshes in the volume file would have old materials
+    if (volume_file) {
+        pageInPoints(Urho3D::IntVector3::ZERO, chunks_size * chunk_width);
+        closeVolume();
+        all_chunks_dirty = true;
+    }
+
+    Urho3D::IntVector3 total_size = chunks_size * chunk_width;
+    if (point_materials.getSize() != total_size) {
+        point_materials.resize(total_size, 0);
+    }
+    point_materials.setDense(data);
+
+    // Rebuild those chunks that use changed materials
+    if (all_chunks_dirty) {
+        return;
+    }
+    WeightMap chunk_materials_old;
+    WeightMap chunk_materials_new;
+    Urho3D::IntVector3 chunk_pos;
+    for (chunk_pos.z_ = 0; chunk_pos.z_ < chunks_size.z_; ++ chunk_pos.z_) {
+        for (chunk_pos.y_ = 0; chunk_pos.y_ < chunks_size.y_; ++ chunk_pos.y_) {
+            for (chunk_pos.x_ = 0; chunk_pos.x_ < chunks_size.x_; ++ chunk_pos.x_) {
+                if (chunks_dirty.Contains(chunk_pos)) {
+                    continue;
+                }
+                Urho3D::IntVector3 begin = chunk_pos * chunk_width - Urho3D::IntVector3::ONE;
+                Urho3D::IntVector3 end = begin + Urho3D::IntVector3::ONE * (chunk_width + 3);
+                materials_old.getBlock(chunk_materials_old, begin, end, 0);
+                point_materials.getBlock(chunk_materials_new, begin, end, 0);
+                if (chunk_materials_new != chunk_materials_old) {
+                    markChunkDirty(chunk_pos);
+                }
+            }
+        }
+    }
+}
+
+Urho3D::ResourceRef MarchingCubes::getMaterialAttr() const
+{
+    return GetResourceRef(mats[0], Urho3D::Material::GetTypeStatic());
+}
+
+void MarchingCubes::setMaterialAttr(Urho3D::ResourceRef const& value)
+{
+    Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+    setMaterial(resources->GetResource<Urho3D::Material>(value.name_));
+}
+
+Urho3D::ResourceRefList MarchingCubes::getMaterialsAttr() const
+{
+    Urho3D::ResourceRefList mats_attr(Urho3D::Material::GetTypeStatic());
+    for (Urho3D::Material* mat : mats) {
+        mats_attr.names_.Push(Urho3D::GetResourceName(mat));
+    }
+    return mats_attr;
+}
+
+void MarchingCubes::setMaterialsAttr(Urho3D::ResourceRefList const& value)
+{
+    Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+    // Slots that are not in the list are cleared
+    unsigned mats_count = Urho3D::Max(value.names_.Size(), mats.Size());
+    for (unsigned i = 0; i < mats_count; ++ i) {
+        Urho3D::Material* mat = nullptr;
+        if (i < value.names_.Size()) {
+            mat = resources->GetResource<Urho3D::Material>(value.names_[i]);
+        }
+        setMaterial(i, mat);
+    }
+}
+
+MarchingCubesChunk::MarchingCubesChunk(Urho3D::Context* context) :
+    Urho3D::Drawable(context, Urho3D::DRAWABLE_GEOMETRY),
+    vbuf(new Urho3D::VertexBuffer(context)),
+    ibuf(new Urho3D::IndexBuffer(context)),
+    rebuild_needed(true),
+    total_width(0),
+    lod(0),
+    keep_collision_triangles(false),
+    region(nullptr)
+{
+    mats.Push(nullptr);
+}
+
+void MarchingCubesChunk::setMaterials(Urho3D::PODVector<Urho3D::Material*> const& mats)
+{
+    this->mats = mats;
+    for (unsigned i = 0; i < batches_.Size(); ++ i) {
+        batches_[i].material_ = getBatchMaterial(i);
+    }
+    if (region) {
+        region->updateBatches();
+    }
+}
+
+void MarchingCubesChunk::setMesh(MeshData const& mesh, float total_width)
+{
+    background_rebuild.discardResult();
+    applyMesh(mesh, total_width);
+    rebuild_needed = false;
+}
+
+void MarchingCubesChunk::setKeepCollisionTriangles(bool keep)
+{
+    keep_collision_triangles = keep;
+    if (!keep) {
+        collision_tris.Clear();
+        collision_nodes.Clear();
+    }
+}
+
+void MarchingCubesChunk::getCollisions(Collisions::Collisions& result, Urho3D::Vector3 const& pos1, Urho3D::Vector3 const& pos2, float radius, float extra_radius) const
+{
+    if (collision_nodes.Empty()) {
+        return;
+    }
+
+    Urho3D::BoundingBox bb(pos1, pos1);
+    bb.Merge(pos2);
+    bb.min_ -= Urho3D::Vector3::ONE * (radius + extra_radius);
+    bb.max_ += Urho3D::Vector3::ONE * (radius + extra_radius);
+
+    // Tree is balanced, so this is deep enough for any mesh
+    unsigned stack[64];
+    unsigned stack_size = 0;
+    stack[stack_size ++] = 0;
+    while (stack_size > 0) {
+        unsigned node_i = stack[-- stack_size];
+        CollisionNode const& node = collision_nodes[node_i];
+        if (node.bb.IsInside(bb) == Urho3D::OUTSIDE) {
+            continue;
+        }
+        if (node.tris_size == 0) {
+            stack[stack_size ++] = node.second_child;
+            stack[stack_size ++] = node_i + 1;
+            continue;
+        }
+        for (unsigned tri_i = node.tris_begin; tri_i < node.tris_begin + node.tris_size; ++ tri_i) {
+            Urho3D::Vector3 const* tri = &collision_tris[tri_i * 3];
+            unsigned result_original_size = result.Size();
+            if (pos1 == pos2) {
+                Collisions::getRawSphereCollisionToTriangle(result, pos1, radius, tri[0], tri[1], tri[2], extra_radius, false);
+            } else {
+                Collisions::getRawCapsuleCollisionToTriangle(result, pos1, pos2, radius, tri[0], tri[1], tri[2], extra_radius, false);
+            }
+            // Drop collisions from the back side
+            if (result.Size() > result_original_size) {
+                Urho3D::Vector3 tri_normal = (tri[1] - tri[0]).CrossProduct(tri[2] - tri[0]);
+                if (result.Back().getNormal().DotProduct(tri_normal) < 0) {
+                    result.Pop();
+                }
+            }
+        }
+    }
+}
+
+void MarchingCubesChunk::setRegion(MarchingCubesRegion* region)
+{
+    this->region = region;
+    // Chunks in regions are drawn by the region, so they are kept out of the octree
+    SetEnabled(!region);
+}
+
+void MarchingCubesChunk::setViewDistance(float distance, float lod_distance)
+{
+    distance_ = distance;
+    lodDistance_ = lod_distance;
+}
+
+void MarchingCubesChunk::markRebuildingNeeded()
+{
+    rebuild_needed = true;
+    // If there is unfinished rebuild, then its result is not up to date any more
+    background_rebuild.discardResult();
+}
+
+bool MarchingCubesChunk::isRebuildNeeded() const
+{
+    return rebuild_needed;
+}
+
+unsigned MarchingCubesChunk::getLod() const
+{
+    return lod;
+}
+
+void MarchingCubesChunk::setLod(unsigned lod)
+{
+    this->lod = lod;
+}
+
+void MarchingCubesChunk::rebuild(MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MeshOptions const& options, MarchingCubesMeshCache* mesh_cache)
+{
+    // This will be more up to date than possible unfinished background rebuild
+    background_rebuild.discardResult();
+
+    MeshData mesh;
+    if (!mesh_cache || !mesh_cache->get(mesh, wmap, materials, chunk_width, cube_width, options)) {
+        buildMesh(mesh, wmap, materials, chunk_width, cube_width, options);
+        if (mesh_cache) {
+            mesh_cache->put(mesh, wmap, materials, chunk_width, cube_width, options);
+        }
+    }
+    applyMesh(mesh, chunk_width * cube_width);
+
+    rebuild_needed = false;
+}
+
+void MarchingCubesChunk::startBackgroundRebuild(MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MeshOptions const& options, MarchingCubesMeshCache* mesh_cache)
+{
+    background_rebuild.discardResult();
+
+    // If the mesh has been built before, then there is no need for background work
+    if (mesh_cache) {
+        MeshData mesh;
+        if (mesh_cache->get(mesh, wmap, materials, chunk_width, cube_width, options)) {
+            applyMesh(mesh, chunk_width * cube_width);
+            rebuild_needed = false;
+            return;
+        }
+    }
+
+    BackgroundRebuildResult* result = new BackgroundRebuildResult();
+    result->wmap = wmap;
+    result->materials = materials;
+    result->chunk_width = chunk_width;
+    result->cube_width = cube_width;
+    result->options = options;
+    background_rebuild = WorkItemResult(result);
+
+    Urho3D::SharedPtr<WorkItemWithResult> workitem(new WorkItemWithResult(background_rebuild));
+    workitem->workFunction_ = doBackgroundRebuild;
+    GetSubsystem<Urho3D::WorkQueue>()->AddWorkItem(workitem);
+
+    rebuild_needed = false;
+}
+
+bool MarchingCubesChunk::isBackgroundRebuildPending()
+{
+    return background_rebuild.getActualWorkItemResult() != nullptr;
+}
+
+bool MarchingCubesChunk::applyBackgroundRebuildIfReady(MarchingCubesMeshCache* mesh_cache)
+{
+    if (!background_rebuild.isResultReady()) {
+        return false;
+    }
+
+    BackgroundRebuildResult* result = static_cast<BackgroundRebuildResult*>(background_rebuild.getActualWorkItemResult());
+    {
+        Urho3D::MutexLock lock(result->getMutex());
+        applyMesh(result->mesh, result->chunk_width * result->cube_width);
+        if (mesh_cache) {
+            mesh_cache->put(result->mesh, result->wmap, result->materials, result->chunk_width, result->cube_width, result->options);
+        }
+    }
+    background_rebuild.discardResult();
+
+    return true;
+}
+
+void MarchingCubesChunk::writeMesh(Urho3D::Serializer& dest, MeshData const& mesh)
+{
+    Urho3D::VectorBuffer mesh_vbuf;
+    mesh_vbuf.WriteBool(mesh.compact_vertices);
+    mesh_vbuf.WriteVLE(mesh.vdata.Size());
+    mesh_vbuf.Write(mesh.vdata.Buffer(), mesh.vdata.Size() * sizeof(float));
+    mesh_vbuf.WriteVLE(mesh.idata.Size());
+    mesh_vbuf.Write(mesh.idata.Buffer(), mesh.idata.Size() * sizeof(unsigned));
+    mesh_vbuf.WriteVLE(mesh.material_ranges.Size());
+    for (MaterialRange const& range : mesh.material_ranges) {
+        mesh_vbuf.WriteUByte(range.material);
+        mesh_vbuf.WriteVLE(range.index_start);
+        mesh_vbuf.WriteVLE(range.index_count);
+    }
+    mesh_vbuf.Seek(0);
+    if (!Urho3D::CompressStream(dest, mesh_vbuf)) {
+        throw std::runtime_error("Unable to compress MarchingCubesChunk mesh!");
+    }
+}
+
+bool MarchingCubesChunk::readMesh(MeshData& result, Urho3D::Deserializer& src)
+{
+    Urho3D::VectorBuffer mesh_vbuf;
+    if (!Urho3D::DecompressStream(mesh_vbuf, src)) {
+        return false;
+    }
+    mesh_vbuf.Seek(0);
+
+    result.compact_vertices = mesh_vbuf.ReadBool();
+    unsigned vertex_floats = result.compact_vertices ? 6 : 12;
+    unsigned vdata_size = mesh_vbuf.ReadVLE();
+    if (vdata_size % vertex_floats != 0 || vdata_size * sizeof(float) > mesh_vbuf.GetSize() - mesh_vbuf.GetPosition()) {
+        return false;
+    }
+    result.vdata.Resize(vdata_size);
+    mesh_vbuf.Read(result.vdata.Buffer(), vdata_size * sizeof(float));
+
+    unsigned idata_size = mesh_vbuf.ReadVLE();
+    if (idata_size % 3 != 0 || idata_size * sizeof(unsigned) > mesh_vbuf.GetSize() - mesh_vbuf.GetPosition()) {
+        return false;
+    }
+    result.idata.Resize(idata_size);
+    mesh_vbuf.Read(result.idata.Buffer(), idata_size * sizeof(unsigned));
+
+    // Ranges must be inside the index data
+    unsigned material_ranges_size = mesh_vbuf.ReadVLE();
+    if (material_ranges_size > idata_size / 3) {
+        return false;
+    }
+    result.material_ranges.Resize(material_ranges_size);
+    for (MaterialRange& range : result.material_ranges) {
+        range.material = mesh_vbuf.ReadUByte();
+        range.index_start = mesh_vbuf.ReadVLE();
+        range.index_count = mesh_vbuf.ReadVLE();
+        if (range.index_start > idata_size || range.index_count > idata_size - range.index_start) {
+            return false;
+        }
+    }
+    if (!mesh_vbuf.IsEof()) {
+        return false;
+    }
+
+    // Indices must refer to existing vertices
+    unsigned vertex_count = vdata_size / vertex_floats;
+    for (unsigned i : result.idata) {
+        if (i >= vertex_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void MarchingCubesChunk::buildMesh(MeshData& result, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MeshOptions const& options)
+{
+    // Chunk width with the extra margin
+    unsigned cwe = chunk_width + 3;
+    assert(wmap.Size() == cwe * cwe * cwe);
+    assert(materials.Empty() || materials.Size() == wmap.Size());
+
+    // Offsets of cube corners in the weight map
+    unsigned corner_ofss[8];
+    for (unsigned i = 0; i < 8; ++ i) {
+        corner_ofss[i] = (i & 1) + ((i >> 1) & 1) * cwe + ((i >> 2) & 1) * cwe * cwe;
+    }
+
+    CubeCases const& cube_cases = getCubeCases();
+
+    // Find cubes of the chunk that are neither fully empty nor fully solid
+    ActiveCubes active_cubes;
+    findActiveCubes(active_cubes, wmap, cwe);
+
+    // Count triangles first, so they are allocated only once
+    unsigned tris_count = 0;
+    for (ActiveCube const& active_cube : active_cubes) {
+        tris_count += cube_cases.cases[active_cube.mask].tris_size;
+    }
+
+    Triangles tris;
+    tris.Reserve(tris_count);
+    for (ActiveCube const& active_cube : active_cubes) {
+        int x = int(active_cube.x) - 1;
+        int y = int(active_cube.y) - 1;
+        int z = int(active_cube.z) - 1;
+
+        // Get corner values
+        unsigned ofs = active_cube.x + active_cube.y * cwe + active_cube.z * cwe * cwe;
+        uint8_t corners[8] = {
+            wmap[ofs],
+            wmap[ofs + 1],
+            wmap[ofs + cwe],
+            wmap[ofs + 1 + cwe],
+            wmap[ofs + cwe * cwe],
+            wmap[ofs + 1 + cwe * cwe],
+            wmap[ofs + cwe + cwe * cwe],
+            wmap[ofs + 1 + cwe + cwe * cwe]
+        };
+
+        // Cube uses the material of its most solid corner
+        uint8_t material = 0;
+        if (!materials.Empty()) {
+            unsigned solidest_corner_i = 0;
+            for (unsigned corner_i = 1; corner_i < 8; ++ corner_i) {
+                if (corners[corner_i] > corners[solidest_corner_i]) {
+                    solidest_corner_i = corner_i;
                 }
+            }
+            material = materials[ofs + corner_ofss[solidest_corner_i]];
+        }
 
-                ++ ofs;
+        // Emit triangles using the precalculated table
+        CubeCase const& cube_case = cube_cases.cases[active_cube.mask];
+        Urho3D::Vector3 cube_pos(x, y, z);
+        for (unsigned tri_i = 0; tri_i < cube_case.tris_size; ++ tri_i) {
+            uint8_t const* tri_edges = cube_case.edges + tri_i * 3;
+            tris.Push(Triangle(
+                (cube_pos + getEdgeVertex(tri_edges[0], corners)) * cube_width,
+                (cube_pos + getEdgeVertex(tri_edges[1], corners)) * cube_width,
+                (cube_pos + getEdgeVertex(tri_edges[2], corners)) * cube_width
+            ));
+            Triangle& tri = tris.Back();
+            tri.material = material;
+            for (unsigned corner_i = 0; corner_i < 3; ++ corner_i) {
+                uint8_t edge = tri_edges[corner_i];
+                tri.lattice_edges[corner_i] = (ofs + corner_ofss[edge / 3]) * 3 + edge % 3;
             }
-            ++ ofs;
         }
-        ofs += cwe;
     }
-    assert(ofs + cwe * cwe == wmap.Size());
 
-    // Calculate normals for vertices, and if they are used my multiple Triangles, then smooth them.
+    // Calculate normals of vertices from the gradient of weights. Padding contains the
+    // neighbors of all corners, so normals at chunk borders match the neighbor chunks.
+    // Every vertex lies on exactly one edge of the lattice, so shared vertices are found using edges.
     PositionsAndNormals poss_nrms;
+    Urho3D::PODVector<unsigned> edges_poss_nrms;
+    edges_poss_nrms.Resize(cwe * cwe * cwe * 3, Urho3D::M_MAX_UNSIGNED);
     for (Triangle& tri : tris) {
-        Urho3D::Vector3 normal = tri.getNormal();
         for (unsigned corner_i = 0; corner_i < 3; ++ corner_i) {
-            Urho3D::Vector3 const& pos = tri.poss[corner_i];
-            bool found = false;
-            for (unsigned pos_nrm_i = 0; pos_nrm_i < poss_nrms.Size(); ++ pos_nrm_i) {
-                PositionAndNormal& pos_nrm = poss_nrms[pos_nrm_i];
-                if ((pos_nrm.pos - pos).LengthSquared() < MERGE_VERTEX_THRESHOLD_TO_2) {
-                    found = true;
-                    pos_nrm.normal += normal;
-                    tri.poss_nrms_i[corner_i] = pos_nrm_i;
-                    break;
+            unsigned lattice_edge = tri.lattice_edges[corner_i];
+            unsigned& pos_nrm_i = edges_poss_nrms[lattice_edge];
+            if (pos_nrm_i == Urho3D::M_MAX_UNSIGNED) {
+                unsigned ofs_begin = lattice_edge / 3;
+                unsigned axis = lattice_edge % 3;
+                unsigned ofs_end = ofs_begin + (axis == 0 ? 1 : axis == 1 ? cwe : cwe * cwe);
+                float em = getEdgePosition(wmap[ofs_begin], wmap[ofs_end]);
+                Urho3D::Vector3 gradient = getGradient(wmap, ofs_begin, cwe).Lerp(getGradient(wmap, ofs_end, cwe), em);
+                // Weights grow towards solid, so normal points to the other direction.
+                // If the gradient vanishes, then the triangle has to do.
+                Urho3D::Vector3 normal;
+                if (gradient.LengthSquared() < Urho3D::M_EPSILON) {
+                    normal = tri.getNormal();
+                } else {
+                    normal = -gradient.Normalized();
                 }
+                pos_nrm_i = poss_nrms.Size();
+                poss_nrms.Push(PositionAndNormal(tri.poss[corner_i], normal));
             }
-            if (!found) {
-                tri.poss_nrms_i[corner_i] = poss_nrms.Size();
-                poss_nrms.Push(PositionAndNormal(pos, normal));
-            }
+            tri.poss_nrms_i[corner_i] = pos_nrm_i;
         }
     }
-    // Normalize all normals
-    for (PositionAndNormal& pos_nrm : poss_nrms) {
-        pos_nrm.normal.Normalize();
-    }
 
-    // Remove temporary triangles
-    for (unsigned i = 0; i < tris.Size(); ) {
-        Triangle& tri = tris[i];
-        if (tri.temporary) {
-            tris.EraseSwap(i);
-        } else {
-            ++ i;
+    // Add skirts. Triangle edges that lie on the border of chunk form the
+    // outline of the surface there, and they are extended into the solid.
+    if (options.skirts) {
+        float total_width = chunk_width * cube_width;
+        unsigned tris_size = tris.Size();
+        for (unsigned tri_i = 0; tri_i < tris_size; ++ tri_i) {
+            for (unsigned corner_i = 0; corner_i < 3; ++ corner_i) {
+                Triangle const& tri = tris[tri_i];
+                unsigned corner2_i = (corner_i + 1) % 3;
+                Urho3D::Vector3 const& pos1 = tri.poss[corner_i];
+                Urho3D::Vector3 const& pos2 = tri.poss[corner2_i];
+                bool on_border = false;
+                for (unsigned axis = 0; axis < 3 && !on_border; ++ axis) {
+                    on_border = (Urho3D::Abs(pos1.Data()[axis]) < WELD_VERTEX_THRESHOLD && Urho3D::Abs(pos2.Data()[axis]) < WELD_VERTEX_THRESHOLD) ||
+                                (Urho3D::Abs(pos1.Data()[axis] - total_width) < WELD_VERTEX_THRESHOLD && Urho3D::Abs(pos2.Data()[axis] - total_width) < WELD_VERTEX_THRESHOLD);
+                }
+                if (!on_border) {
+                    continue;
+                }
+                // Skirt uses the same vertex normals, so its lighting matches the surface
+                unsigned pos_nrm1_i = tri.poss_nrms_i[corner_i];
+                unsigned pos_nrm2_i = tri.poss_nrms_i[corner2_i];
+                Urho3D::Vector3 pos1_bottom = pos1 - poss_nrms[pos_nrm1_i].normal * cube_width;
+                Urho3D::Vector3 pos2_bottom = pos2 - poss_nrms[pos_nrm2_i].normal * cube_width;
+                // Edge is in reverse order, so the skirt faces the same way as the triangle
+                Triangle skirt1(pos2, pos1, pos1_bottom);
+                skirt1.poss_nrms_i[0] = pos_nrm2_i;
+                skirt1.poss_nrms_i[1] = pos_nrm1_i;
+                skirt1.poss_nrms_i[2] = pos_nrm1_i;
+                skirt1.material = tri.material;
+                Triangle skirt2(pos2, pos1_bottom, pos2_bottom);
+                skirt2.poss_nrms_i[0] = pos_nrm2_i;
+                skirt2.poss_nrms_i[1] = pos_nrm1_i;
+                skirt2.poss_nrms_i[2] = pos_nrm2_i;
+                skirt2.material = tri.material;
+                tris.Push(skirt1);
+                tris.Push(skirt2);
+            }
         }
     }
 
+    // Group triangles by material, so every material gets a continuous range of indices
+    if (!materials.Empty()) {
+        std::stable_sort(tris.Buffer(), tris.Buffer() + tris.Size(), [](Triangle const& tri1, Triangle const& tri2) {
+            return tri1.material < tri2.material;
+        });
+    }
+
     // Convert triangles to vertex and index data.
-    Urho3D::PODVector<float> vdata_raw;
-    Urho3D::PODVector<unsigned> idata_raw;
+    Urho3D::PODVector<float>& vdata_raw = result.vdata;
+    Urho3D::PODVector<unsigned>& idata_raw = result.idata;
+    vdata_raw.Clear();
+    idata_raw.Clear();
+    result.material_ranges.Clear();
+    result.compact_vertices = options.compact_vertices;
     Urho3D::PODVector<float> corner_vdata_raw;
+    VertexLookup vertex_lookup;
     for (Triangle const& tri : tris) {
+        // Every corner adds one index
+        if (result.material_ranges.Empty() || result.material_ranges.Back().material != tri.material) {
+            MaterialRange range;
+            range.material = tri.material;
+            range.index_start = idata_raw.Size();
+            range.index_count = 0;
+            result.material_ranges.Push(range);
+        }
+        result.material_ranges.Back().index_count += 3;
+
         // Precalculate some normal and tangent stuff
         Urho3D::Vector3 vrts_normals[3];
         Urho3D::Vector3 vrts_normals_avg;
@@ -1306,6 +2925,11 @@ void MarchingCubesChunk::rebuild(MarchingCubes::WeightMap const& wmap, unsigned
             corner_vdata_raw.Push(vrt_normal.x_);
             corner_vdata_raw.Push(vrt_normal.y_);
             corner_vdata_raw.Push(vrt_normal.z_);
+            // Compact vertices calculate the rest in shader
+            if (options.compact_vertices) {
+                addVertexToRawData(corner_vdata_raw, vdata_raw, idata_raw, vertex_lookup);
+                continue;
+            }
             // Texture coordinates
             Urho3D::Vector2 texcoord;
             if (normal_abs.x_ > normal_abs.y_ && normal_abs.x_ > normal_abs.z_) {
@@ -1329,36 +2953,220 @@ void MarchingCubesChunk::rebuild(MarchingCubes::WeightMap const& wmap, unsigned
             corner_vdata_raw.Push(tangent.z_);
             corner_vdata_raw.Push(1.0f);
             // Add to main containers
-            addVertexToRawData(corner_vdata_raw, vdata_raw, idata_raw);
+            addVertexToRawData(corner_vdata_raw, vdata_raw, idata_raw, vertex_lookup);
         }
     }
+}
+
+void MarchingCubesChunk::applyMesh(MeshData const& mesh, float total_width)
+{
+    this->total_width = total_width;
+
+    // Vertex format
+    Urho3D::PODVector<Urho3D::VertexElement> elements;
+    elements.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
+    unsigned vertex_floats;
+    if (mesh.compact_vertices) {
+        elements.Push(Urho3D::VertexElement(Urho3D::TYPE_UBYTE4_NORM, Urho3D::SEM_NORMAL));
+        vertex_floats = 6;
+    } else {
+        elements.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
+        elements.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR2, Urho3D::SEM_TEXCOORD));
+        elements.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR4, Urho3D::SEM_TANGENT));
+        vertex_floats = 12;
+    }
 
-    // Create actual Vertex and IndexBuffers
-    if (vbuf->GetVertexCount() != vdata_raw.Size() / 12) {
-        vbuf->SetSize(vdata_raw.Size() / 12, Urho3D::MASK_POSITION | Urho3D::MASK_NORMAL | Urho3D::MASK_TEXCOORD1 | Urho3D::MASK_TANGENT);
+    // Create actual Vertex and IndexBuffers. If possible, use 16 bit indices.
+    Urho3D::PODVector<float> const& vdata_raw = mesh.vdata;
+    Urho3D::PODVector<unsigned> const& idata_raw = mesh.idata;
+    unsigned vertex_count = vdata_raw.Size() / vertex_floats;
+    bool large_indices = vertex_count > 0xffff;
+    if (vbuf->GetVertexCount() != vertex_count || vbuf->GetVertexSize() != Urho3D::VertexBuffer::GetVertexSize(elements)) {
+        vbuf->SetSize(vertex_count, elements);
     }
-    if (ibuf->GetIndexCount() != idata_raw.Size()) {
-        ibuf->SetSize(idata_raw.Size(), true);
+    if (ibuf->GetIndexCount() != idata_raw.Size() || ibuf->GetIndexSize() != (large_indices ? 4 : 2)) {
+        ibuf->SetSize(idata_raw.Size(), large_indices);
     }
-    if (!tris.Empty()) {
-        float* vbuf_data = (float*)vbuf->Lock(0, vbuf->GetVertexCount());
-        for (float f : vdata_raw) {
-            *vbuf_data ++ = f;
+    if (!idata_raw.Empty()) {
+        if (mesh.compact_vertices) {
+            unsigned char* vbuf_data = (unsigned char*)vbuf->Lock(0, vertex_count);
+            for (unsigned vrt_i = 0; vrt_i < vertex_count; ++ vrt_i) {
+                float const* vrt = &vdata_raw[vrt_i * vertex_floats];
+                memcpy(vbuf_data, vrt, sizeof(float) * 3);
+                vbuf_data += sizeof(float) * 3;
+                for (unsigned i = 0; i < 3; ++ i) {
+                    *vbuf_data ++ = Urho3D::Clamp(Urho3D::RoundToInt((vrt[3 + i] * 0.5f + 0.5f) * 255), 0, 255);
+                }
+                *vbuf_data ++ = 0;
+            }
+        } else {
+            float* vbuf_data = (float*)vbuf->Lock(0, vertex_count);
+            for (float f : vdata_raw) {
+                *vbuf_data ++ = f;
+            }
         }
         vbuf->Unlock();
         vbuf->ClearDataLost();
-        unsigned* ibuf_data = (unsigned*)ibuf->Lock(0, ibuf->GetIndexCount());
-        for (unsigned i : idata_raw) {
-            *ibuf_data ++ = i;
+        if (large_indices) {
+            unsigned* ibuf_data = (unsigned*)ibuf->Lock(0, ibuf->GetIndexCount());
+            for (unsigned i : idata_raw) {
+                *ibuf_data ++ = i;
+            }
+        } else {
+            uint16_t* ibuf_data = (uint16_t*)ibuf->Lock(0, ibuf->GetIndexCount());
+            for (unsigned i : idata_raw) {
+                *ibuf_data ++ = i;
+            }
         }
         ibuf->Unlock();
         ibuf->ClearDataLost();
     }
-    if (!geometry->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, idata_raw.Size(), 0, vdata_raw.Size() / 12)) {
-        throw std::runtime_error("Unable to set Geometry draw range!");
+
+    // One batch for every material. Meshes without ranges use the first material.
+    material_ranges = mesh.material_ranges;
+    if (material_ranges.Empty()) {
+        MaterialRange range;
+        range.material = 0;
+        range.index_start = 0;
+        range.index_count = idata_raw.Size();
+        material_ranges.Push(range);
+    }
+    while (geometries.Size() < material_ranges.Size()) {
+        Urho3D::SharedPtr<Urho3D::Geometry> geometry(new Urho3D::Geometry(context_));
+        geometry->SetVertexBuffer(0, vbuf);
+        geometry->SetIndexBuffer(ibuf);
+        geometries.Push(geometry);
+    }
+    batches_.Resize(material_ranges.Size());
+    for (unsigned i = 0; i < material_ranges.Size(); ++ i) {
+        MaterialRange const& range = material_ranges[i];
+        if (!geometries[i]->SetDrawRange(Urho3D::TRIANGLE_LIST, range.index_start, range.index_count, 0, vertex_count)) {
+            throw std::runtime_error("Unable to set Geometry draw range!");
+        }
+        batches_[i].geometry_ = geometries[i];
+        batches_[i].geometryType_ = Urho3D::GEOM_STATIC_NOINSTANCING;
+        batches_[i].material_ = getBatchMaterial(i);
     }
 
-    rebuild_needed = false;
+    buildCollisionTriangles(mesh);
+
+    if (region) {
+        region->updateBatches();
+    }
+}
+
+void MarchingCubesChunk::buildCollisionTriangles(MeshData const& mesh)
+{
+    collision_tris.Clear();
+    collision_nodes.Clear();
+    if (!keep_collision_triangles || mesh.idata.Empty()) {
+        return;
+    }
+
+    unsigned vertex_floats = mesh.compact_vertices ? 6 : 12;
+    unsigned tris_size = mesh.idata.Size() / 3;
+    Urho3D::PODVector<Urho3D::Vector3> tris_poss(tris_size * 3);
+    Urho3D::PODVector<Urho3D::Vector3> tris_centers(tris_size);
+    Urho3D::PODVector<unsigned> tris_order(tris_size);
+    for (unsigned tri_i = 0; tri_i < tris_size; ++ tri_i) {
+        Urho3D::Vector3 center = Urho3D::Vector3::ZERO;
+        for (unsigned i = 0; i < 3; ++ i) {
+            Urho3D::Vector3 pos(&mesh.vdata[mesh.idata[tri_i * 3 + i] * vertex_floats]);
+            tris_poss[tri_i * 3 + i] = pos;
+            center += pos;
+        }
+        tris_centers[tri_i] = center / 3;
+        tris_order[tri_i] = tri_i;
+    }
+
+    buildCollisionNode(tris_order, tris_poss, tris_centers, 0, tris_size);
+
+    // Store triangles in the order of nodes
+    collision_tris.Resize(tris_size * 3);
+    for (unsigned tri_i = 0; tri_i < tris_size; ++ tri_i) {
+        for (unsigned i = 0; i < 3; ++ i) {
+            collision_tris[tri_i * 3 + i] = tris_poss[tris_order[tri_i] * 3 + i];
+        }
+    }
+}
+
+void MarchingCubesChunk::buildCollisionNode(Urho3D::PODVector<unsigned>& tris_order, Urho3D::PODVector<Urho3D::Vector3> const& tris_poss, Urho3D::PODVector<Urho3D::Vector3> const& tris_centers, unsigned begin, unsigned end)
+{
+    unsigned node_i = collision_nodes.Size();
+    collision_nodes.Push(CollisionNode());
+
+    Urho3D::BoundingBox bb;
+    Urho3D::BoundingBox centers_bb;
+    for (unsigned i = begin; i < end; ++ i) {
+        unsigned tri_i = tris_order[i];
+        bb.Merge(tris_poss[tri_i * 3]);
+        bb.Merge(tris_poss[tri_i * 3 + 1]);
+        bb.Merge(tris_poss[tri_i * 3 + 2]);
+        centers_bb.Merge(tris_centers[tri_i]);
+    }
+    collision_nodes[node_i].bb = bb;
+    collision_nodes[node_i].tris_begin = begin;
+
+    if (end - begin <= COLLISION_NODE_MAX_TRIANGLES) {
+        collision_nodes[node_i].tris_size = end - begin;
+        collision_nodes[node_i].second_child = 0;
+        return;
+    }
+
+    // Split at the median of the longest axis
+    Urho3D::Vector3 centers_size = centers_bb.Size();
+    unsigned axis = 0;
+    if (centers_size.y_ > centers_size.x_) {
+        axis = 1;
+    }
+    if (centers_size.z_ > centers_size.Data()[axis]) {
+        axis = 2;
+    }
+    unsigned middle = (begin + end) / 2;
+    std::nth_element(tris_order.Buffer() + begin, tris_order.Buffer() + middle, tris_order.Buffer() + end, [&tris_centers, axis](unsigned tri1_i, unsigned tri2_i) {
+        return tris_centers[tri1_i].Data()[axis] < tris_centers[tri2_i].Data()[axis];
+    });
+
+    collision_nodes[node_i].tris_size = 0;
+    buildCollisionNode(tris_order, tris_poss, tris_centers, begin, middle);
+    collision_nodes[node_i].second_child = collision_nodes.Size();
+    buildCollisionNode(tris_order, tris_poss, tris_centers, middle, end);
+}
+
+Urho3D::Material* MarchingCubesChunk::getBatchMaterial(unsigned batch_i) const
+{
+    unsigned material_i = batch_i < material_ranges.Size() ? material_ranges[batch_i].material : 0;
+    if (material_i < mats.Size() && mats[material_i]) {
+        return mats[material_i];
+    }
+    return mats[0];
+}
+
+void MarchingCubesChunk::doBackgroundRebuild(Urho3D::WorkItem const* workitem, unsigned thread_i)
+{
+    (void)thread_i;
+    WorkItemWithResult const* workitem_wr = static_cast<WorkItemWithResult const*>(workitem);
+    BackgroundRebuildResult* result = static_cast<BackgroundRebuildResult*>(workitem_wr->getActualWorkItemResult());
+
+    // Input is never modified after the WorkItem is started, so it can be read without locking.
+    MeshData mesh;
+    buildMesh(mesh, result->wmap, result->materials, result->chunk_width, result->cube_width, result->options);
+
+    Urho3D::MutexLock lock(result->getMutex());
+    result->mesh.vdata.Swap(mesh.vdata);
+    result->mesh.idata.Swap(mesh.idata);
+    result->mesh.material_ranges.Swap(mesh.material_ranges);
+    result->mesh.compact_vertices = mesh.compact_vertices;
+    result->setResultsReady();
+}
+
+void MarchingCubesChunk::OnMarkedDirty(Urho3D::Node* node)
+{
+    Urho3D::Drawable::OnMarkedDirty(node);
+    // Moving the chunk changes the bounding box of the region too
+    if (region) {
+        region->markChunkMoved();
+    }
 }
 
 void MarchingCubesChunk::OnWorldBoundingBoxUpdate()
@@ -1367,7 +3175,685 @@ void MarchingCubesChunk::OnWorldBoundingBoxUpdate()
     worldBoundingBox_ = bb.Transformed(node_->GetWorldTransform());
 }
 
-MarchingCubesChunk::Triangles MarchingCubesChunk::finalizeTriangles(bool temporary, bool flip_normals, float cube_width, int x, int y, int z, Rotation rot, MakeFunction func, uint8_t const* corners)
+void MarchingCubesChunk::findActiveCubes(ActiveCubes& result, MarchingCubes::WeightMap const& wmap, unsigned cwe)
+{
+    result.Clear();
+
+    // Get solid bits of those rows of weight map that are corners of the cubes
+    unsigned row_words = (cwe + 63) / 64;
+    Urho3D::PODVector<uint64_t> solid_bits;
+    solid_bits.Resize(cwe * cwe * row_words, 0);
+    for (unsigned z = 1; z < cwe - 1; ++ z) {
+        for (unsigned y = 1; y < cwe - 1; ++ y) {
+            unsigned row_i = y + z * cwe;
+            getSolidBits(&solid_bits[row_i * row_words], &wmap[row_i * cwe], cwe);
+        }
+    }
+
+    // Go rows of cubes through. Every row of cubes is
+    // touched by four rows of weight map, i.e. cube corners.
+    for (unsigned z = 1; z < cwe - 2; ++ z) {
+        for (unsigned y = 1; y < cwe - 2; ++ y) {
+            uint64_t const* rows[4] = {
+                &solid_bits[(y + z * cwe) * row_words],
+                &solid_bits[(y + 1 + z * cwe) * row_words],
+                &solid_bits[(y + (z + 1) * cwe) * row_words],
+                &solid_bits[(y + 1 + (z + 1) * cwe) * row_words]
+            };
+            for (unsigned word_i = 0; word_i < row_words; ++ word_i) {
+                // Get bits of corners at the beginning of cubes and at the end of cubes
+                uint64_t bits_begin[4];
+                uint64_t bits_end[4];
+                for (unsigned i = 0; i < 4; ++ i) {
+                    bits_begin[i] = rows[i][word_i];
+                    bits_end[i] = bits_begin[i] >> 1;
+                    if (word_i + 1 < row_words) {
+                        bits_end[i] |= rows[i][word_i + 1] << 63;
+                    }
+                }
+
+                // Cube is active, if some of its corners are solid, but not all of them
+                uint64_t all_solid = bits_begin[0] & bits_begin[1] & bits_begin[2] & bits_begin[3] & bits_end[0] & bits_end[1] & bits_end[2] & bits_end[3];
+                uint64_t some_solid = bits_begin[0] | bits_begin[1] | bits_begin[2] | bits_begin[3] | bits_end[0] | bits_end[1] | bits_end[2] | bits_end[3];
+                uint64_t active = some_solid & ~all_solid;
+                // Ignore the padding cubes
+                if (word_i == 0) {
+                    active &= ~uint64_t(1);
+                }
+                unsigned cubes_in_word = Urho3D::Min(64u, cwe - 2 - word_i * 64);
+                if (cubes_in_word < 64) {
+                    active &= (uint64_t(1) << cubes_in_word) - 1;
+                }
+
+                while (active) {
+                    unsigned bit = getLowestBitIndex(active);
+                    active &= active - 1;
+
+                    ActiveCube active_cube;
+                    active_cube.x = word_i * 64 + bit;
+                    active_cube.y = y;
+                    active_cube.z = z;
+                    active_cube.mask = 0;
+                    for (unsigned i = 0; i < 4; ++ i) {
+                        active_cube.mask |= ((bits_begin[i] >> bit) & 1) << (i * 2);
+                        active_cube.mask |= ((bits_end[i] >> bit) & 1) << (i * 2 + 1);
+                    }
+                    result.Push(active_cube);
+                }
+            }
+        }
+    }
+}
+
+void MarchingCubesChunk::getSolidBits(uint64_t* result, uint8_t const* values, unsigned size)
+{
+    // Value is solid, if its highest bit is set
+    unsigned i = 0;
+#if defined(URHOEXTRAS_MARCHINGCUBES_AVX2)
+    for (; i + 32 <= size; i += 32) {
+        uint32_t bits = _mm256_movemask_epi8(_mm256_loadu_si256((__m256i const*)(values + i)));
+        result[i / 64] |= uint64_t(bits) << (i % 64);
+    }
+#elif defined(URHOEXTRAS_MARCHINGCUBES_SSE2)
+    for (; i + 16 <= size; i += 16) {
+        uint32_t bits = _mm_movemask_epi8(_mm_loadu_si128((__m128i const*)(values + i)));
+        result[i / 64] |= uint64_t(bits) << (i % 64);
+    }
+#endif
+    for (; i < size; ++ i) {
+        result[i / 64] |= uint64_t(values[i] >> 7) << (i % 64);
+    }
+}
+
+unsigned MarchingCubesChunk::getLowestBitIndex(uint64_t bits)
+{
+    assert(bits);
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long result;
+    _BitScanForward64(&result, bits);
+    return result;
+#else
+    unsigned result = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++ result;
+    }
+    return result;
+#endif
+}
+
+MarchingCubesChunk::CubeCases const& MarchingCubesChunk::getCubeCases()
+{
+    // Static local variables are initialized in a thread safe way
+    static CubeCases const cube_cases = buildCubeCases();
+    return cube_cases;
+}
+
+MarchingCubesChunk::CubeCases MarchingCubesChunk::buildCubeCases()
+{
+    CubeCases result;
+    uint8_t corners[8];
+    for (unsigned mask = 0; mask < 256; ++ mask) {
+        // When corners are fully solid or fully empty, all vertices end up in the middle of edges
+        for (unsigned i = 0; i < 8; ++ i) {
+            corners[i] = (mask & (1 << i)) ? 255 : 0;
+        }
+        Triangles tris = makeCubeTriangles(corners);
+        assert(tris.Size() <= CUBE_CASE_MAX_TRIANGLES);
+
+        CubeCase& cube_case = result.cases[mask];
+        cube_case.tris_size = tris.Size();
+        for (unsigned tri_i = 0; tri_i < tris.Size(); ++ tri_i) {
+            for (unsigned corner_i = 0; corner_i < 3; ++ corner_i) {
+                Urho3D::Vector3 const& pos = tris[tri_i].poss[corner_i];
+                // Find the edge that has the vertex in its middle
+                Urho3D::Vector3 diff = Urho3D::VectorAbs(pos - Urho3D::Vector3(0.5, 0.5, 0.5));
+                unsigned axis;
+                if (diff.x_ < diff.y_ && diff.x_ < diff.z_) {
+                    axis = 0;
+                } else if (diff.y_ < diff.z_) {
+                    axis = 1;
+                } else {
+                    axis = 2;
+                }
+                unsigned corner = 0;
+                if (axis != 0 && pos.x_ > 0.5) corner |= 1;
+                if (axis != 1 && pos.y_ > 0.5) corner |= 2;
+                if (axis != 2 && pos.z_ > 0.5) corner |= 4;
+                cube_case.edges[tri_i * 3 + corner_i] = corner * 3 + axis;
+            }
+        }
+    }
+    return result;
+}
+
+MarchingCubesChunk::Triangles MarchingCubesChunk::makeCubeTriangles(uint8_t const* corners)
+{
+    uint8_t mask = 0;
+    for (unsigned i = 0; i < 8; ++ i) {
+        mask += int(corners[i] >= 128) << i;
+    }
+    switch (mask) {
+    case 0x00:
+        // Empty
+        break;
+    case 0x01:
+        return finalizeTriangles(false, ROT_NOTHING, makeOneCorner, corners);
+    case 0x02:
+        return finalizeTriangles(false, ROT_FORWARD_90, makeOneCorner, corners);
+    case 0x03:
+        return finalizeTriangles(false, ROT_NOTHING, makeOneEdge, corners);
+    case 0x04:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makeOneCorner, corners);
+    case 0x05:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makeOneEdge, corners);
+    case 0x06:
+        return finalizeTriangles(false, ROT_FORWARD_90, makeTwoCorners, corners);
+    case 0x07:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_NEG90, makeBigHalfCorner, corners);
+    case 0x08:
+        return finalizeTriangles(false, ROT_FORWARD_180, makeOneCorner, corners);
+    case 0x09:
+        return finalizeTriangles(false, ROT_NOTHING, makeTwoCorners, corners);
+    case 0x0A:
+        return finalizeTriangles(false, ROT_FORWARD_90, makeOneEdge, corners);
+    case 0x0B:
+        return finalizeTriangles(false, ROT_RIGHT_90, makeBigHalfCorner, corners);
+    case 0x0C:
+        return finalizeTriangles(false, ROT_FORWARD_180, makeOneEdge, corners);
+    case 0x0D:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_180, makeBigHalfCorner, corners);
+    case 0x0E:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_90, makeBigHalfCorner, corners);
+    case 0x0F:
+        return finalizeTriangles(false, ROT_RIGHT_90, makePlane, corners);
+    case 0x10:
+        return finalizeTriangles(false, ROT_UP_90, makeOneCorner, corners);
+    case 0x11:
+        return finalizeTriangles(false, ROT_UP_90, makeOneEdge, corners);
+    case 0x12:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makeTwoCorners, corners);
+    case 0x13:
+        return finalizeTriangles(false, ROT_UP_180, makeBigHalfCorner, corners);
+    case 0x14:
+        return finalizeTriangles(false, ROT_UP_90, makeTwoCorners, corners);
+    case 0x15:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_90, makeBigHalfCorner, corners);
+    case 0x16:
+        return finalizeTriangles(false, ROT_FORWARD_180, makeThreeCorners, corners);
+    case 0x17:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeHexagon, corners);
+    case 0x18:
+        return finalizeTriangles(false, ROT_UP_90, makeOpposingCorners, corners);
+    case 0x19:
+        return finalizeTriangles(false, ROT_UP_90, makeCornerAndEdge, corners);
+    case 0x1A:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0x1B:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90, makeZigZag1, corners);
+    case 0x1C:
+        return finalizeTriangles(false, ROT_FORWARD_180, makeCornerAndEdge, corners);
+    case 0x1D:
+        return finalizeTriangles(false, ROT_RIGHT_180_FORWARD_90, makeZigZag2, corners);
+    case 0x1E:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_90, makeBigHalfCornerAndCorner, corners);
+    case 0x1F:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90, makeBigHalfCorner, corners);
+    case 0x20:
+        return finalizeTriangles(false, ROT_UP_180, makeOneCorner, corners);
+    case 0x21:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_UP_NEG90, makeTwoCorners, corners);
+    case 0x22:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeOneEdge, corners);
+    case 0x23:
+        return finalizeTriangles(false, ROT_UP_90, makeBigHalfCorner, corners);
+    case 0x24:
+        return finalizeTriangles(false, ROT_UP_180, makeOpposingCorners, corners);
+    case 0x25:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0x26:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_UP_90, makeCornerAndEdge, corners);
+    case 0x27:
+        return finalizeTriangles(false, ROT_UP_180, makeZigZag2, corners);
+    case 0x28:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_90, makeTwoCorners, corners);
+    case 0x29:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makeThreeCorners, corners);
+    case 0x2A:
+        return finalizeTriangles(false, ROT_UP_180_FORWARD_90, makeBigHalfCorner, corners);
+    case 0x2B:
+        return finalizeTriangles(false, ROT_UP_180, makeHexagon, corners);
+    case 0x2C:
+        return finalizeTriangles(false, ROT_RIGHT_90, makeCornerAndEdge, corners);
+    case 0x2D:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
+    case 0x2E:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_90, makeZigZag1, corners);
+    case 0x2F:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_90, makeBigHalfCorner, corners);
+    case 0x30:
+        return finalizeTriangles(false, ROT_UP_180, makeOneEdge, corners);
+    case 0x31:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeBigHalfCorner, corners);
+    case 0x32:
+        return finalizeTriangles(false, ROT_NOTHING, makeBigHalfCorner, corners);
+    case 0x33:
+        return finalizeTriangles(false, ROT_NOTHING, makePlane, corners);
+    case 0x34:
+        return finalizeTriangles(false, ROT_UP_180, makeCornerAndEdge, corners);
+    case 0x35:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeZigZag1, corners);
+    case 0x36:
+        return finalizeTriangles(false, ROT_NOTHING, makeBigHalfCornerAndCorner, corners);
+    case 0x37:
+        return finalizeTriangles(true, ROT_RIGHT_180_UP_NEG90, makeBigHalfCorner, corners);
+    case 0x38:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makeCornerAndEdge, corners);
+    case 0x39:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0x3A:
+        return finalizeTriangles(false, ROT_UP_90, makeZigZag2, corners);
+    case 0x3B:
+        return finalizeTriangles(true, ROT_FORWARD_180, makeBigHalfCorner, corners);
+    case 0x3C:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makeTwoEdges, corners);
+    case 0x3D:
+        return finalizeTriangles(true, ROT_RIGHT_180, makeCornerAndEdge, corners);
+    case 0x3E:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_180, makeCornerAndEdge, corners);
+    case 0x3F:
+        return finalizeTriangles(true, ROT_RIGHT_180, makeOneEdge, corners);
+    case 0x40:
+        return finalizeTriangles(false, ROT_RIGHT_180, makeOneCorner, corners);
+    case 0x41:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_90, makeTwoCorners, corners);
+    case 0x42:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeOpposingCorners, corners);
+    case 0x43:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_180, makeCornerAndEdge, corners);
+    case 0x44:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_90, makeOneEdge, corners);
+    case 0x45:
+        return finalizeTriangles(false, ROT_RIGHT_180_FORWARD_90, makeBigHalfCorner, corners);
+    case 0x46:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_90, makeCornerAndEdge, corners);
+    case 0x47:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_NEG90, makeZigZag1, corners);
+    case 0x48:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_90, makeTwoCorners, corners);
+    case 0x49:
+        return finalizeTriangles(false, ROT_UP_90, makeThreeCorners, corners);
+    case 0x4A:
+        return finalizeTriangles(false, ROT_FORWARD_90, makeCornerAndEdge, corners);
+    case 0x4B:
+        return finalizeTriangles(false, ROT_RIGHT_90, makeBigHalfCornerAndCorner, corners);
+    case 0x4C:
+        return finalizeTriangles(false, ROT_RIGHT_180_UP_90, makeBigHalfCorner, corners);
+    case 0x4D:
+        return finalizeTriangles(false, ROT_RIGHT_180, makeHexagon, corners);
+    case 0x4E:
+        return finalizeTriangles(true, ROT_NOTHING, makeZigZag2, corners);
+    case 0x4F:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_NEG90, makeBigHalfCorner, corners);
+    case 0x50:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_NEG90, makeOneEdge, corners);
+    case 0x51:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makeBigHalfCorner, corners);
+    case 0x52:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0x53:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeZigZag2, corners);
+    case 0x54:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCorner, corners);
+    case 0x55:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makePlane, corners);
+    case 0x56:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0x57:
+        return finalizeTriangles(true, ROT_FORWARD_90, makeBigHalfCorner, corners);
+    case 0x58:
+        return finalizeTriangles(false, ROT_RIGHT_180_FORWARD_90, makeCornerAndEdge, corners);
+    case 0x59:
+        return finalizeTriangles(false, ROT_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0x5A:
+        return finalizeTriangles(false, ROT_UP_90, makeTwoEdges, corners);
+    case 0x5B:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_90, makeCornerAndEdge, corners);
+    case 0x5C:
+        return finalizeTriangles(true, ROT_UP_90, makeZigZag1, corners);
+    case 0x5D:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_NEG90, makeBigHalfCorner, corners);
+    case 0x5E:
+        return finalizeTriangles(true, ROT_RIGHT_180_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0x5F:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_90, makeOneEdge, corners);
+    case 0x60:
+        return finalizeTriangles(false, ROT_UP_180, makeTwoCorners, corners);
+    case 0x61:
+        return finalizeTriangles(false, ROT_RIGHT_180_UP_NEG90, makeThreeCorners, corners);
+    case 0x62:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x63:
+        return finalizeTriangles(false, ROT_UP_90, makeBigHalfCornerAndCorner, corners);
+    case 0x64:
+        return finalizeTriangles(false, ROT_RIGHT_180_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x65:
+        return finalizeTriangles(false, ROT_RIGHT_180_FORWARD_90, makeBigHalfCornerAndCorner, corners);
+    case 0x66:
+        return finalizeTriangles(false, ROT_RIGHT_90, makeTwoEdges, corners);
+    case 0x67:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x68:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeThreeCorners, corners);
+    case 0x69:
+        return finalizeTriangles(false, ROT_NOTHING, makeFourCorners, corners);
+    case 0x6A:
+        return finalizeTriangles(false, ROT_RIGHT_180_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0x6B:
+        return finalizeTriangles(true, ROT_UP_180, makeThreeCorners, corners);
+    case 0x6C:
+        return finalizeTriangles(false, ROT_RIGHT_180_UP_90, makeBigHalfCornerAndCorner, corners);
+    case 0x6D:
+        return finalizeTriangles(true, ROT_RIGHT_180, makeThreeCorners, corners);
+    case 0x6E:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x6F:
+        return finalizeTriangles(true, ROT_UP_180_FORWARD_90, makeTwoCorners, corners);
+    case 0x70:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCorner, corners);
+    case 0x71:
+        return finalizeTriangles(false, ROT_NOTHING, makeHexagon, corners);
+    case 0x72:
+        return finalizeTriangles(false, ROT_NOTHING, makeZigZag1, corners);
+    case 0x73:
+        return finalizeTriangles(true, ROT_RIGHT_180, makeBigHalfCorner, corners);
+    case 0x74:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_90, makeZigZag2, corners);
+    case 0x75:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_UP_90, makeBigHalfCorner, corners);
+    case 0x76:
+        return finalizeTriangles(true, ROT_RIGHT_180_UP_90, makeCornerAndEdge, corners);
+    case 0x77:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_NEG90, makeOneEdge, corners);
+    case 0x78:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
+    case 0x79:
+        return finalizeTriangles(true, ROT_NOTHING, makeThreeCorners, corners);
+    case 0x7A:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_90, makeCornerAndEdge, corners);
+    case 0x7B:
+        return finalizeTriangles(true, ROT_RIGHT_90, makeTwoCorners, corners);
+    case 0x7C:
+        return finalizeTriangles(true, ROT_NOTHING, makeCornerAndEdge, corners);
+    case 0x7D:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeTwoCorners, corners);
+    case 0x7E:
+        return finalizeTriangles(true, ROT_NOTHING, makeOpposingCorners, corners);
+    case 0x7F:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_180, makeOneCorner, corners);
+    case 0x80:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_180, makeOneCorner, corners);
+    case 0x81:
+        return finalizeTriangles(false, ROT_NOTHING, makeOpposingCorners, corners);
+    case 0x82:
+        return finalizeTriangles(false, ROT_UP_NEG90, makeTwoCorners, corners);
+    case 0x83:
+        return finalizeTriangles(false, ROT_NOTHING, makeCornerAndEdge, corners);
+    case 0x84:
+        return finalizeTriangles(false, ROT_RIGHT_90, makeTwoCorners, corners);
+    case 0x85:
+        return finalizeTriangles(false, ROT_RIGHT_90_FORWARD_90, makeCornerAndEdge, corners);
+    case 0x86:
+        return finalizeTriangles(false, ROT_NOTHING, makeThreeCorners, corners);
+    case 0x87:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
+    case 0x88:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_NEG90, makeOneEdge, corners);
+    case 0x89:
+        return finalizeTriangles(false, ROT_RIGHT_180_UP_90, makeCornerAndEdge, corners);
+    case 0x8A:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_UP_90, makeBigHalfCorner, corners);
+    case 0x8B:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_90, makeZigZag2, corners);
+    case 0x8C:
+        return finalizeTriangles(false, ROT_RIGHT_180, makeBigHalfCorner, corners);
+    case 0x8D:
+        return finalizeTriangles(true, ROT_NOTHING, makeZigZag1, corners);
+    case 0x8E:
+        return finalizeTriangles(true, ROT_NOTHING, makeHexagon, corners);
+    case 0x8F:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_180, makeBigHalfCorner, corners);
+    case 0x90:
+        return finalizeTriangles(false, ROT_UP_180_FORWARD_90, makeTwoCorners, corners);
+    case 0x91:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x92:
+        return finalizeTriangles(false, ROT_RIGHT_180, makeThreeCorners, corners);
+    case 0x93:
+        return finalizeTriangles(true, ROT_RIGHT_180_UP_90, makeBigHalfCornerAndCorner, corners);
+    case 0x94:
+        return finalizeTriangles(false, ROT_UP_180, makeThreeCorners, corners);
+    case 0x95:
+        return finalizeTriangles(true, ROT_RIGHT_180_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0x96:
+        return finalizeTriangles(false, ROT_UP_90, makeFourCorners, corners);
+    case 0x97:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeThreeCorners, corners);
+    case 0x98:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x99:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makeTwoEdges, corners);
+    case 0x9A:
+        return finalizeTriangles(true, ROT_RIGHT_180_FORWARD_90, makeBigHalfCornerAndCorner, corners);
+    case 0x9B:
+        return finalizeTriangles(true, ROT_RIGHT_180_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x9C:
+        return finalizeTriangles(true, ROT_UP_90, makeBigHalfCornerAndCorner, corners);
+    case 0x9D:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeCornerAndEdge, corners);
+    case 0x9E:
+        return finalizeTriangles(true, ROT_RIGHT_180_UP_NEG90, makeThreeCorners, corners);
+    case 0x9F:
+        return finalizeTriangles(true, ROT_UP_180, makeTwoCorners, corners);
+    case 0xA0:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_90, makeOneEdge, corners);
+    case 0xA1:
+        return finalizeTriangles(false, ROT_RIGHT_180_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0xA2:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_NEG90, makeBigHalfCorner, corners);
+    case 0xA3:
+        return finalizeTriangles(false, ROT_UP_90, makeZigZag1, corners);
+    case 0xA4:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_90, makeCornerAndEdge, corners);
+    case 0xA5:
+        return finalizeTriangles(false, ROT_NOTHING, makeTwoEdges, corners);
+    case 0xA6:
+        return finalizeTriangles(true, ROT_FORWARD_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0xA7:
+        return finalizeTriangles(true, ROT_RIGHT_180_FORWARD_90, makeCornerAndEdge, corners);
+    case 0xA8:
+        return finalizeTriangles(false, ROT_FORWARD_90, makeBigHalfCorner, corners);
+    case 0xA9:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0xAA:
+        return finalizeTriangles(false, ROT_FORWARD_90, makePlane, corners);
+    case 0xAB:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_UP_NEG90, makeBigHalfCorner, corners);
+    case 0xAC:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeZigZag2, corners);
+    case 0xAD:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0xAE:
+        return finalizeTriangles(true, ROT_FORWARD_NEG90, makeBigHalfCorner, corners);
+    case 0xAF:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_NEG90, makeOneEdge, corners);
+    case 0xB0:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_NEG90, makeBigHalfCorner, corners);
+    case 0xB1:
+        return finalizeTriangles(false, ROT_NOTHING, makeZigZag2, corners);
+    case 0xB2:
+        return finalizeTriangles(true, ROT_RIGHT_180, makeHexagon, corners);
+    case 0xB3:
+        return finalizeTriangles(true, ROT_RIGHT_180_UP_90, makeBigHalfCorner, corners);
+    case 0xB4:
+        return finalizeTriangles(true, ROT_RIGHT_90, makeBigHalfCornerAndCorner, corners);
+    case 0xB5:
+        return finalizeTriangles(true, ROT_FORWARD_90, makeCornerAndEdge, corners);
+    case 0xB6:
+        return finalizeTriangles(true, ROT_UP_90, makeThreeCorners, corners);
+    case 0xB7:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_90, makeTwoCorners, corners);
+    case 0xB8:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_NEG90, makeZigZag1, corners);
+    case 0xB9:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_90, makeCornerAndEdge, corners);
+    case 0xBA:
+        return finalizeTriangles(true, ROT_RIGHT_180_FORWARD_90, makeBigHalfCorner, corners);
+    case 0xBB:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_90, makeOneEdge, corners);
+    case 0xBC:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_180, makeCornerAndEdge, corners);
+    case 0xBD:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeOpposingCorners, corners);
+    case 0xBE:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_90, makeTwoCorners, corners);
+    case 0xBF:
+        return finalizeTriangles(true, ROT_RIGHT_180, makeOneCorner, corners);
+    case 0xC0:
+        return finalizeTriangles(false, ROT_RIGHT_180, makeOneEdge, corners);
+    case 0xC1:
+        return finalizeTriangles(false, ROT_RIGHT_90_UP_180, makeCornerAndEdge, corners);
+    case 0xC2:
+        return finalizeTriangles(false, ROT_RIGHT_180, makeCornerAndEdge, corners);
+    case 0xC3:
+        return finalizeTriangles(false, ROT_FORWARD_90, makeTwoEdges, corners);
+    case 0xC4:
+        return finalizeTriangles(false, ROT_FORWARD_180, makeBigHalfCorner, corners);
+    case 0xC5:
+        return finalizeTriangles(true, ROT_UP_90, makeZigZag2, corners);
+    case 0xC6:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeBigHalfCornerAndCorner, corners);
+    case 0xC7:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90, makeCornerAndEdge, corners);
+    case 0xC8:
+        return finalizeTriangles(false, ROT_RIGHT_180_UP_NEG90, makeBigHalfCorner, corners);
+    case 0xC9:
+        return finalizeTriangles(true, ROT_NOTHING, makeBigHalfCornerAndCorner, corners);
+    case 0xCA:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeZigZag1, corners);
+    case 0xCB:
+        return finalizeTriangles(true, ROT_UP_180, makeCornerAndEdge, corners);
+    case 0xCC:
+        return finalizeTriangles(false, ROT_RIGHT_180, makePlane, corners);
+    case 0xCD:
+        return finalizeTriangles(true, ROT_NOTHING, makeBigHalfCorner, corners);
+    case 0xCE:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeBigHalfCorner, corners);
+    case 0xCF:
+        return finalizeTriangles(true, ROT_UP_180, makeOneEdge, corners);
+    case 0xD0:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90_FORWARD_90, makeBigHalfCorner, corners);
+    case 0xD1:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_90, makeZigZag1, corners);
+    case 0xD2:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_180, makeBigHalfCornerAndCorner, corners);
+    case 0xD3:
+        return finalizeTriangles(true, ROT_RIGHT_90, makeCornerAndEdge, corners);
+    case 0xD4:
+        return finalizeTriangles(true, ROT_UP_180, makeHexagon, corners);
+    case 0xD5:
+        return finalizeTriangles(true, ROT_UP_180_FORWARD_90, makeBigHalfCorner, corners);
+    case 0xD6:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90, makeThreeCorners, corners);
+    case 0xD7:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_FORWARD_90, makeTwoCorners, corners);
+    case 0xD8:
+        return finalizeTriangles(true, ROT_UP_180, makeZigZag2, corners);
+    case 0xD9:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_UP_90, makeCornerAndEdge, corners);
+    case 0xDA:
+        return finalizeTriangles(true, ROT_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0xDB:
+        return finalizeTriangles(true, ROT_UP_180, makeOpposingCorners, corners);
+    case 0xDC:
+        return finalizeTriangles(true, ROT_UP_90, makeBigHalfCorner, corners);
+    case 0xDD:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeOneEdge, corners);
+    case 0xDE:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90_UP_NEG90, makeTwoCorners, corners);
+    case 0xDF:
+        return finalizeTriangles(true, ROT_UP_180, makeOneCorner, corners);
+    case 0xE0:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makeBigHalfCorner, corners);
+    case 0xE1:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_90, makeBigHalfCornerAndCorner, corners);
+    case 0xE2:
+        return finalizeTriangles(true, ROT_RIGHT_180_FORWARD_90, makeZigZag2, corners);
+    case 0xE3:
+        return finalizeTriangles(true, ROT_FORWARD_180, makeCornerAndEdge, corners);
+    case 0xE4:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makeZigZag1, corners);
+    case 0xE5:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_NEG90, makeCornerAndEdge, corners);
+    case 0xE6:
+        return finalizeTriangles(true, ROT_UP_90, makeCornerAndEdge, corners);
+    case 0xE7:
+        return finalizeTriangles(true, ROT_UP_90, makeOpposingCorners, corners);
+    case 0xE8:
+        return finalizeTriangles(true, ROT_UP_NEG90, makeHexagon, corners);
+    case 0xE9:
+        return finalizeTriangles(true, ROT_FORWARD_180, makeThreeCorners, corners);
+    case 0xEA:
+        return finalizeTriangles(true, ROT_RIGHT_90_UP_90, makeBigHalfCorner, corners);
+    case 0xEB:
+        return finalizeTriangles(true, ROT_UP_90, makeTwoCorners, corners);
+    case 0xEC:
+        return finalizeTriangles(true, ROT_UP_180, makeBigHalfCorner, corners);
+    case 0xED:
+        return finalizeTriangles(true, ROT_RIGHT_NEG90, makeTwoCorners, corners);
+    case 0xEE:
+        return finalizeTriangles(true, ROT_UP_90, makeOneEdge, corners);
+    case 0xEF:
+        return finalizeTriangles(true, ROT_UP_90, makeOneCorner, corners);
+    case 0xF0:
+        return finalizeTriangles(false, ROT_RIGHT_NEG90, makePlane, corners);
+    case 0xF1:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_90, makeBigHalfCorner, corners);
+    case 0xF2:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_180, makeBigHalfCorner, corners);
+    case 0xF3:
+        return finalizeTriangles(true, ROT_FORWARD_180, makeOneEdge, corners);
+    case 0xF4:
+        return finalizeTriangles(true, ROT_RIGHT_90, makeBigHalfCorner, corners);
+    case 0xF5:
+        return finalizeTriangles(true, ROT_FORWARD_90, makeOneEdge, corners);
+    case 0xF6:
+        return finalizeTriangles(true, ROT_NOTHING, makeTwoCorners, corners);
+    case 0xF7:
+        return finalizeTriangles(true, ROT_FORWARD_180, makeOneCorner, corners);
+    case 0xF8:
+        return finalizeTriangles(true, ROT_RIGHT_90_FORWARD_NEG90, makeBigHalfCorner, corners);
+    case 0xF9:
+        return finalizeTriangles(true, ROT_FORWARD_90, makeTwoCorners, corners);
+    case 0xFA:
+        return finalizeTriangles(true, ROT_FORWARD_NEG90, makeOneEdge, corners);
+    case 0xFB:
+        return finalizeTriangles(true, ROT_FORWARD_NEG90, makeOneCorner, corners);
+    case 0xFC:
+        return finalizeTriangles(true, ROT_NOTHING, makeOneEdge, corners);
+    case 0xFD:
+        return finalizeTriangles(true, ROT_FORWARD_90, makeOneCorner, corners);
+    case 0xFE:
+        return finalizeTriangles(true, ROT_NOTHING, makeOneCorner, corners);
+    case 0xFF:
+        // Full
+        break;
+    }
+    return Triangles();
+}
+MarchingCubesChunk::Triangles MarchingCubesChunk::finalizeTriangles(bool flip_normals, Rotation rot, MakeFunction func, uint8_t const* corners)
 {
     // Rotate corners
     uint8_t corners_fixed[8];
@@ -1390,14 +3876,11 @@ MarchingCubesChunk::Triangles MarchingCubesChunk::finalizeTriangles(bool tempora
     Urho3D::Vector3 transl(-0.5, -0.5, -0.5);
     transl = rot_q * transl;
     transl += Urho3D::Vector3(0.5, 0.5, 0.5);
-    transl += Urho3D::Vector3(x, y, z);
     transl = Urho3D::VectorRound(transl);
-    transl *= cube_width;
-    Urho3D::Matrix3x4 transf(transl, rot_q, cube_width);
+    Urho3D::Matrix3x4 transf(transl, rot_q, 1);
 
     // Modify triangles
     for (Triangle& tri : tris) {
-        tri.temporary = temporary;
         for (Urho3D::Vector3& pos : tri.poss) {
             assert(pos.x_ >= 0 && pos.x_ <= 1);
             assert(pos.y_ >= 0 && pos.y_ <= 1);
@@ -1412,6 +3895,42 @@ MarchingCubesChunk::Triangles MarchingCubesChunk::finalizeTriangles(bool tempora
     return tris;
 }
 
+float MarchingCubesChunk::getEdgePosition(uint8_t corner_begin, uint8_t corner_end)
+{
+    // Edge multiplier is measured from the solid corner
+    if (corner_begin >= 128) {
+        return getEdgeMultiplier(corner_begin, corner_end);
+    }
+    return 1 - getEdgeMultiplier(corner_end, corner_begin);
+}
+
+Urho3D::Vector3 MarchingCubesChunk::getGradient(MarchingCubes::WeightMap const& wmap, unsigned ofs, unsigned cwe)
+{
+    return Urho3D::Vector3(
+        int(wmap[ofs + 1]) - int(wmap[ofs - 1]),
+        int(wmap[ofs + cwe]) - int(wmap[ofs - cwe]),
+        int(wmap[ofs + cwe * cwe]) - int(wmap[ofs - cwe * cwe])
+    );
+}
+
+Urho3D::Vector3 MarchingCubesChunk::getEdgeVertex(uint8_t edge, uint8_t const* corners)
+{
+    unsigned corner_begin = edge / 3;
+    unsigned axis = edge % 3;
+    unsigned corner_end = corner_begin | (1 << axis);
+    float em = getEdgePosition(corners[corner_begin], corners[corner_end]);
+
+    Urho3D::Vector3 result(corner_begin & 1, (corner_begin >> 1) & 1, (corner_begin >> 2) & 1);
+    if (axis == 0) {
+        result.x_ = em;
+    } else if (axis == 1) {
+        result.y_ = em;
+    } else {
+        result.z_ = em;
+    }
+    return result;
+}
+
 float MarchingCubesChunk::getEdgeMultiplier(uint8_t corner_solid, uint8_t corner_empty)
 {
     assert(corner_solid >= 128);
@@ -1859,32 +4378,275 @@ MarchingCubesChunk::Triangles MarchingCubesChunk::makeFourCorners(uint8_t const*
     tris.Push(Triangle(
         Urho3D::Vector3(0, em_1x0, 1),
         Urho3D::Vector3(0, 1, em_x10),
-        Urho3D::Vector3(em_11x, 1, 0)
+        Urho3D::Vector3(em_11x, 1, 1)
     ));
     return tris;
 }
 
-void MarchingCubesChunk::addVertexToRawData(Urho3D::PODVector<float> const& vertex, Urho3D::PODVector<float>& vdata, Urho3D::PODVector<unsigned>& idata)
+void MarchingCubesChunk::addVertexToRawData(Urho3D::PODVector<float> const& vertex, Urho3D::PODVector<float>& vdata, Urho3D::PODVector<unsigned>& idata, VertexLookup& lookup)
 {
-    // Try to find existing vertex
-    unsigned index = 0;
-    for (unsigned ofs = 0; ofs < vdata.Size(); ofs += vertex.Size()) {
-        bool match = true;
-        for (unsigned i = 0; i < vertex.Size(); ++ i) {
-            if (Urho3D::Abs(vertex[i] - vdata[ofs + i]) > 0.0001) {
-                match = false;
-                break;
+    Urho3D::IntVector3 cell(
+        Urho3D::FloorToInt(vertex[0] / WELD_VERTEX_CELL_WIDTH),
+        Urho3D::FloorToInt(vertex[1] / WELD_VERTEX_CELL_WIDTH),
+        Urho3D::FloorToInt(vertex[2] / WELD_VERTEX_CELL_WIDTH)
+    );
+
+    // Try to find existing vertex from this and neighbor cells. If
+    // there are multiple matches, then use the oldest one.
+    unsigned index = Urho3D::M_MAX_UNSIGNED;
+    Urho3D::IntVector3 ofs;
+    for (ofs.z_ = -1; ofs.z_ <= 1; ++ ofs.z_) {
+        for (ofs.y_ = -1; ofs.y_ <= 1; ++ ofs.y_) {
+            for (ofs.x_ = -1; ofs.x_ <= 1; ++ ofs.x_) {
+                auto first_find = lookup.first.Find(cell + ofs);
+                if (first_find == lookup.first.End()) {
+                    continue;
+                }
+                for (unsigned vrt_i = first_find->second_; vrt_i != Urho3D::M_MAX_UNSIGNED; vrt_i = lookup.next[vrt_i]) {
+                    if (vrt_i >= index) {
+                        continue;
+                    }
+                    float const* vrt = &vdata[vrt_i * vertex.Size()];
+                    bool match = true;
+                    for (unsigned i = 0; i < vertex.Size(); ++ i) {
+                        if (Urho3D::Abs(vertex[i] - vrt[i]) > WELD_VERTEX_THRESHOLD) {
+                            match = false;
+                            break;
+                        }
+                    }
+                    if (match) {
+                        index = vrt_i;
+                    }
+                }
             }
         }
-        if (match) {
-            idata.Push(index);
-            return;
-        }
-        index += 1;
     }
+    if (index != Urho3D::M_MAX_UNSIGNED) {
+        idata.Push(index);
+        return;
+    }
+
     // If existing one was not found, then add a new one
+    index = vdata.Size() / vertex.Size();
     vdata.Insert(vdata.End(), vertex.Begin(), vertex.End());
     idata.Push(index);
+
+    // Add to the beginning of the cell's list
+    auto first_find = lookup.first.Find(cell);
+    if (first_find != lookup.first.End()) {
+        lookup.next.Push(first_find->second_);
+        first_find->second_ = index;
+    } else {
+        lookup.next.Push(Urho3D::M_MAX_UNSIGNED);
+        lookup.first[cell] = index;
+    }
+}
+
+MarchingCubesRegion::MarchingCubesRegion(Urho3D::Context* context) :
+    Urho3D::Drawable(context, Urho3D::DRAWABLE_GEOMETRY)
+{
+}
+
+void MarchingCubesRegion::addChunk(MarchingCubesChunk* chunk)
+{
+    chunks.Push(chunk);
+    updateBatches();
+}
+
+void MarchingCubesRegion::removeChunk(MarchingCubesChunk* chunk)
+{
+    chunks.Remove(chunk);
+    updateBatches();
+}
+
+bool MarchingCubesRegion::isEmpty() const
+{
+    return chunks.Empty();
+}
+
+void MarchingCubesRegion::updateBatches()
+{
+    batches_.Clear();
+    for (MarchingCubesChunk* chunk : chunks) {
+        for (Urho3D::SourceBatch batch : chunk->GetBatches()) {
+            batch.worldTransform_ = &chunk->GetNode()->GetWorldTransform();
+            batches_.Push(batch);
+        }
+    }
+    // Bounding box needs to be updated too
+    OnMarkedDirty(node_);
+    SetEnabled(!batches_.Empty());
+}
+
+void MarchingCubesRegion::markChunkMoved()
+{
+    OnMarkedDirty(node_);
+}
+
+void MarchingCubesRegion::UpdateBatches(Urho3D::FrameInfo const& frame)
+{
+    distance_ = frame.camera_->GetDistance(GetWorldBoundingBox().Center());
+
+    // Every chunk gets its own distance, so sorting and level of detail work like without regions
+    unsigned batch_i = 0;
+    for (MarchingCubesChunk* chunk : chunks) {
+        unsigned batches_size = chunk->GetBatches().Size();
+        if (batches_size == 0) {
+            continue;
+        }
+        Urho3D::BoundingBox const& chunk_bb = chunk->GetWorldBoundingBox();
+        float distance = frame.camera_->GetDistance(chunk_bb.Center());
+        float scale = chunk_bb.Size().DotProduct(Urho3D::DOT_SCALE);
+        chunk->setViewDistance(distance, frame.camera_->GetLodDistance(distance, scale, lodBias_));
+        for (unsigned i = 0; i < batches_size; ++ i) {
+            batches_[batch_i ++].distance_ = distance;
+        }
+    }
+}
+
+void MarchingCubesRegion::OnWorldBoundingBoxUpdate()
+{
+    worldBoundingBox_.Clear();
+    for (MarchingCubesChunk* chunk : chunks) {
+        if (!chunk->GetBatches().Empty()) {
+            worldBoundingBox_.Merge(chunk->GetWorldBoundingBox());
+        }
+    }
+}
+
+MarchingCubesMeshCache::MarchingCubesMeshCache(unsigned max_size) :
+    max_size(max_size),
+    use_counter(0),
+    hits(0),
+    misses(0)
+{
+}
+
+unsigned MarchingCubesMeshCache::getSize() const
+{
+    return entries.Size();
+}
+
+unsigned MarchingCubesMeshCache::getMaxSize() const
+{
+    return max_size;
+}
+
+void MarchingCubesMeshCache::setMaxSize(unsigned max_size)
+{
+    this->max_size = max_size;
+    while (entries.Size() > max_size) {
+        removeLeastRecentlyUsed();
+    }
+}
+
+bool MarchingCubesMeshCache::get(MarchingCubesChunk::MeshData& result, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options)
+{
+    auto entries_find = entries.Find(getHash(wmap, materials, chunk_width, cube_width, options));
+    if (entries_find == entries.End() || !isSameInput(entries_find->second_, wmap, materials, chunk_width, cube_width, options)) {
+        ++ misses;
+        return false;
+    }
+    Entry& entry = entries_find->second_;
+    entry.last_used = ++ use_counter;
+    result = entry.mesh;
+    ++ hits;
+    return true;
+}
+
+void MarchingCubesMeshCache::put(MarchingCubesChunk::MeshData const& mesh, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options)
+{
+    if (max_size == 0) {
+        return;
+    }
+    unsigned hash = getHash(wmap, materials, chunk_width, cube_width, options);
+    if (!entries.Contains(hash)) {
+        while (entries.Size() >= max_size) {
+            removeLeastRecentlyUsed();
+        }
+    }
+    // If another input has the same hash, then it is replaced
+    Entry& entry = entries[hash];
+    entry.wmap = wmap;
+    entry.materials = materials;
+    entry.chunk_width = chunk_width;
+    entry.cube_width = cube_width;
+    entry.options = options;
+    entry.mesh = mesh;
+    entry.last_used = ++ use_counter;
+}
+
+void MarchingCubesMeshCache::clear()
+{
+    entries.Clear();
+}
+
+unsigned MarchingCubesMeshCache::getHits() const
+{
+    return hits;
+}
+
+unsigned MarchingCubesMeshCache::getMisses() const
+{
+    return misses;
+}
+
+void MarchingCubesMeshCache::resetCounters()
+{
+    hits = 0;
+    misses = 0;
+}
+
+unsigned MarchingCubesMeshCache::getHash(MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options)
+{
+    // FNV-1a, but eight bytes at a time
+    uint64_t const prime = 1099511628211ULL;
+    uint64_t hash = 14695981039346656037ULL;
+    for (MarchingCubes::WeightMap const* input : { &wmap, &materials }) {
+        unsigned char const* data = input->Buffer();
+        unsigned size = input->Size();
+        unsigned i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; i < size; ++ i) {
+            hash = (hash ^ data[i]) * prime;
+        }
+        hash = (hash ^ size) * prime;
+    }
+
+    uint32_t cube_width_bits;
+    memcpy(&cube_width_bits, &cube_width, 4);
+    hash = (hash ^ chunk_width) * prime;
+    hash = (hash ^ cube_width_bits) * prime;
+    hash = (hash ^ (options.skirts ? 1 : 0) ^ (options.compact_vertices ? 2 : 0)) * prime;
+    return unsigned(hash ^ (hash >> 32));
+}
+
+bool MarchingCubesMeshCache::isSameInput(Entry const& entry, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options)
+{
+    return entry.chunk_width == chunk_width &&
+           entry.cube_width == cube_width &&
+           entry.options.skirts == options.skirts &&
+           entry.options.compact_vertices == options.compact_vertices &&
+           entry.wmap == wmap &&
+           entry.materials == materials;
+}
+
+void MarchingCubesMeshCache::removeLeastRecentlyUsed()
+{
+    // Cache is small compared to the cost of meshing, so linear search is fine
+    auto oldest = entries.End();
+    for (auto i = entries.Begin(); i != entries.End(); ++ i) {
+        if (oldest == entries.End() || use_counter - i->second_.last_used > use_counter - oldest->second_.last_used) {
+            oldest = i;
+        }
+    }
+    if (oldest != entries.End()) {
+        entries.Erase(oldest);
+    }
 }
 
 }
@@ -1,11 +1,20 @@
 #ifndef URHOEXTRAS_GRAPHICS_MARCHINGCUBES_HPP
 #define URHOEXTRAS_GRAPHICS_MARCHINGCUBES_HPP
 
+#include "brickedweightmap.hpp"
+#include "marchingcubesbrush.hpp"
+#include "../collisions/shape.hpp"
+#include "../workitemwithresult.hpp"
+
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Graphics/Camera.h>
 #include <Urho3D/Graphics/Drawable.h>
 #include <Urho3D/Graphics/Geometry.h>
 #include <Urho3D/Graphics/IndexBuffer.h>
 #include <Urho3D/Graphics/Material.h>
 #include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/IO/File.h>
+#include <Urho3D/Math/Ray.h>
 
 namespace UrhoExtras
 {
@@ -14,6 +23,8 @@ namespace Graphics
 {
 
 class MarchingCubesChunk;
+class MarchingCubesMeshCache;
+class MarchingCubesRegion;
 
 class MarchingCubes : public Urho3D::Component
 {
@@ -23,6 +34,26 @@ public:
 
     typedef Urho3D::PODVector<unsigned char> WeightMap;
 
+    enum BrushMode
+    {
+        // Makes the shape solid
+        BRUSH_ADD,
+        // Makes the shape empty
+        BRUSH_SUBTRACT,
+        // Blurs the weights inside the shape
+        BRUSH_SMOOTH,
+        // Changes only the material of the points inside the shape
+        BRUSH_PAINT
+    };
+
+    struct RaycastResult
+    {
+        // In sphere casts, this is the center of the sphere
+        Urho3D::Vector3 pos;
+        Urho3D::Vector3 normal;
+        float distance;
+    };
+
     MarchingCubes(Urho3D::Context* context);
 
     float getCubeWidth() const;
@@ -33,47 +64,386 @@ public:
 
     uint8_t getPoint(Urho3D::IntVector3 const& pos) const;
 
+    uint8_t getPointMaterial(Urho3D::IntVector3 const& pos) const;
+
+    bool isBackgroundRebuilding() const;
+
+    float getRebuildBudget() const;
+
+    unsigned getRegionWidth() const;
+
+    float getLodDistance() const;
+
+    bool getCompactVertices() const;
+
+    MarchingCubesMeshCache* getMeshCache() const;
+
+    bool getKeepCollisionTriangles() const;
+
     void setCubeWidth(float width);
 
     void setChunkWidth(unsigned width);
 
     void setChunksSize(Urho3D::IntVector3 const& size);
 
+    // Sets the material of points that have material index zero
     void setMaterial(Urho3D::Material* mat);
 
+    // Every point has a material index. Surface of a cube uses the material
+    // of its most solid corner, and chunks have one batch per material.
+    // If there is no material for an index, then the first one is used.
+    void setMaterial(unsigned material_i, Urho3D::Material* mat);
+
     void setPoint(Urho3D::IntVector3 const& pos, uint8_t value);
 
+    void setPointMaterial(Urho3D::IntVector3 const& pos, uint8_t material);
+
+    // Finds where the ray enters solid. Ray is in local space, and its
+    // direction must be normalized. Weights are used directly, so meshes
+    // are not needed. Surface at the borders of the volume is not hit.
+    // If ray starts inside solid, then it hits immediately.
+    bool raycast(RaycastResult& result, Urho3D::Ray const& ray, float max_distance) const;
+
+    // Like raycast(), but moves a sphere. Accuracy is about half of the cube width.
+    bool sphereCast(RaycastResult& result, Urho3D::Ray const& ray, float radius, float max_distance) const;
+
+    // Gets collisions of a Sphere or Capsule against the meshes of those chunks
+    // that overlap its bounding box. Shape is in local space, and collision
+    // normals point towards it. Only the front side of the surface collides.
+    // Collision triangles must be kept, otherwise nothing is found.
+    void getCollisions(Collisions::Collisions& result, Collisions::Shape const* shape, float extra_radius = 0) const;
+
+    // Modifies all points inside the brush in one go. Strength
+    // is between 0 and 1 and tells how much the points change.
+    // Points that become more solid or are painted get the material.
+    void applyBrush(MarchingCubesBrush const& brush, BrushMode mode, float strength = 1, uint8_t material = 0);
+
+    // When enabled, dirty chunks are meshed in WorkQueue threads and the
+    // results are uploaded to GPU during Scene post update. Old geometry
+    // stays visible until the new one is ready.
+    void setBackgroundRebuilding(bool enabled);
+
+    // Limits how many milliseconds of a frame are spent on rebuilding
+    // dirty chunks. Visible chunks near the camera are rebuilt first,
+    // and chunks that have waited long get their turn eventually. The
+    // rest keep their old meshes until then. Zero means no limit.
+    void setRebuildBudget(float msecs);
+
+    // Distant chunks are meshed from every second, fourth or eighth
+    // point. Level of detail is halved at the given distance from the
+    // camera, and again every time the distance doubles. Chunks get
+    // skirts that hide the cracks between different levels of detail.
+    // Zero disables this.
+    void setLodDistance(float distance);
+
+    // Compact vertices have only position and normal, and normal is packed
+    // to four bytes. The material must decode the normal from 0..1 to
+    // -1..1 and calculate texture coordinates and tangent in the shader.
+    void setCompactVertices(bool compact);
+
+    // Writes the volume so that every chunk is compressed separately and
+    // an index of them is in the beginning. This makes it possible to read
+    // chunks one by one. If "include_meshes" is true, then full detail
+    // meshes are stored too, so they do not need to be built when loading.
+    void saveVolume(Urho3D::Serializer& dest, bool include_meshes) const;
+
+    // Reads only the header and the index of a volume. Points of chunks
+    // are read when they are needed, so the file is kept open. Set the
+    // streaming focus before this to avoid meshing the whole volume.
+    bool loadVolume(Urho3D::File* file);
+
+    // Only chunks within the radius from the focus get meshes. Points of
+    // unmodified chunks outside it are dropped from memory, if they can be
+    // read again from the volume file. Position is in local space. Zero
+    // radius means the whole volume.
+    void setStreamingFocus(Urho3D::Vector3 const& pos, float radius);
+
+    // When set, chunks look for their mesh from the cache before building
+    // it. Same cache can be shared between many MarchingCubes.
+    void setMeshCache(MarchingCubesMeshCache* cache);
+
+    // Groups chunks to regions that are this many chunks wide. Only regions
+    // are in the octree, so culling cost depends on the number of regions
+    // instead of chunks. Regions without surface are not in the octree at
+    // all. Zero disables this, and chunks are culled one by one.
+    void setRegionWidth(unsigned width);
+
+    // When enabled, chunks keep a copy of their triangles in CPU memory,
+    // so that getCollisions() can be used. Distant chunks use the
+    // triangles of their current level of detail.
+    void setKeepCollisionTriangles(bool keep);
+
     void static registerObject(Urho3D::Context* context);
 
     // Called after scene load or network update
     void ApplyAttributes() override;
 
+protected:
+
+    void OnSceneSet(Urho3D::Scene* scene) override;
+
 private:
 
     typedef Urho3D::HashMap<Urho3D::IntVector3, MarchingCubesChunk*> Chunks;
+    typedef Urho3D::HashMap<Urho3D::IntVector3, MarchingCubesRegion*> Regions;
+    typedef Urho3D::HashSet<Urho3D::IntVector3> ChunkPositions;
+    // Chunks and the system time when they became dirty
+    typedef Urho3D::HashMap<Urho3D::IntVector3, unsigned> ChunkDirtyTimes;
+    typedef Urho3D::PODVector<unsigned> ChunkSolidCounts;
+    typedef Urho3D::PODVector<unsigned> ChunkVersions;
+
+    // Compressed points of a chunk that has changed after the network base was made
+    struct NetworkDeltaChunk
+    {
+        unsigned version;
+        Urho3D::PODVector<unsigned char> data;
+    };
+    typedef Urho3D::HashMap<unsigned, NetworkDeltaChunk> NetworkDeltaChunks;
 
     float cube_width;
     unsigned chunk_width;
     Urho3D::IntVector3 chunks_size;
 
-    WeightMap wmap;
+    BrickedWeightMap wmap;
+    // Material index of every point
+    BrickedWeightMap point_materials;
+    // Number of solid points in each chunk. Used to skip chunks that have no surface.
+    ChunkSolidCounts chunks_solid_counts;
 
-    Urho3D::Material* mat;
+    Urho3D::PODVector<Urho3D::Material*> mats;
 
     bool some_chunks_dirty;
     bool all_chunks_dirty;
+    ChunkDirtyTimes chunks_dirty;
 
     Chunks chunks;
 
+    bool background_rebuilding;
+    // Chunks that have their meshes being built in WorkQueue
+    ChunkPositions chunks_rebuilding;
+
+    float rebuild_budget;
+
+    unsigned region_width;
+    Regions regions;
+
+    float lod_distance;
+
+    bool compact_vertices;
+
+    Urho3D::SharedPtr<MarchingCubesMeshCache> mesh_cache;
+
+    bool keep_collision_triangles;
+
+    // Whole weightmap is replicated as a base, and after that the chunks
+    // that change are replicated as a delta. Versions of chunks are
+    // increased whenever their points change, so clients can skip
+    // the chunks that they already have.
+    ChunkVersions chunks_versions;
+    mutable bool network_base_dirty;
+    mutable Urho3D::PODVector<unsigned char> network_base;
+    mutable ChunkVersions network_base_versions;
+    mutable NetworkDeltaChunks network_delta_chunks;
+
+    // Chunk in the volume file. Offsets are from the beginning of the volume.
+    struct VolumeChunk
+    {
+        unsigned data_offset;
+        // If zero, then every point has "uniform_value"
+        unsigned data_size;
+        uint8_t uniform_value;
+        // If zero, then every point has material zero
+        unsigned materials_offset;
+        unsigned materials_size;
+        unsigned mesh_offset;
+        // If zero, then there is no mesh
+        unsigned mesh_size;
+        // If false, then points in wmap are not valid and must be read from file
+        bool resident;
+    };
+    typedef Urho3D::PODVector<VolumeChunk> VolumeChunks;
+
+    Urho3D::SharedPtr<Urho3D::File> volume_file;
+    unsigned volume_file_begin;
+    VolumeChunks volume_chunks;
+    // Recently decoded chunks that are only in the volume file, so queries
+    // do not decompress the same chunk again. Least recently used is dropped.
+    struct DecodedVolumeChunk
+    {
+        unsigned chunk_i;
+        bool materials;
+        unsigned last_used;
+        WeightMap data;
+    };
+    mutable Urho3D::Vector<DecodedVolumeChunk> decoded_volume_chunks;
+    mutable unsigned decoded_volume_chunks_use_counter;
+    // Cube width and options that the stored meshes were built with
+    float volume_cube_width;
+    bool volume_meshes_skirts;
+    bool volume_meshes_compact;
+
+    Urho3D::Vector3 streaming_focus;
+    float streaming_radius;
+
     void rebuildChunksIfNeeded();
 
+    // Removes the chunk and its node. Returns the next chunk.
+    Chunks::Iterator removeChunk(Chunks::Iterator chunks_find);
+
+    // Adds chunk to the region that it belongs to, creating the region if needed
+    void addChunkToRegion(Urho3D::IntVector3 const& chunk_pos, MarchingCubesChunk* chunk);
+    void removeChunkFromRegion(Urho3D::IntVector3 const& chunk_pos, MarchingCubesChunk* chunk);
+
+    void rebuildChunk(Urho3D::IntVector3 const& chunk_pos, bool reposition, WeightMap& chunk_wmap, Urho3D::WorkQueue* workqueue);
+
+    // Rebuilds dirty chunks in the order of priority until the budget is used
+    void rebuildChunksWithinBudget(WeightMap& chunk_wmap, Urho3D::WorkQueue* workqueue);
+
+    // Cameras of the viewports that show the scene
+    void getCameras(Urho3D::PODVector<Urho3D::Camera*>& result) const;
+
+    Urho3D::BoundingBox getChunkWorldBoundingBox(Urho3D::IntVector3 const& chunk_pos) const;
+
+    // Distance that is used for level of detail. This is calculated from
+    // the cameras, because chunks that are not drawn do not know it.
+    float getChunkLodDistance(Urho3D::IntVector3 const& chunk_pos, Urho3D::PODVector<Urho3D::Camera*> const& cameras) const;
+
+    // Smaller is more urgent. Cameras are in world space.
+    float getRebuildPriority(Urho3D::IntVector3 const& chunk_pos, unsigned dirty_time, unsigned now, Urho3D::PODVector<Urho3D::Camera*> const& cameras) const;
+
+    // Goes through the cells of a grid in the order that a ray hits them.
+    // Positions and distances are in units of the cube width.
+    struct GridWalk
+    {
+        int cell[3];
+        int step[3];
+        float t_next[3];
+        float t_delta[3];
+        int begin[3];
+        int end[3];
+        float t;
+
+        GridWalk(Urho3D::Vector3 const& origin, Urho3D::Vector3 const& dir, float t, int cell_width, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end);
+
+        // Distance where ray leaves the current cell
+        float getCellEnd() const;
+
+        // Returns false if ray leaves the grid
+        bool next();
+    };
+
+    void markChunkDirty(Urho3D::IntVector3 const& chunk_pos);
+
+    bool isChunkInsideVolume(Urho3D::IntVector3 const& chunk_pos) const;
+    bool isChunkInRange(Urho3D::IntVector3 const& chunk_pos, Urho3D::Vector3 const& focus, float radius) const;
+
+    // Returns true if the volume file has a mesh of the chunk, and neither the points
+    // nor the settings have changed after the mesh was built.
+    bool isVolumeMeshValid(Urho3D::IntVector3 const& chunk_pos) const;
+
+    bool isChunkUniform(Urho3D::IntVector3 const& chunk_pos) const;
+
+    unsigned getChunkIndex(Urho3D::IntVector3 const& chunk_pos) const;
+
+    // Returns true if there are no solid points in the chunks of box [begin, end)
+    bool areChunksEmpty(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) const;
+
+    // Returns true if there is a solid point within the reach from the center.
+    // Values are in units of the cube width. Normal points away from solid.
+    // Block is for temporary points, so it can be reused between calls.
+    bool isSphereTouchingSolid(Urho3D::Vector3& result_normal, WeightMap& block, Urho3D::Vector3 const& center, float reach) const;
+
+    // Shortens range [t_min, t_max] of the ray to the part that is inside the box
+    static bool clipRay(float& t_min, float& t_max, Urho3D::Vector3 const& origin, Urho3D::Vector3 const& dir, Urho3D::Vector3 const& box_min, Urho3D::Vector3 const& box_max);
+
+    // Finds where ray enters solid in one cube. Corners are ordered so that
+    // X changes fastest, and origin is relative to the first corner.
+    static bool raycastCube(float& result_t, uint8_t const* corners, Urho3D::Vector3 const& origin, Urho3D::Vector3 const& dir, float t_begin, float t_end);
+
+    // Interpolated weight inside a cube. Position is relative to the first corner.
+    static float getCubeWeight(uint8_t const* corners, Urho3D::Vector3 const& pos);
+
+    // Returns normal at a position in units of the cube width. Normals of
+    // the corners are interpolated, so block must contain their neighbors too.
+    static Urho3D::Vector3 getBlockNormal(WeightMap const& block, Urho3D::IntVector3 const& block_begin, Urho3D::IntVector3 const& block_size, Urho3D::Vector3 const& pos);
+
+    // Returns the range of chunks that have the point in
+    // their weightmap chunk. This includes the neighbor padding.
+    void getChunksUsingPoint(Urho3D::IntVector3& result_begin, Urho3D::IntVector3& result_end, Urho3D::IntVector3 const& pos) const;
+
+    // Updates solid count and version of the chunk of the point
+    void onPointChanged(Urho3D::IntVector3 const& pos, uint8_t old_value, uint8_t new_value);
+
+    void resetChunksVersions();
+
+    void closeVolume();
+
+    // Reads points or their materials of a chunk from the volume file
+    void readVolumeChunk(WeightMap& result, unsigned chunk_i, bool materials) const;
+    void readVolumeBlob(Urho3D::PODVector<unsigned char>& result, unsigned offset, unsigned size) const;
+    // Same as readVolumeChunk(), but uses the cache of decoded chunks. The
+    // result is valid until the next call.
+    WeightMap const& getDecodedVolumeChunk(unsigned chunk_i, bool materials) const;
+
+    // Makes sure that points of chunks in box [begin, end) are in wmap
+    void pageInPoints(Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end);
+    void pageInChunk(unsigned chunk_i);
+    void pageOutChunk(unsigned chunk_i);
+
+    // Like wmap.getBlock(), but also reads those chunks
+    // from the volume file that are not in memory.
+    void getPoints(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) const;
+    void getPointMaterials(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end) const;
+    void getPointsOrMaterials(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, bool materials) const;
+
+    Urho3D::IntVector3 getChunkPosition(unsigned chunk_i) const;
+
+    // Returns true if some point has other than the first material
+    static bool areMaterialsUsed(WeightMap const& materials);
+    // Picks every nth point of a cubic block, starting from the first one
+    static void pickEveryNthPoint(WeightMap& result, WeightMap const& source, unsigned source_width, unsigned result_width, unsigned stride);
+
+    // Compresses the chunks that are not up to date in network
+    // delta. Returns the total size of the compressed chunks.
+    unsigned updateNetworkDeltaChunks() const;
+
+    void updateChunksSolidCounts();
+
+    void applyReadyBackgroundRebuilds();
+
+    // Marks those chunks dirty that are now at different distance
+    // level from the camera than their current mesh is.
+    void updateLods();
+
+    unsigned getMaxLod() const;
+
+    unsigned getLodForDistance(float distance, unsigned current_lod) const;
+
+    void updateSubscriptions(Urho3D::Scene* scene);
+
+    void handleScenePostUpdate(Urho3D::StringHash event_type, Urho3D::VariantMap& event_data);
+
     Urho3D::PODVector<unsigned char> getWeightmapAttr() const;
     void setWeightmapAttr(Urho3D::PODVector<unsigned char> const& value);
 
+    Urho3D::PODVector<unsigned char> getPointMaterialsAttr() const;
+    void setPointMaterialsAttr(Urho3D::PODVector<unsigned char> const& value);
+
+    Urho3D::PODVector<unsigned char> getNetworkBaseAttr() const;
+    void setNetworkBaseAttr(Urho3D::PODVector<unsigned char> const& value);
+
+    Urho3D::PODVector<unsigned char> getNetworkDeltaAttr() const;
+    void setNetworkDeltaAttr(Urho3D::PODVector<unsigned char> const& value);
+
+    // Replace whole weightmap or materials with dense data, and mark changed chunks dirty
+    void setWeightmap(unsigned char const* data);
+    void setPointMaterials(unsigned char const* data);
+
     Urho3D::ResourceRef getMaterialAttr() const;
     void setMaterialAttr(Urho3D::ResourceRef const& value);
 
-    void getWeightMapChunk(WeightMap& result, Urho3D::IntVector3 const& begin, Urho3D::IntVector3 const& end, WeightMap const& source) const;
+    Urho3D::ResourceRefList getMaterialsAttr() const;
+    void setMaterialsAttr(Urho3D::ResourceRefList const& value);
 };
 
 class MarchingCubesChunk : public Urho3D::Drawable
@@ -82,18 +452,90 @@ class MarchingCubesChunk : public Urho3D::Drawable
 
 public:
 
+    struct MeshOptions
+    {
+        // Edges of surface at chunk borders are extended one cube width into the solid
+        bool skirts;
+        // Vertices have only position and normal
+        bool compact_vertices;
+    };
+
+    // Indices that are drawn with the same material
+    struct MaterialRange
+    {
+        uint8_t material;
+        unsigned index_start;
+        unsigned index_count;
+    };
+    typedef Urho3D::PODVector<MaterialRange> MaterialRanges;
+
+    // CPU side vertex and index data of a chunk
+    struct MeshData
+    {
+        Urho3D::PODVector<float> vdata;
+        // Indices are grouped by material
+        Urho3D::PODVector<unsigned> idata;
+        MaterialRanges material_ranges;
+        bool compact_vertices = false;
+    };
+
     MarchingCubesChunk(Urho3D::Context* context);
 
-    void setMaterial(Urho3D::Material* mat);
+    // Index in the vector is the material index of points
+    void setMaterials(Urho3D::PODVector<Urho3D::Material*> const& mats);
+
+    // Uses mesh that has been built earlier, for example loaded from a file
+    void setMesh(MeshData const& mesh, float total_width);
+
+    // If enabled, triangles of the next meshes are kept for collision checks
+    void setKeepCollisionTriangles(bool keep);
 
+    // Collisions of a capsule against the kept triangles. If positions
+    // are the same, then the capsule is a sphere. Values are in the
+    // local space of the chunk, and normals point towards the capsule.
+    void getCollisions(Collisions::Collisions& result, Urho3D::Vector3 const& pos1, Urho3D::Vector3 const& pos2, float radius, float extra_radius) const;
+
+    // Region draws the chunk instead of the chunk itself. Null means no region.
+    void setRegion(MarchingCubesRegion* region);
+
+    // Used by the region, because chunks in regions do not get view updates
+    void setViewDistance(float distance, float lod_distance);
+
+    // Marks chunk dirty and drops possible unfinished background rebuild
     void markRebuildingNeeded();
 
     bool isRebuildNeeded() const;
 
-    void rebuild(MarchingCubes::WeightMap const& wmap, unsigned chunk_width, float cube_width);
+    // Level of detail of the current mesh. Zero is the full detail.
+    unsigned getLod() const;
+    void setLod(unsigned lod);
+
+    // Materials of points are in the same layout as weights. If they are empty,
+    // then every point has material zero. If mesh cache is given, then the
+    // mesh is taken from there if possible, and otherwise the new mesh is
+    // stored there.
+    void rebuild(MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MeshOptions const& options, MarchingCubesMeshCache* mesh_cache = nullptr);
+
+    // Starts building the mesh in WorkQueue. The result must
+    // be uploaded from main thread by calling applyBackgroundRebuildIfReady().
+    // If the mesh is found from the cache, it is uploaded immediately.
+    void startBackgroundRebuild(MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MeshOptions const& options, MarchingCubesMeshCache* mesh_cache = nullptr);
+
+    bool isBackgroundRebuildPending();
+
+    // Returns true if background rebuild was ready and its result was uploaded
+    bool applyBackgroundRebuildIfReady(MarchingCubesMeshCache* mesh_cache = nullptr);
+
+    // Mesh data compressed to a form that can be stored to a file
+    static void writeMesh(Urho3D::Serializer& dest, MeshData const& mesh);
+    static bool readMesh(MeshData& result, Urho3D::Deserializer& src);
+
+    // Does not touch any Urho3D objects, so this is safe to call from any thread.
+    static void buildMesh(MeshData& result, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MeshOptions const& options);
 
 protected:
 
+    void OnMarkedDirty(Urho3D::Node* node) override;
     void OnWorldBoundingBoxUpdate() override;
 
 private:
@@ -101,11 +543,12 @@ private:
     struct Triangle
     {
         Urho3D::Vector3 poss[3];
+        unsigned lattice_edges[3];
         unsigned poss_nrms_i[3];
-        bool temporary;
+        uint8_t material;
 
         inline Triangle(Urho3D::Vector3 const& pos0, Urho3D::Vector3 const& pos1, Urho3D::Vector3 const& pos2) :
-            temporary(false)
+            material(0)
         {
             poss[0] = pos0;
             poss[1] = pos1;
@@ -133,6 +576,15 @@ private:
     };
     typedef Urho3D::PODVector<PositionAndNormal> PositionsAndNormals;
 
+    // Spatial hash of vertices that are already added to raw vertex data.
+    // Vertices are bucketed by their quantized position, and buckets are
+    // linked lists that go through "next" using vertex indices.
+    struct VertexLookup
+    {
+        Urho3D::HashMap<Urho3D::IntVector3, unsigned> first;
+        Urho3D::PODVector<unsigned> next;
+    };
+
     enum Rotation
     {
         ROT_NOTHING = 0,
@@ -165,15 +617,118 @@ private:
 
     typedef Triangles (*MakeFunction)(uint8_t const* corners, bool extra_faces);
 
-    Urho3D::SharedPtr<Urho3D::Geometry> geometry;
+    static unsigned const CUBE_CASE_MAX_TRIANGLES = 8;
+
+    // Triangles of a single cube configuration. Every three edges form a
+    // triangle, and edges are stored as "first corner * 3 + axis".
+    struct CubeCase
+    {
+        uint8_t edges[CUBE_CASE_MAX_TRIANGLES * 3];
+        uint8_t tris_size;
+    };
+    struct CubeCases
+    {
+        CubeCase cases[256];
+    };
+
+    // Cube that has both solid and empty corners. Coordinates are in the padded weight map.
+    struct ActiveCube
+    {
+        uint16_t x, y, z;
+        uint8_t mask;
+    };
+    typedef Urho3D::PODVector<ActiveCube> ActiveCubes;
+
+    // Node of the bounding volume hierarchy of collision triangles. First
+    // child of a branch is the next node, and second is at "second_child".
+    struct CollisionNode
+    {
+        Urho3D::BoundingBox bb;
+        unsigned tris_begin;
+        // If zero, then this is a branch
+        unsigned tris_size;
+        unsigned second_child;
+    };
+    typedef Urho3D::PODVector<CollisionNode> CollisionNodes;
+
+    static unsigned const COLLISION_NODE_MAX_TRIANGLES = 4;
+
+    class BackgroundRebuildResult : public WorkItemResult::ActualResult
+    {
+    public:
+        // Input
+        MarchingCubes::WeightMap wmap;
+        MarchingCubes::WeightMap materials;
+        unsigned chunk_width;
+        float cube_width;
+        MeshOptions options;
+        // Output
+        MeshData mesh;
+    };
+
+    // One Geometry for every material. They all share the same buffers.
+    Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > geometries;
     Urho3D::SharedPtr<Urho3D::VertexBuffer> vbuf;
     Urho3D::SharedPtr<Urho3D::IndexBuffer> ibuf;
 
+    Urho3D::PODVector<Urho3D::Material*> mats;
+    // Ranges of the current mesh
+    MaterialRanges material_ranges;
+
     bool rebuild_needed;
 
     float total_width;
 
-    static Triangles finalizeTriangles(bool temporary, bool flip_normals, float cube_width, int x, int y, int z, Rotation rot, MakeFunction func, uint8_t const* corners);
+    unsigned lod;
+
+    WorkItemResult background_rebuild;
+
+    bool keep_collision_triangles;
+    // Every three positions form a triangle. Triangles are
+    // ordered so that every node has a continuous range.
+    Urho3D::PODVector<Urho3D::Vector3> collision_tris;
+    CollisionNodes collision_nodes;
+
+    MarchingCubesRegion* region;
+
+    void applyMesh(MeshData const& mesh, float total_width);
+
+    Urho3D::Material* getBatchMaterial(unsigned batch_i) const;
+
+    void buildCollisionTriangles(MeshData const& mesh);
+
+    // Builds node of triangles [begin, end) of "tris_order" and its children.
+    // Order is changed so that children get continuous ranges.
+    void buildCollisionNode(Urho3D::PODVector<unsigned>& tris_order, Urho3D::PODVector<Urho3D::Vector3> const& tris_poss, Urho3D::PODVector<Urho3D::Vector3> const& tris_centers, unsigned begin, unsigned end);
+
+    static void doBackgroundRebuild(Urho3D::WorkItem const* workitem, unsigned thread_i);
+
+    // Classifies the cubes of the chunk and lists those that need triangles. Cubes
+    // in the padding are skipped. "cwe" is the width of padded weight map. This
+    // does not touch corners one by one, but converts whole rows of weights to
+    // bits using SIMD, if it is available.
+    static void findActiveCubes(ActiveCubes& result, MarchingCubes::WeightMap const& wmap, unsigned cwe);
+    static void getSolidBits(uint64_t* result, uint8_t const* values, unsigned size);
+    static unsigned getLowestBitIndex(uint64_t bits);
+
+    // Table of all cube configurations. It is generated from the
+    // make functions when it is needed for the first time.
+    static CubeCases const& getCubeCases();
+    static CubeCases buildCubeCases();
+
+    // Makes triangles of a single cube in a unit cube at origin
+    static Triangles makeCubeTriangles(uint8_t const* corners);
+
+    static Triangles finalizeTriangles(bool flip_normals, Rotation rot, MakeFunction func, uint8_t const* corners);
+
+    // Returns position of vertex in a unit cube. Edge is encoded like in CubeCase.
+    static Urho3D::Vector3 getEdgeVertex(uint8_t edge, uint8_t const* corners);
+
+    // Position of the surface on an edge, measured from the first corner
+    static float getEdgePosition(uint8_t corner_begin, uint8_t corner_end);
+
+    // Central differences of weights at a point of padded weight map
+    static Urho3D::Vector3 getGradient(MarchingCubes::WeightMap const& wmap, unsigned ofs, unsigned cwe);
 
     static float getEdgeMultiplier(uint8_t corner_solid, uint8_t corner_empty);
 
@@ -192,7 +747,99 @@ private:
     static Triangles makeThreeCorners(uint8_t const* corners, bool extra_faces);
     static Triangles makeFourCorners(uint8_t const* corners, bool extra_faces);
 
-    static void addVertexToRawData(Urho3D::PODVector<float> const& vertex, Urho3D::PODVector<float>& vdata, Urho3D::PODVector<unsigned>& idata);
+    static void addVertexToRawData(Urho3D::PODVector<float> const& vertex, Urho3D::PODVector<float>& vdata, Urho3D::PODVector<unsigned>& idata, VertexLookup& lookup);
+};
+
+// Drawable that draws the batches of a group of neighbor chunks, so that the
+// octree and views see one object instead of many. Bounding box is the union
+// of the chunks. Batches keep the transforms and distances of their chunks.
+class MarchingCubesRegion : public Urho3D::Drawable
+{
+    URHO3D_OBJECT(MarchingCubesRegion, Urho3D::Drawable);
+
+public:
+
+    MarchingCubesRegion(Urho3D::Context* context);
+
+    void addChunk(MarchingCubesChunk* chunk);
+    void removeChunk(MarchingCubesChunk* chunk);
+
+    bool isEmpty() const;
+
+    // Copies batches from the chunks again. Region is removed from
+    // the octree while none of its chunks have anything to draw.
+    void updateBatches();
+
+    // Called when a chunk moves, so the bounding box is updated
+    void markChunkMoved();
+
+    void UpdateBatches(Urho3D::FrameInfo const& frame) override;
+
+protected:
+
+    void OnWorldBoundingBoxUpdate() override;
+
+private:
+
+    // Batches are in the same order as chunks
+    Urho3D::PODVector<MarchingCubesChunk*> chunks;
+};
+
+// Recently built meshes of chunks, keyed by the weights and the settings that
+// they were built from. When the cache is full, the least recently used mesh
+// is dropped. Must be used only from the main thread.
+class MarchingCubesMeshCache : public Urho3D::RefCounted
+{
+
+public:
+
+    MarchingCubesMeshCache(unsigned max_size);
+
+    unsigned getSize() const;
+
+    unsigned getMaxSize() const;
+    void setMaxSize(unsigned max_size);
+
+    // Returns true and sets the result, if there is a mesh for the input
+    bool get(MarchingCubesChunk::MeshData& result, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options);
+
+    void put(MarchingCubesChunk::MeshData const& mesh, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options);
+
+    void clear();
+
+    // Counters of get() calls that found and did not find a mesh
+    unsigned getHits() const;
+    unsigned getMisses() const;
+    void resetCounters();
+
+private:
+
+    struct Entry
+    {
+        // Input is stored too, so hash collisions can be detected
+        MarchingCubes::WeightMap wmap;
+        MarchingCubes::WeightMap materials;
+        unsigned chunk_width;
+        float cube_width;
+        MarchingCubesChunk::MeshOptions options;
+        MarchingCubesChunk::MeshData mesh;
+        unsigned last_used;
+    };
+    typedef Urho3D::HashMap<unsigned, Entry> Entries;
+
+    unsigned max_size;
+    Entries entries;
+    unsigned use_counter;
+
+    unsigned hits;
+    unsigned misses;
+
+    // Only one entry is kept per hash
+    static unsigned getHash(MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options);
+
+    static bool isSameInput(Entry const& entry, MarchingCubes::WeightMap const& wmap, MarchingCubes::WeightMap const& materials, unsigned chunk_width, float cube_width, MarchingCubesChunk::MeshOptions const& options);
+
+    void removeLeastRecentlyUsed();
 };
 
 }
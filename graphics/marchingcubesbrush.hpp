@@ -0,0 +1,134 @@
+#ifndef URHOEXTRAS_GRAPHICS_MARCHINGCUBESBRUSH_HPP
+#define URHOEXTRAS_GRAPHICS_MARCHINGCUBESBRUSH_HPP
+
+#include <Urho3D/Math/BoundingBox.h>
+#include <Urho3D/Math/Matrix3x4.h>
+#include <Urho3D/Math/Quaternion.h>
+
+namespace UrhoExtras
+{
+
+namespace Graphics
+{
+
+// Shape that can be used to modify MarchingCubes. Shapes are signed distance
+// functions in the local space of MarchingCubes. Subclass this to use
+// arbitrary shapes.
+class MarchingCubesBrush
+{
+
+public:
+
+    inline virtual ~MarchingCubesBrush() {}
+
+    // Distance to the surface of the shape. Negative inside the shape.
+    virtual float getDistance(Urho3D::Vector3 const& pos) const = 0;
+
+    // Must contain all positions where distance is negative
+    virtual Urho3D::BoundingBox getBoundingBox() const = 0;
+};
+
+class SphereBrush : public MarchingCubesBrush
+{
+
+public:
+
+    inline SphereBrush(Urho3D::Vector3 const& pos, float radius) :
+        pos(pos),
+        radius(radius)
+    {
+    }
+
+    inline float getDistance(Urho3D::Vector3 const& pos) const override
+    {
+        return (pos - this->pos).Length() - radius;
+    }
+
+    inline Urho3D::BoundingBox getBoundingBox() const override
+    {
+        return Urho3D::BoundingBox(pos - Urho3D::Vector3::ONE * radius, pos + Urho3D::Vector3::ONE * radius);
+    }
+
+private:
+
+    Urho3D::Vector3 pos;
+    float radius;
+};
+
+class BoxBrush : public MarchingCubesBrush
+{
+
+public:
+
+    inline BoxBrush(Urho3D::Vector3 const& pos, Urho3D::Vector3 const& size, Urho3D::Quaternion const& rot = Urho3D::Quaternion::IDENTITY) :
+        pos(pos),
+        half_size(size / 2),
+        rot(rot),
+        rot_inv(rot.Inverse())
+    {
+    }
+
+    inline float getDistance(Urho3D::Vector3 const& pos) const override
+    {
+        Urho3D::Vector3 pos_rel = rot_inv * (pos - this->pos);
+        Urho3D::Vector3 q = pos_rel.Abs() - half_size;
+        float outside = Urho3D::Vector3(Urho3D::Max(q.x_, 0.0f), Urho3D::Max(q.y_, 0.0f), Urho3D::Max(q.z_, 0.0f)).Length();
+        float inside = Urho3D::Min(Urho3D::Max(q.x_, Urho3D::Max(q.y_, q.z_)), 0.0f);
+        return outside + inside;
+    }
+
+    inline Urho3D::BoundingBox getBoundingBox() const override
+    {
+        return Urho3D::BoundingBox(-half_size, half_size).Transformed(Urho3D::Matrix3x4(pos, rot, 1));
+    }
+
+private:
+
+    Urho3D::Vector3 pos;
+    Urho3D::Vector3 half_size;
+    Urho3D::Quaternion rot;
+    Urho3D::Quaternion rot_inv;
+};
+
+class CapsuleBrush : public MarchingCubesBrush
+{
+
+public:
+
+    inline CapsuleBrush(Urho3D::Vector3 const& pos1, Urho3D::Vector3 const& pos2, float radius) :
+        pos1(pos1),
+        pos2(pos2),
+        radius(radius)
+    {
+    }
+
+    inline float getDistance(Urho3D::Vector3 const& pos) const override
+    {
+        Urho3D::Vector3 diff = pos2 - pos1;
+        float diff_len_sqr = diff.LengthSquared();
+        float m = 0;
+        if (diff_len_sqr > 0) {
+            m = Urho3D::Clamp((pos - pos1).DotProduct(diff) / diff_len_sqr, 0.0f, 1.0f);
+        }
+        return (pos - (pos1 + diff * m)).Length() - radius;
+    }
+
+    inline Urho3D::BoundingBox getBoundingBox() const override
+    {
+        Urho3D::BoundingBox bb(pos1 - Urho3D::Vector3::ONE * radius, pos1 + Urho3D::Vector3::ONE * radius);
+        bb.Merge(pos2 - Urho3D::Vector3::ONE * radius);
+        bb.Merge(pos2 + Urho3D::Vector3::ONE * radius);
+        return bb;
+    }
+
+private:
+
+    Urho3D::Vector3 pos1, pos2;
+    float radius;
+};
+
+}
+
+}
+
+#endif
@@ -1,17 +1,22 @@
 #include "terraingrid.hpp"
 
 #include <Urho3D/Core/Context.h>
-#include <Urho3D/Graphics/Material.h>
-#include <Urho3D/Graphics/Technique.h>
-#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Core/WorkQueue.h>
 #include <Urho3D/Graphics/TerrainPatch.h>
 #include <Urho3D/IO/Compression.h>
+#include <Urho3D/IO/Log.h>
 #include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
 #include <Urho3D/Resource/Image.h>
 #include <Urho3D/Resource/ResourceCache.h>
 #include <Urho3D/Scene/Node.h>
+#include <Urho3D/Scene/Scene.h>
+#include <Urho3D/Scene/SceneEvents.h>
 
-#include <vector>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 
 namespace UrhoExtras
 {
@@ -25,6 +30,55 @@ float const DEFAULT_HEIGHTMAP_STEP = 1;
 unsigned const DEFAULT_TEXTURE_REPEATS = 32;
 unsigned const DEFAULT_TEXTUREWEIGHT_WIDTH = 1024;
 
+unsigned const CHUNK_PREPARING_PRIORITY = 0xffffffff;
+
+// Bigger textures are not supported by all GPUs
+int const MAX_WEIGHT_ATLAS_WIDTH = 16384;
+
+// Tiles file has a header, then an index of all chunks, and then compressed chunks
+char const* const TILES_FILE_ID = "TGTS";
+unsigned const TILES_VERSION = 1;
+unsigned const TILES_HEADER_SIZE = 4 + 4 + 8 + 4 + 4 + 4 + 4 + 1;
+unsigned const TILES_INDEX_ENTRY_SIZE = 4 + 4;
+// Images of chunks are allocated for every loader, so broken files must not make them huge
+unsigned const MAX_TILE_IMAGE_WIDTH = 4096;
+
+// Loading is less urgent than preparing, and closer chunks are loaded first
+unsigned const CHUNK_LOADING_PRIORITY = 0x7fffffff;
+// Chunks are dropped only when they are this much farther than the radius,
+// so moving back and forth at the edge does not load them again and again.
+float const STREAMING_HYSTERESIS = 0.1;
+
+class TerrainGrid::ChunkPreparer : public Urho3D::WorkItem
+{
+public:
+    TerrainGrid const* grid;
+    Urho3D::IntVector2 chunk_pos;
+    // These are allocated in the main thread and only filled in the WorkItem.
+    // Weights image is not used with the weight atlas.
+    Urho3D::SharedPtr<Urho3D::Image> heightmap_img;
+    Urho3D::SharedPtr<Urho3D::Image> textureweights_img;
+};
+
+class TerrainGrid::ChunkLoader : public Urho3D::WorkItem
+{
+public:
+    TerrainGrid const* grid;
+    Urho3D::IntVector2 chunk_pos;
+    Tile tile;
+    unsigned request_time;
+    // These are allocated in the main thread and only filled in the WorkItem
+    Urho3D::SharedPtr<Urho3D::Image> heightmap_img;
+    Urho3D::SharedPtr<Urho3D::Image> textureweights_img;
+    // Set if tile could not be read
+    mutable bool failed;
+    // Set when loader does not use the grid any more. Flag is needed,
+    // because the condition does not remember if it was already notified.
+    mutable bool done;
+    mutable std::mutex done_mutex;
+    mutable std::condition_variable done_condition;
+};
+
 TerrainGrid::TerrainGrid(Urho3D::Context* context) :
     Urho3D::Component(context),
     heightmap_width(DEFAULT_HEIGHTMAP_WIDTH),
@@ -32,12 +86,24 @@ TerrainGrid::TerrainGrid(Urho3D::Context* context) :
     heightmap_step(DEFAULT_HEIGHTMAP_STEP),
     texture_repeats(DEFAULT_TEXTURE_REPEATS),
     textureweight_width(DEFAULT_TEXTUREWEIGHT_WIDTH),
-    viewmask(Urho3D::DEFAULT_VIEWMASK)
+    viewmask(Urho3D::DEFAULT_VIEWMASK),
+    partial_updates(false),
+    tiles_file_begin(0),
+    tiles_components(0),
+    streaming_radius(0),
+    loaded_chunks_count(0),
+    loads_count(0),
+    loads_total_latency(0),
+    loads_max_latency(0)
 {
 }
 
 TerrainGrid::~TerrainGrid()
 {
+    // Loaders must not run after this
+    for (auto i = chunks_loading.Begin(); i != chunks_loading.End(); ++ i) {
+        cancelChunkLoader(i->second_, true);
+    }
 }
 
 void TerrainGrid::addTexture(Urho3D::Image* tex_img)
@@ -52,7 +118,37 @@ void TerrainGrid::setViewmask(unsigned viewmask)
 {
     this->viewmask = viewmask;
     for (Urho3D::Terrain* chunk : chunks) {
-        chunk->SetViewMask(viewmask);
+        if (chunk) {
+            chunk->SetViewMask(viewmask);
+        }
+    }
+}
+
+void TerrainGrid::setPartialUpdates(bool partial)
+{
+    if (partial_updates == partial) {
+        return;
+    }
+    partial_updates = partial;
+    // Weight textures need to be recreated with the correct mipmap levels
+    if (!chunks.Empty() && !heightmap.Empty()) {
+        chunks_not_dirty.Clear();
+        buildFromBuffers();
+    }
+}
+
+void TerrainGrid::setWeightAtlasTechnique(Urho3D::Technique* technique)
+{
+    if (weight_atlas_technique == technique) {
+        return;
+    }
+    weight_atlas_technique = technique;
+    weight_atlas.Reset();
+    weight_atlas_mat.Reset();
+    // Every chunk needs a new material
+    if (!chunks.Empty() && !heightmap.Empty()) {
+        chunks_not_dirty.Clear();
+        buildFromBuffers();
     }
 }
 
@@ -108,6 +204,7 @@ unsigned TerrainGrid::getChunkTextureweightsWidth() const
 
 void TerrainGrid::generateFlatland(Urho3D::IntVector2 const& grid_size)
 {
+    closeTiles();
     this->grid_size = grid_size;
 
     // Prepare buffers
@@ -134,6 +231,7 @@ void TerrainGrid::generateFromImages(Urho3D::Image* terrainweight, Urho3D::Image
         throw std::runtime_error("Invalid heightmap height!");
     }
 
+    closeTiles();
     grid_size.x_ = (heightmap->GetWidth() - 1) / (heightmap_width - 1);
     grid_size.y_ = (heightmap->GetHeight() - 1) / (heightmap_width - 1);
 
@@ -200,6 +298,7 @@ void TerrainGrid::generateFromVectors(Urho3D::IntVector2 const& grid_size, Heigh
     }
 
     // Copy data
+    closeTiles();
     this->grid_size = grid_size;
     this->heightmap = heightmap;
     this->textureweights = textureweights;
@@ -214,6 +313,230 @@ void TerrainGrid::forgetSourceData()
     textureweights.Clear();
 }
 
+void TerrainGrid::saveTiles(Urho3D::Serializer& dest) const
+{
+    unsigned chunks_count = grid_size.x_ * grid_size.y_;
+    unsigned components = tiles_file ? tiles_components : texs.Size();
+    Urho3D::IntVector2 hmap_total_size = getHeightmapSize();
+    Urho3D::IntVector2 texmap_total_size = getTextureweightsSize();
+    if (!tiles_file && (heightmap.Size() != unsigned(hmap_total_size.x_ * hmap_total_size.y_) || textureweights.Size() != texmap_total_size.x_ * texmap_total_size.y_ * components)) {
+        throw std::runtime_error("TerrainGrid has no source data to save!");
+    }
+
+    // Compress chunks first, so their offsets are known when the index is written
+    Tiles index;
+    index.Resize(chunks_count);
+    Urho3D::VectorBuffer blobs;
+    unsigned blobs_begin = TILES_HEADER_SIZE + chunks_count * TILES_INDEX_ENTRY_SIZE;
+    Urho3D::PODVector<unsigned char> blob;
+    Urho3D::IntVector2 chunk_pos;
+    for (chunk_pos.y_ = 0; chunk_pos.y_ < grid_size.y_; ++ chunk_pos.y_) {
+        for (chunk_pos.x_ = 0; chunk_pos.x_ < grid_size.x_; ++ chunk_pos.x_) {
+            unsigned chunk_i = chunk_pos.x_ + chunk_pos.y_ * grid_size.x_;
+            unsigned offset = blobs.GetSize();
+
+            // Streamed chunks are copied as they are
+            if (tiles_file) {
+                Tile const& old_tile = tiles[chunk_i];
+                if (old_tile.size == 0) {
+                    throw std::runtime_error("Unable to read TerrainGrid tiles!");
+                }
+                Urho3D::MutexLock lock(tiles_file_mutex);
+                tiles_file->Seek(tiles_file_begin + old_tile.offset);
+                blob.Resize(old_tile.size);
+                if (tiles_file->Read(blob.Buffer(), blob.Size()) != blob.Size()) {
+                    throw std::runtime_error("Unable to read TerrainGrid tiles!");
+                }
+                blobs.Write(blob.Buffer(), blob.Size());
+            } else {
+                // Heights and then weights of the chunk, in the same order as in source data
+                Urho3D::VectorBuffer chunk_vbuf;
+                for (unsigned y = 0; y < heightmap_width; ++ y) {
+                    unsigned ofs = chunk_pos.x_ * (heightmap_width - 1) + (chunk_pos.y_ * (heightmap_width - 1) + y) * hmap_total_size.x_;
+                    for (unsigned x = 0; x < heightmap_width; ++ x) {
+                        chunk_vbuf.WriteUShort(heightmap[ofs ++]);
+                    }
+                }
+                unsigned row_size = textureweight_width * components;
+                for (unsigned y = 0; y < textureweight_width; ++ y) {
+                    unsigned ofs = (chunk_pos.x_ * textureweight_width + (chunk_pos.y_ * textureweight_width + y) * texmap_total_size.x_) * components;
+                    chunk_vbuf.Write(&textureweights[ofs], row_size);
+                }
+                chunk_vbuf.Seek(0);
+                if (!Urho3D::CompressStream(blobs, chunk_vbuf)) {
+                    throw std::runtime_error("Unable to compress TerrainGrid tile!");
+                }
+            }
+
+            index[chunk_i].offset = blobs_begin + offset;
+            index[chunk_i].size = blobs.GetSize() - offset;
+        }
+    }
+
+    // Header
+    dest.WriteFileID(TILES_FILE_ID);
+    dest.WriteUInt(TILES_VERSION);
+    dest.WriteIntVector2(grid_size);
+    dest.WriteUInt(heightmap_width);
+    dest.WriteFloat(heightmap_square_width);
+    dest.WriteFloat(heightmap_step);
+    dest.WriteUInt(textureweight_width);
+    dest.WriteUByte(components);
+
+    // Index
+    for (Tile const& tile : index) {
+        dest.WriteUInt(tile.offset);
+        dest.WriteUInt(tile.size);
+    }
+
+    // Chunks
+    if (dest.Write(blobs.GetData(), blobs.GetSize()) != blobs.GetSize()) {
+        throw std::runtime_error("Unable to write TerrainGrid tiles!");
+    }
+}
+
+bool TerrainGrid::loadTiles(Urho3D::File* file)
+{
+    unsigned file_begin = file->GetPosition();
+
+    // Header
+    if (file->ReadFileID() != TILES_FILE_ID) {
+        URHO3D_LOGWARNING("File is not TerrainGrid tiles!");
+        return false;
+    }
+    if (file->ReadUInt() != TILES_VERSION) {
+        URHO3D_LOGWARNING("TerrainGrid tiles have unsupported version!");
+        return false;
+    }
+    Urho3D::IntVector2 new_grid_size = file->ReadIntVector2();
+    unsigned new_heightmap_width = file->ReadUInt();
+    float new_heightmap_square_width = file->ReadFloat();
+    float new_heightmap_step = file->ReadFloat();
+    unsigned new_textureweight_width = file->ReadUInt();
+    unsigned new_components = file->ReadUByte();
+    if (new_grid_size.x_ < 0 || new_grid_size.y_ < 0 ||
+        new_heightmap_width < 2 || new_heightmap_width > MAX_TILE_IMAGE_WIDTH ||
+        new_textureweight_width == 0 || new_textureweight_width > MAX_TILE_IMAGE_WIDTH ||
+        new_components == 0 || new_components > 4) {
+        URHO3D_LOGWARNING("TerrainGrid tiles have invalid size!");
+        return false;
+    }
+    // Sizes of the whole grid must fit in int
+    unsigned long long max_chunk_width = Urho3D::Max(new_heightmap_width, new_textureweight_width);
+    if (new_grid_size.x_ * max_chunk_width > unsigned(Urho3D::M_MAX_INT) || new_grid_size.y_ * max_chunk_width > unsigned(Urho3D::M_MAX_INT)) {
+        URHO3D_LOGWARNING("TerrainGrid tiles have invalid size!");
+        return false;
+    }
+
+    // Index. This is calculated in 64 bits, so a broken header can not wrap it around.
+    unsigned tiles_size = file->GetSize() - file_begin;
+    unsigned long long index_end = TILES_HEADER_SIZE + (unsigned long long)new_grid_size.x_ * new_grid_size.y_ * TILES_INDEX_ENTRY_SIZE;
+    if (tiles_size < index_end) {
+        URHO3D_LOGWARNING("TerrainGrid tiles are truncated!");
+        return false;
+    }
+    unsigned new_chunks_count = new_grid_size.x_ * new_grid_size.y_;
+    Tiles new_tiles;
+    new_tiles.Resize(new_chunks_count);
+    for (Tile& tile : new_tiles) {
+        tile.offset = file->ReadUInt();
+        tile.size = file->ReadUInt();
+        if (tile.offset < index_end || tile.offset > tiles_size || tile.size > tiles_size - tile.offset) {
+            URHO3D_LOGWARNING("TerrainGrid tiles have invalid chunk!");
+            return false;
+        }
+    }
+
+    // Take the tiles into use. Old chunks and source data are dropped.
+    closeTiles();
+    for (Urho3D::Terrain* chunk : chunks) {
+        if (chunk) {
+            chunk->GetNode()->Remove();
+        }
+    }
+    chunks.Clear();
+    chunks_not_dirty.Clear();
+    heightmap_dirty.Clear();
+    textureweights_dirty.Clear();
+    heightmap.Clear();
+    textureweights.Clear();
+    weight_atlas.Reset();
+    weight_atlas_mat.Reset();
+
+    grid_size = new_grid_size;
+    heightmap_width = new_heightmap_width;
+    heightmap_square_width = new_heightmap_square_width;
+    heightmap_step = new_heightmap_step;
+    textureweight_width = new_textureweight_width;
+    tiles_file = file;
+    tiles_file_begin = file_begin;
+    tiles.Swap(new_tiles);
+    tiles_components = new_components;
+    chunks.Resize(new_chunks_count, nullptr);
+
+    // Weight atlas would be as big as the whole grid, so streamed chunks have their own weight textures
+    if (weight_atlas_technique) {
+        URHO3D_LOGWARNING("Weight atlas is not used with streamed TerrainGrid!");
+    }
+    streaming_mat = createBaseMaterial(nullptr);
+
+    updateSubscriptions(GetScene());
+    updateStreaming();
+    return true;
+}
+
+void TerrainGrid::setStreamingFoci(Urho3D::PODVector<Urho3D::Vector3> const& foci, float radius)
+{
+    streaming_foci = foci;
+    streaming_radius = radius;
+    updateStreaming();
+}
+
+bool TerrainGrid::isStreaming() const
+{
+    return tiles_file.NotNull();
+}
+
+unsigned TerrainGrid::getLoadedChunksCount() const
+{
+    return loaded_chunks_count;
+}
+
+unsigned TerrainGrid::getLoadingChunksCount() const
+{
+    return chunks_loading.Size();
+}
+
+unsigned TerrainGrid::getStreamingMemoryUse() const
+{
+    // Terrain keeps both the heightmap image and the heights as floats. Loaders
+    // also have the weights image, that is dropped after uploading it to GPU.
+    unsigned heightmap_img_size = heightmap_width * heightmap_width * 3;
+    unsigned textureweights_img_size = textureweight_width * textureweight_width * tiles_components;
+    return loaded_chunks_count * (heightmap_img_size + heightmap_width * heightmap_width * sizeof(float)) +
+           chunks_loading.Size() * (heightmap_img_size + textureweights_img_size);
+}
+
+float TerrainGrid::getAverageLoadLatency() const
+{
+    if (loads_count == 0) {
+        return 0;
+    }
+    return double(loads_total_latency) / loads_count;
+}
+
+unsigned TerrainGrid::getMaxLoadLatency() const
+{
+    return loads_max_latency;
+}
+
+void TerrainGrid::resetStreamingCounters()
+{
+    loads_count = 0;
+    loads_total_latency = 0;
+    loads_max_latency = 0;
+}
+
 float TerrainGrid::getHeight(Urho3D::Vector3 const& world_pos) const
 {
     Urho3D::Terrain* terrain = getChunkAt(world_pos.x_, world_pos.z_);
@@ -248,6 +571,10 @@ void TerrainGrid::getTerrainPatches(Urho3D::PODVector<Urho3D::TerrainPatch*>& re
     for (int y = bounds_min_i.y_; y < bounds_max_i.y_; ++ y) {
         for (int x = bounds_min_i.x_; x < bounds_max_i.x_; ++ x) {
             Urho3D::Terrain* chunk = chunks[x + y * grid_size.x_];
+            // Streamed chunk might not be loaded
+            if (!chunk) {
+                continue;
+            }
             Urho3D::IntVector2 patches_size = chunk->GetNumPatches();
             for (int y = 0; y < patches_size.y_; ++ y) {
                 for (int x = 0; x < patches_size.x_; ++ x) {
@@ -315,12 +642,40 @@ void TerrainGrid::getTerrainPatches(Urho3D::PODVector<Urho3D::TerrainPatch*>& re
 
 void TerrainGrid::buildFromBuffers()
 {
-    Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+    // Streamed chunks are created when they are loaded
+    if (tiles_file) {
+        return;
+    }
 
-    Urho3D::Node* node = GetNode();
+    // Source data might be missing, for example if it was forgotten before serializing
+    Urho3D::IntVector2 hmap_total_size = getHeightmapSize();
+    Urho3D::IntVector2 texmap_total_size = getTextureweightsSize();
+    if (grid_size.x_ > 0 && grid_size.y_ > 0 &&
+        (heightmap.Size() != unsigned(hmap_total_size.x_ * hmap_total_size.y_) || textureweights.Size() != texmap_total_size.x_ * texmap_total_size.y_ * texs.Size())) {
+        URHO3D_LOGWARNING("TerrainGrid source data does not match the grid size!");
+        return;
+    }
 
     chunks.Resize(grid_size.x_ * grid_size.y_, nullptr);
 
+    // Modified chunks are either updated in place or recreated
+    for (auto i = heightmap_dirty.Begin(); i != heightmap_dirty.End(); ++ i) {
+        if (partial_updates && chunks_not_dirty.Contains(i->first_)) {
+            updateChunkHeightmap(i->first_, i->second_);
+        } else {
+            chunks_not_dirty.Erase(i->first_);
+        }
+    }
+    for (auto i = textureweights_dirty.Begin(); i != textureweights_dirty.End(); ++ i) {
+        if (partial_updates && chunks_not_dirty.Contains(i->first_)) {
+            updateChunkTextureweights(i->first_, i->second_);
+        } else {
+            chunks_not_dirty.Erase(i->first_);
+        }
+    }
+    heightmap_dirty.Clear();
+    textureweights_dirty.Clear();
+
     // Clear possible old stuff
     Urho3D::IntVector2 i;
     unsigned offset = 0;
@@ -334,84 +689,72 @@ void TerrainGrid::buildFromBuffers()
         }
     }
 
-    Urho3D::SharedPtr<Urho3D::Material> original_mat(new Urho3D::Material(context_));
-    original_mat->SetNumTechniques(1);
-    original_mat->SetTechnique(0, resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend.xml"));
-    original_mat->SetShaderParameter("DetailTiling", Urho3D::Vector2(texture_repeats, texture_repeats));
-    for (unsigned i = 0; i < texs.Size(); ++ i) {
-        original_mat->SetTexture(static_cast<Urho3D::TextureUnit>(i + 1), texs[i]);
+    // With the weight atlas, this is shared by all chunks
+    Urho3D::SharedPtr<Urho3D::Material> original_mat = createBaseMaterial(weight_atlas_technique);
+
+    // Recreated chunks are copied to the atlas one by one, unless the whole atlas is recreated
+    bool weight_atlas_built = false;
+    if (weight_atlas_technique) {
+        Urho3D::IntVector2 texmap_total_size = getTextureweightsSize();
+        if (!weight_atlas || weight_atlas->GetWidth() != texmap_total_size.x_ || weight_atlas->GetHeight() != texmap_total_size.y_) {
+            buildWeightAtlas();
+            weight_atlas_built = true;
+        }
+        original_mat->SetTexture(static_cast<Urho3D::TextureUnit>(0), weight_atlas);
     }
 
-    // Create Terrain objects
+    // Prepare images of new chunks in WorkQueue
+    Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+    Urho3D::Vector<Urho3D::SharedPtr<ChunkPreparer> > preparers;
     offset = 0;
-    for (int y = 0; y < grid_size.y_; ++ y) {
-        for (int x = 0; x < grid_size.x_; ++ x) {
+    for (i.y_ = 0; i.y_ < grid_size.y_; ++ i.y_) {
+        for (i.x_ = 0; i.x_ < grid_size.x_; ++ i.x_) {
             // If there is already a chunk, it doesn't need to be recreated
-            if (chunks[offset]) {
-                ++ offset;
+            if (chunks[offset ++]) {
                 continue;
             }
+            Urho3D::SharedPtr<ChunkPreparer> preparer(new ChunkPreparer());
+            preparer->grid = this;
+            preparer->chunk_pos = i;
+            preparer->heightmap_img = new Urho3D::Image(context_);
+            preparer->heightmap_img->SetSize(heightmap_width, heightmap_width, 3);
+            if (!weight_atlas_technique) {
+                preparer->textureweights_img = new Urho3D::Image(context_);
+                preparer->textureweights_img->SetSize(textureweight_width, textureweight_width, texs.Size());
+            }
+            preparer->priority_ = CHUNK_PREPARING_PRIORITY;
+            preparer->workFunction_ = doPrepareChunk;
+            workqueue->AddWorkItem(Urho3D::SharedPtr<Urho3D::WorkItem>(preparer));
+            preparers.Push(preparer);
+        }
+    }
+    workqueue->Complete(CHUNK_PREPARING_PRIORITY);
+
+    // Create Terrain objects. Only this needs to be done in main thread.
+    for (ChunkPreparer const* preparer : preparers) {
+        // Without the atlas, every chunk has its own weight texture
+        Urho3D::SharedPtr<Urho3D::Material> chunk_mat;
+        if (weight_atlas_technique) {
+            chunk_mat = original_mat;
+        } else {
+            chunk_mat = createChunkMaterial(original_mat, preparer->textureweights_img);
+        }
 
-            // Node
-            Urho3D::Node* chunk_node = node->CreateChild(Urho3D::String::EMPTY, Urho3D::LOCAL);
-            chunk_node->SetPosition(Urho3D::Vector3(
-                (x + 0.5) * (heightmap_width - 1) * heightmap_square_width,
-                0,
-                (y + 0.5) * (heightmap_width - 1) * heightmap_square_width
-            ));
+        createChunk(preparer->chunk_pos, preparer->heightmap_img, chunk_mat);
 
-            // Heightmap for this Chunk
-            std::vector<unsigned char> chunk_heightmap_data;
-            chunk_heightmap_data.reserve(heightmap_width * heightmap_width * 3);
-            for (unsigned y2 = 0; y2 < heightmap_width; ++ y2) {
-                unsigned ofs = x * (heightmap_width - 1) + ((heightmap_width - y2 - 1) + y * (heightmap_width - 1)) * ((heightmap_width - 1) * grid_size.x_ + 1);
-                for (unsigned x2 = 0; x2 < heightmap_width; ++ x2) {
-                    uint16_t height = heightmap[ofs ++];
-                    chunk_heightmap_data.push_back(height / 256);
-                    chunk_heightmap_data.push_back(height % 256);
-                    chunk_heightmap_data.push_back(0);
-                }
-            }
-            Urho3D::SharedPtr<Urho3D::Image> chunk_heightmap(new Urho3D::Image(context_));
-            chunk_heightmap->SetSize(heightmap_width, heightmap_width, 3);
-            assert(chunk_heightmap_data.size() == heightmap_width * heightmap_width * 3);
-            chunk_heightmap->SetData(chunk_heightmap_data.data());
-
-            // Weight texture for material
-            std::vector<unsigned char> chunk_textureweight_data;
-            chunk_textureweight_data.reserve(textureweight_width * textureweight_width * texs.Size());
-            for (unsigned y2 = 0; y2 < textureweight_width; ++ y2) {
-                unsigned ofs = (x * textureweight_width + ((textureweight_width - y2 - 1) + y * textureweight_width) * textureweight_width * grid_size.x_) * texs.Size();
-                for (unsigned x2 = 0; x2 < textureweight_width; ++ x2) {
-                    for (unsigned i = 0; i < texs.Size(); ++ i) {
-                        float weight = textureweights[ofs ++];
-                        chunk_textureweight_data.push_back(weight);
-                    }
-                }
-            }
-            Urho3D::SharedPtr<Urho3D::Image> chunk_textureweight_img(new Urho3D::Image(context_));
-            chunk_textureweight_img->SetSize(textureweight_width, textureweight_width, texs.Size());
-            chunk_textureweight_img->SetData(&chunk_textureweight_data[0]);
-            Urho3D::SharedPtr<Urho3D::Texture2D> chunk_textureweight_tex(new Urho3D::Texture2D(context_));
-            chunk_textureweight_tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
-            chunk_textureweight_tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
-            chunk_textureweight_tex->SetData(chunk_textureweight_img);
-
-            // Material
-            Urho3D::SharedPtr<Urho3D::Material> chunk_mat(original_mat->Clone());
-            chunk_mat->SetTexture(static_cast<Urho3D::TextureUnit>(0), chunk_textureweight_tex);
-
-            // Terrain
-            Urho3D::Terrain* chunk_terrain = chunk_node->CreateComponent<Urho3D::Terrain>(Urho3D::LOCAL);
-            chunk_terrain->SetSpacing(Urho3D::Vector3(heightmap_square_width, heightmap_step, heightmap_square_width));
-            chunk_terrain->SetHeightMap(chunk_heightmap);
-            chunk_terrain->SetMaterial(chunk_mat);
-            chunk_terrain->SetViewMask(viewmask);
-
-            chunks_not_dirty.Insert(Urho3D::IntVector2(x, y));
-
-            chunks[offset] = chunk_terrain;
-            ++ offset;
+        chunks_not_dirty.Insert(preparer->chunk_pos);
+
+        if (weight_atlas_technique && !weight_atlas_built) {
+            updateChunkTextureweights(preparer->chunk_pos, Urho3D::IntRect(0, 0, textureweight_width, textureweight_width));
+        }
+    }
+
+    // Old chunks are moved to the new shared material too
+    if (weight_atlas_technique && (!preparers.Empty() || !weight_atlas_mat)) {
+        weight_atlas_mat = original_mat;
+        updateWeightAtlasTransform();
+        for (Urho3D::Terrain* chunk : chunks) {
+            chunk->SetMaterial(weight_atlas_mat);
         }
     }
 
@@ -437,6 +780,10 @@ void TerrainGrid::buildFromBuffers()
 
 void TerrainGrid::drawTo(Urho3D::Vector3 const& pos, Urho3D::Image* terrain_mod, Urho3D::Image* height_mod, float height_mod_strength, Urho3D::Vector2 const& size, float angle, bool update_over_network)
 {
+    if (tiles_file) {
+        throw std::runtime_error("Streamed TerrainGrid can not be modified!");
+    }
+
     // Calculate relative position
     Urho3D::Vector3 terrain_pos = GetNode()->GetWorldPosition();
     Urho3D::Vector3 total_size = getSize();
@@ -465,6 +812,9 @@ void TerrainGrid::drawTo(Urho3D::Vector3 const& pos, Urho3D::Image* terrain_mod,
         float texmap_scale = terrain_mod->GetWidth() * total_size.x_ / texmap_total_size.x_ / size.x_;
         for (i.x_ = texmap_bounds_min.x_; i.x_ <= texmap_bounds_max.x_; ++ i.x_) {
             float x_rel = i.x_ - texmap_pos.x_;
+            // Modified part of this column
+            int changed_begin = -1;
+            int changed_end = -1;
             for (i.y_ = texmap_bounds_min.y_; i.y_ <= texmap_bounds_max.y_; ++ i.y_) {
                 // Convert from texture space to image space
                 float z_rel = i.y_ - texmap_pos.y_;
@@ -488,9 +838,22 @@ void TerrainGrid::drawTo(Urho3D::Vector3 const& pos, Urho3D::Image* terrain_mod,
                     textureweights[offset + 2] / 255.0 * (1 - color.a_) + color.b_ * color.a_
                 );
                 final_color.Normalize();
-                textureweights[offset] = Urho3D::Clamp(Urho3D::RoundToInt(final_color.x_ * 255), 0, 255);
-                textureweights[offset + 1] = Urho3D::Clamp(Urho3D::RoundToInt(final_color.y_ * 255), 0, 255);
-                textureweights[offset + 2] = Urho3D::Clamp(Urho3D::RoundToInt(final_color.z_ * 255), 0, 255);
+                uint8_t new_weights[3] = {
+                    uint8_t(Urho3D::Clamp(Urho3D::RoundToInt(final_color.x_ * 255), 0, 255)),
+                    uint8_t(Urho3D::Clamp(Urho3D::RoundToInt(final_color.y_ * 255), 0, 255)),
+                    uint8_t(Urho3D::Clamp(Urho3D::RoundToInt(final_color.z_ * 255), 0, 255))
+                };
+                if (memcmp(&textureweights[offset], new_weights, 3) == 0) {
+                    continue;
+                }
+                memcpy(&textureweights[offset], new_weights, 3);
+                if (changed_begin < 0) {
+                    changed_begin = i.y_;
+                }
+                changed_end = i.y_ + 1;
+            }
+            if (changed_begin >= 0) {
+                markTextureweightsDirty(Urho3D::IntRect(i.x_, changed_begin, i.x_ + 1, changed_end));
             }
         }
     }
@@ -513,6 +876,9 @@ void TerrainGrid::drawTo(Urho3D::Vector3 const& pos, Urho3D::Image* terrain_mod,
         float hmap_scale = height_mod->GetWidth() * total_size.x_ / hmap_total_size.x_ / size.x_;
         for (i.x_ = hmap_bounds_min.x_; i.x_ <= hmap_bounds_max.x_; ++ i.x_) {
             float x_rel = i.x_ - hmap_pos.x_;
+            // Modified part of this column
+            int changed_begin = -1;
+            int changed_end = -1;
             for (i.y_ = hmap_bounds_min.y_; i.y_ <= hmap_bounds_max.y_; ++ i.y_) {
                 // Convert from height space to image space
                 float z_rel = i.y_ - hmap_pos.y_;
@@ -532,19 +898,19 @@ void TerrainGrid::drawTo(Urho3D::Vector3 const& pos, Urho3D::Image* terrain_mod,
                 float height_increase = (color.Average() - 0.5) * 2 * height_mod_strength;
                 int height_increase_i = 65535.0 * height_increase / total_size.z_;
                 unsigned offset = i.x_ + i.y_ * hmap_total_size.x_;
-                heightmap[offset] = Urho3D::Clamp(int(heightmap[offset]) + height_increase_i, 0, 0xffff);
+                uint16_t new_height = Urho3D::Clamp(int(heightmap[offset]) + height_increase_i, 0, 0xffff);
+                if (heightmap[offset] == new_height) {
+                    continue;
+                }
+                heightmap[offset] = new_height;
+                if (changed_begin < 0) {
+                    changed_begin = i.y_;
+                }
+                changed_end = i.y_ + 1;
+            }
+            if (changed_begin >= 0) {
+                markHeightmapDirty(Urho3D::IntRect(i.x_, changed_begin, i.x_ + 1, changed_end));
             }
-        }
-    }
-
-    // Mark chunks dirty
-// TODO: Would it be a good idea to more accurate here? Now some chunks are marked dirty even if no changes happen on them.
-    Urho3D::IntVector2 chunks_bounds_min(Urho3D::FloorToInt(bounds_rel_min.x_ * grid_size.x_), Urho3D::FloorToInt(bounds_rel_min.y_ * grid_size.y_));
-    Urho3D::IntVector2 chunks_bounds_max(Urho3D::CeilToInt(bounds_rel_max.x_ * grid_size.x_), Urho3D::CeilToInt(bounds_rel_max.y_ * grid_size.y_));
-    Urho3D::IntVector2 i;
-    for (i.x_ = chunks_bounds_min.x_; i.x_ <= chunks_bounds_max.x_; ++ i.x_) {
-        for (i.y_ = chunks_bounds_min.y_; i.y_ <= chunks_bounds_max.y_; ++ i.y_) {
-            chunks_not_dirty.Erase(i);
         }
     }
 
@@ -566,7 +932,7 @@ void TerrainGrid::registerObject(Urho3D::Context* context)
     URHO3D_ATTRIBUTE("Texture repeats", unsigned, texture_repeats, DEFAULT_TEXTURE_REPEATS, Urho3D::AM_DEFAULT);
     URHO3D_ATTRIBUTE("Textureweight width", unsigned, textureweight_width, DEFAULT_TEXTUREWEIGHT_WIDTH, Urho3D::AM_DEFAULT);
     URHO3D_ACCESSOR_ATTRIBUTE("Texture Images", getTexturesImagesAttr, setTexturesImagesAttr, Urho3D::ResourceRefList, Urho3D::ResourceRefList(Urho3D::Image::GetTypeStatic()), Urho3D::AM_DEFAULT);
-    URHO3D_ATTRIBUTE("Grid size", Urho3D::IntVector2, grid_size, Urho3D::IntVector2::ZERO, Urho3D::AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Grid size", getGridSizeAttr, setGridSizeAttr, Urho3D::IntVector2, Urho3D::IntVector2::ZERO, Urho3D::AM_DEFAULT);
     URHO3D_ACCESSOR_ATTRIBUTE("Heightmap", getHeightmapAttr, setHeightmapAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_DEFAULT);
     URHO3D_ACCESSOR_ATTRIBUTE("Textureweights", getTextureweightsAttr, setTextureweightsAttr, Urho3D::PODVector<unsigned char>, Urho3D::Variant::emptyBuffer, Urho3D::AM_DEFAULT);
     URHO3D_ATTRIBUTE("Viewask", unsigned, viewmask, Urho3D::DEFAULT_VIEWMASK, Urho3D::AM_DEFAULT);
@@ -577,6 +943,28 @@ void TerrainGrid::ApplyAttributes()
     buildFromBuffers();
 }
 
+void TerrainGrid::OnNodeSet(Urho3D::Node* node)
+{
+    Urho3D::Component::OnNodeSet(node);
+    // Listen to transform changes, so the weight atlas stays in place
+    if (node) {
+        node->AddListener(this);
+    }
+}
+
+void TerrainGrid::OnSceneSet(Urho3D::Scene* scene)
+{
+    Urho3D::Component::OnSceneSet(scene);
+
+    updateSubscriptions(scene);
+}
+
+void TerrainGrid::OnMarkedDirty(Urho3D::Node* node)
+{
+    (void)node;
+    updateWeightAtlasTransform();
+}
+
 Urho3D::Terrain* TerrainGrid::getChunkAt(float x, float z) const
 {
     int x_i = Urho3D::FloorToInt(x / (heightmap_width - 1) / heightmap_square_width);
@@ -588,6 +976,501 @@ Urho3D::Terrain* TerrainGrid::getChunkAt(float x, float z) const
     return chunks[x_i + z_i * grid_size.x_];
 }
 
+void TerrainGrid::markHeightmapDirty(Urho3D::IntRect const& rect)
+{
+    Urho3D::IntVector2 hmap_total_size = getHeightmapSize();
+    int begin_x = Urho3D::Max(0, rect.left_);
+    int begin_y = Urho3D::Max(0, rect.top_);
+    int end_x = Urho3D::Min(hmap_total_size.x_, rect.right_);
+    int end_y = Urho3D::Min(hmap_total_size.y_, rect.bottom_);
+    if (begin_x >= end_x || begin_y >= end_y) {
+        return;
+    }
+
+    // Heights at the borders of chunks belong to both chunks
+    int chunk_squares = heightmap_width - 1;
+    Urho3D::IntVector2 chunks_begin(Urho3D::Max(0, (begin_x - 1) / chunk_squares), Urho3D::Max(0, (begin_y - 1) / chunk_squares));
+    Urho3D::IntVector2 chunks_end(Urho3D::Min(grid_size.x_, (end_x - 1) / chunk_squares + 1), Urho3D::Min(grid_size.y_, (end_y - 1) / chunk_squares + 1));
+
+    Urho3D::IntVector2 chunk_pos;
+    for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+        for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+            mergeDirtyRect(heightmap_dirty, chunk_pos, Urho3D::IntRect(
+                Urho3D::Max(0, begin_x - chunk_pos.x_ * chunk_squares),
+                Urho3D::Max(0, begin_y - chunk_pos.y_ * chunk_squares),
+                Urho3D::Min(int(heightmap_width), end_x - chunk_pos.x_ * chunk_squares),
+                Urho3D::Min(int(heightmap_width), end_y - chunk_pos.y_ * chunk_squares)
+            ));
+        }
+    }
+}
+
+void TerrainGrid::markTextureweightsDirty(Urho3D::IntRect const& rect)
+{
+    Urho3D::IntVector2 texmap_total_size = getTextureweightsSize();
+    int begin_x = Urho3D::Max(0, rect.left_);
+    int begin_y = Urho3D::Max(0, rect.top_);
+    int end_x = Urho3D::Min(texmap_total_size.x_, rect.right_);
+    int end_y = Urho3D::Min(texmap_total_size.y_, rect.bottom_);
+    if (begin_x >= end_x || begin_y >= end_y) {
+        return;
+    }
+
+    int tw = textureweight_width;
+    Urho3D::IntVector2 chunks_begin(begin_x / tw, begin_y / tw);
+    Urho3D::IntVector2 chunks_end((end_x - 1) / tw + 1, (end_y - 1) / tw + 1);
+
+    Urho3D::IntVector2 chunk_pos;
+    for (chunk_pos.y_ = chunks_begin.y_; chunk_pos.y_ < chunks_end.y_; ++ chunk_pos.y_) {
+        for (chunk_pos.x_ = chunks_begin.x_; chunk_pos.x_ < chunks_end.x_; ++ chunk_pos.x_) {
+            mergeDirtyRect(textureweights_dirty, chunk_pos, Urho3D::IntRect(
+                Urho3D::Max(0, begin_x - chunk_pos.x_ * tw),
+                Urho3D::Max(0, begin_y - chunk_pos.y_ * tw),
+                Urho3D::Min(tw, end_x - chunk_pos.x_ * tw),
+                Urho3D::Min(tw, end_y - chunk_pos.y_ * tw)
+            ));
+        }
+    }
+}
+
+void TerrainGrid::mergeDirtyRect(DirtyRects& rects, Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& rect)
+{
+    auto rects_find = rects.Find(chunk_pos);
+    if (rects_find == rects.End()) {
+        rects[chunk_pos] = rect;
+        return;
+    }
+    Urho3D::IntRect& old_rect = rects_find->second_;
+    old_rect.left_ = Urho3D::Min(old_rect.left_, rect.left_);
+    old_rect.top_ = Urho3D::Min(old_rect.top_, rect.top_);
+    old_rect.right_ = Urho3D::Max(old_rect.right_, rect.right_);
+    old_rect.bottom_ = Urho3D::Max(old_rect.bottom_, rect.bottom_);
+}
+
+void TerrainGrid::updateChunkHeightmap(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& rect)
+{
+    unsigned hmap_total_width = getHeightmapSize().x_;
+    unsigned chunk_squares = heightmap_width - 1;
+
+    // Write to the same image, so Terrain notices which patches have changed
+    Urho3D::Terrain* chunk = chunks[chunk_pos.x_ + chunk_pos.y_ * grid_size.x_];
+    unsigned char* chunk_heightmap_data = chunk->GetHeightMap()->GetData();
+    for (int y = rect.top_; y < rect.bottom_; ++ y) {
+        unsigned ofs = chunk_pos.x_ * chunk_squares + rect.left_ + (chunk_pos.y_ * chunk_squares + y) * hmap_total_width;
+        unsigned char* pixel = chunk_heightmap_data + ((heightmap_width - y - 1) * heightmap_width + rect.left_) * 3;
+        for (int x = rect.left_; x < rect.right_; ++ x) {
+            uint16_t height = heightmap[ofs ++];
+            *pixel ++ = height / 256;
+            *pixel ++ = height % 256;
+            *pixel ++ = 0;
+        }
+    }
+    chunk->ApplyHeightMap();
+}
+
+void TerrainGrid::updateChunkTextureweights(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& rect)
+{
+    unsigned texmap_total_width = getTextureweightsSize().x_;
+
+    // Chunk is either in the atlas or in its own texture
+    Urho3D::Texture2D* tex;
+    Urho3D::IntVector2 tex_offset;
+    if (weight_atlas) {
+        tex = weight_atlas;
+        tex_offset.x_ = chunk_pos.x_ * textureweight_width;
+        tex_offset.y_ = (grid_size.y_ - chunk_pos.y_ - 1) * textureweight_width;
+    } else {
+        Urho3D::Terrain* chunk = chunks[chunk_pos.x_ + chunk_pos.y_ * grid_size.x_];
+        tex = static_cast<Urho3D::Texture2D*>(chunk->GetMaterial()->GetTexture(static_cast<Urho3D::TextureUnit>(0)));
+    }
+
+    // Some graphics APIs store three component images with four components
+    unsigned components = tex->GetComponents();
+    Urho3D::PODVector<unsigned char> data;
+    data.Reserve(rect.Width() * rect.Height() * components);
+    // Rows of texture are in opposite order
+    for (int y = rect.bottom_ - 1; y >= rect.top_; -- y) {
+        unsigned ofs = (chunk_pos.x_ * textureweight_width + rect.left_ + (chunk_pos.y_ * textureweight_width + y) * texmap_total_width) * texs.Size();
+        for (int x = rect.left_; x < rect.right_; ++ x) {
+            for (unsigned i = 0; i < components; ++ i) {
+                data.Push(i < texs.Size() ? textureweights[ofs + i] : 255);
+            }
+            ofs += texs.Size();
+        }
+    }
+    tex->SetData(0, tex_offset.x_ + rect.left_, tex_offset.y_ + textureweight_width - rect.bottom_, rect.Width(), rect.Height(), data.Buffer());
+}
+
+void TerrainGrid::buildWeightAtlas()
+{
+    Urho3D::IntVector2 texmap_total_size = getTextureweightsSize();
+    if (texmap_total_size.x_ > MAX_WEIGHT_ATLAS_WIDTH || texmap_total_size.y_ > MAX_WEIGHT_ATLAS_WIDTH) {
+        URHO3D_LOGWARNING("TerrainGrid weight atlas is " + Urho3D::String(texmap_total_size.x_) + "x" + Urho3D::String(texmap_total_size.y_) + ", which might be too big for the GPU!");
+    }
+
+    // Rows are in opposite order, like in the textures of chunks
+    unsigned components = texs.Size();
+    Urho3D::SharedPtr<Urho3D::Image> atlas_img(new Urho3D::Image(context_));
+    atlas_img->SetSize(texmap_total_size.x_, texmap_total_size.y_, components);
+    unsigned char* atlas_data = atlas_img->GetData();
+    unsigned row_size = texmap_total_size.x_ * components;
+    for (int y = texmap_total_size.y_ - 1; y >= 0; -- y) {
+        memcpy(atlas_data, &textureweights[y * row_size], row_size);
+        atlas_data += row_size;
+    }
+
+    weight_atlas = new Urho3D::Texture2D(context_);
+    weight_atlas->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
+    weight_atlas->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+    // Mipmaps would mix weights of neighbor chunks and go out of date in partial updates
+    weight_atlas->SetNumLevels(1);
+    weight_atlas->SetData(atlas_img);
+}
+
+void TerrainGrid::updateWeightAtlasTransform()
+{
+    if (!weight_atlas_mat || !node_) {
+        return;
+    }
+    // V goes from north to south, because rows of the atlas are in opposite order
+    Urho3D::Vector3 origin = node_->GetWorldPosition();
+    Urho3D::Vector3 size = getSize() * node_->GetWorldScale();
+    weight_atlas_mat->SetShaderParameter("WeightAtlasTransform", Urho3D::Vector4(
+        1 / size.x_,
+        -1 / size.z_,
+        -origin.x_ / size.x_,
+        1 + origin.z_ / size.z_
+    ));
+}
+
+Urho3D::SharedPtr<Urho3D::Material> TerrainGrid::createBaseMaterial(Urho3D::Technique* technique) const
+{
+    Urho3D::SharedPtr<Urho3D::Material> mat(new Urho3D::Material(context_));
+    mat->SetNumTechniques(1);
+    if (technique) {
+        mat->SetTechnique(0, technique);
+    } else {
+        mat->SetTechnique(0, GetSubsystem<Urho3D::ResourceCache>()->GetResource<Urho3D::Technique>("Techniques/TerrainBlend.xml"));
+    }
+    mat->SetShaderParameter("DetailTiling", Urho3D::Vector2(texture_repeats, texture_repeats));
+    for (unsigned i = 0; i < texs.Size(); ++ i) {
+        mat->SetTexture(static_cast<Urho3D::TextureUnit>(i + 1), texs[i]);
+    }
+    return mat;
+}
+
+Urho3D::SharedPtr<Urho3D::Material> TerrainGrid::createChunkMaterial(Urho3D::Material* base_mat, Urho3D::Image* textureweights_img) const
+{
+    Urho3D::SharedPtr<Urho3D::Texture2D> textureweights_tex(new Urho3D::Texture2D(context_));
+    textureweights_tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
+    textureweights_tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+    // Partial updates would leave the mipmaps out of date
+    if (partial_updates) {
+        textureweights_tex->SetNumLevels(1);
+    }
+    textureweights_tex->SetData(textureweights_img);
+    Urho3D::SharedPtr<Urho3D::Material> mat = base_mat->Clone();
+    mat->SetTexture(static_cast<Urho3D::TextureUnit>(0), textureweights_tex);
+    return mat;
+}
+
+Urho3D::Terrain* TerrainGrid::createChunk(Urho3D::IntVector2 const& chunk_pos, Urho3D::Image* heightmap_img, Urho3D::Material* mat)
+{
+    Urho3D::Node* chunk_node = GetNode()->CreateChild(Urho3D::String::EMPTY, Urho3D::LOCAL);
+    chunk_node->SetPosition(Urho3D::Vector3(
+        (chunk_pos.x_ + 0.5) * (heightmap_width - 1) * heightmap_square_width,
+        0,
+        (chunk_pos.y_ + 0.5) * (heightmap_width - 1) * heightmap_square_width
+    ));
+
+    Urho3D::Terrain* chunk_terrain = chunk_node->CreateComponent<Urho3D::Terrain>(Urho3D::LOCAL);
+    chunk_terrain->SetSpacing(Urho3D::Vector3(heightmap_square_width, heightmap_step, heightmap_square_width));
+    chunk_terrain->SetHeightMap(heightmap_img);
+    chunk_terrain->SetMaterial(mat);
+    chunk_terrain->SetViewMask(viewmask);
+
+    chunks[chunk_pos.x_ + chunk_pos.y_ * grid_size.x_] = chunk_terrain;
+    return chunk_terrain;
+}
+
+void TerrainGrid::closeTiles()
+{
+    if (!tiles_file) {
+        return;
+    }
+
+    for (auto i = chunks_loading.Begin(); i != chunks_loading.End(); ++ i) {
+        cancelChunkLoader(i->second_, true);
+    }
+    chunks_loading.Clear();
+
+    for (Urho3D::Terrain*& chunk : chunks) {
+        if (chunk) {
+            chunk->GetNode()->Remove();
+            chunk = nullptr;
+        }
+    }
+    loaded_chunks_count = 0;
+
+    tiles_file.Reset();
+    tiles.Clear();
+    streaming_mat.Reset();
+
+    updateSubscriptions(GetScene());
+}
+
+void TerrainGrid::updateStreaming()
+{
+    if (!tiles_file) {
+        return;
+    }
+
+    Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+    float chunk_width = getChunkWidth();
+
+    Urho3D::IntVector2 chunk_pos;
+    unsigned chunk_i = 0;
+    for (chunk_pos.y_ = 0; chunk_pos.y_ < grid_size.y_; ++ chunk_pos.y_) {
+        for (chunk_pos.x_ = 0; chunk_pos.x_ < grid_size.x_; ++ chunk_pos.x_) {
+            float distance = getChunkStreamingDistance(chunk_pos);
+
+            // Drop chunks that are too far
+            if (distance > streaming_radius * (1 + STREAMING_HYSTERESIS)) {
+                if (chunks[chunk_i]) {
+                    chunks[chunk_i]->GetNode()->Remove();
+                    chunks[chunk_i] = nullptr;
+                    -- loaded_chunks_count;
+                    updateChunkNeighbors(chunk_pos);
+                }
+                // If loader has already started, its result is dropped when it is ready
+                auto chunks_loading_find = chunks_loading.Find(chunk_pos);
+                if (chunks_loading_find != chunks_loading.End() && cancelChunkLoader(chunks_loading_find->second_, false)) {
+                    chunks_loading.Erase(chunks_loading_find);
+                }
+            }
+            // Start loading missing chunks. Broken tiles are not tried again.
+            else if (distance <= streaming_radius && !chunks[chunk_i] && !chunks_loading.Contains(chunk_pos) && tiles[chunk_i].size > 0) {
+                Urho3D::SharedPtr<ChunkLoader> loader(new ChunkLoader());
+                loader->grid = this;
+                loader->chunk_pos = chunk_pos;
+                loader->tile = tiles[chunk_i];
+                loader->request_time = Urho3D::Time::GetSystemTime();
+                loader->heightmap_img = new Urho3D::Image(context_);
+                loader->heightmap_img->SetSize(heightmap_width, heightmap_width, 3);
+                loader->textureweights_img = new Urho3D::Image(context_);
+                loader->textureweights_img->SetSize(textureweight_width, textureweight_width, tiles_components);
+                loader->failed = false;
+                loader->done = false;
+                loader->priority_ = CHUNK_LOADING_PRIORITY - unsigned(Urho3D::Min(distance / chunk_width * 100, float(CHUNK_LOADING_PRIORITY)));
+                loader->workFunction_ = doLoadChunk;
+                workqueue->AddWorkItem(Urho3D::SharedPtr<Urho3D::WorkItem>(loader));
+                chunks_loading[chunk_pos] = loader;
+            }
+
+            ++ chunk_i;
+        }
+    }
+}
+
+void TerrainGrid::applyLoadedChunks()
+{
+    for (auto i = chunks_loading.Begin(); i != chunks_loading.End(); ) {
+        ChunkLoader const* loader = i->second_;
+        if (!loader->completed_) {
+            ++ i;
+            continue;
+        }
+
+        Urho3D::IntVector2 chunk_pos = loader->chunk_pos;
+        if (loader->failed) {
+            URHO3D_LOGWARNING("Unable to load TerrainGrid chunk " + chunk_pos.ToString() + "!");
+            tiles[chunk_pos.x_ + chunk_pos.y_ * grid_size.x_].size = 0;
+        }
+        // Foci might have moved away while loading
+        else if (getChunkStreamingDistance(chunk_pos) <= streaming_radius * (1 + STREAMING_HYSTERESIS)) {
+            createChunk(chunk_pos, loader->heightmap_img, createChunkMaterial(streaming_mat, loader->textureweights_img));
+            ++ loaded_chunks_count;
+            updateChunkNeighbors(chunk_pos);
+
+            unsigned latency = Urho3D::Time::GetSystemTime() - loader->request_time;
+            ++ loads_count;
+            loads_total_latency += latency;
+            loads_max_latency = Urho3D::Max(loads_max_latency, latency);
+        }
+
+        i = chunks_loading.Erase(i);
+    }
+}
+
+bool TerrainGrid::cancelChunkLoader(ChunkLoader* loader, bool wait)
+{
+    Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+    if (workqueue->RemoveWorkItem(Urho3D::SharedPtr<Urho3D::WorkItem>(loader))) {
+        return true;
+    }
+    // Loader has already started, or even finished. WorkQueue sets
+    // "completed_" only after the work function returns, so it is not used.
+    std::unique_lock<std::mutex> lock(loader->done_mutex);
+    if (wait) {
+        loader->done_condition.wait(lock, [loader] { return loader->done; });
+    }
+    return loader->done;
+}
+
+float TerrainGrid::getChunkStreamingDistance(Urho3D::IntVector2 const& chunk_pos) const
+{
+    float chunk_width = getChunkWidth();
+    Urho3D::Rect chunk_rect(
+        Urho3D::Vector2(chunk_pos.x_, chunk_pos.y_) * chunk_width,
+        Urho3D::Vector2(chunk_pos.x_ + 1, chunk_pos.y_ + 1) * chunk_width
+    );
+    float result = Urho3D::M_INFINITY;
+    for (Urho3D::Vector3 const& focus : streaming_foci) {
+        Urho3D::Vector2 diff(
+            Urho3D::Max(0.0f, Urho3D::Max(chunk_rect.min_.x_ - focus.x_, focus.x_ - chunk_rect.max_.x_)),
+            Urho3D::Max(0.0f, Urho3D::Max(chunk_rect.min_.y_ - focus.z_, focus.z_ - chunk_rect.max_.y_))
+        );
+        result = Urho3D::Min(result, diff.Length());
+    }
+    return result;
+}
+
+void TerrainGrid::updateChunkNeighbors(Urho3D::IntVector2 const& chunk_pos)
+{
+    int x = chunk_pos.x_;
+    int y = chunk_pos.y_;
+    Urho3D::Terrain* chunk = chunks[x + y * grid_size.x_];
+    Urho3D::Terrain* west = x > 0 ? chunks[x - 1 + y * grid_size.x_] : nullptr;
+    Urho3D::Terrain* east = x < grid_size.x_ - 1 ? chunks[x + 1 + y * grid_size.x_] : nullptr;
+    Urho3D::Terrain* south = y > 0 ? chunks[x + (y - 1) * grid_size.x_] : nullptr;
+    Urho3D::Terrain* north = y < grid_size.y_ - 1 ? chunks[x + (y + 1) * grid_size.x_] : nullptr;
+    if (chunk) {
+        chunk->SetWestNeighbor(west);
+        chunk->SetEastNeighbor(east);
+        chunk->SetSouthNeighbor(south);
+        chunk->SetNorthNeighbor(north);
+    }
+    if (west) {
+        west->SetEastNeighbor(chunk);
+    }
+    if (east) {
+        east->SetWestNeighbor(chunk);
+    }
+    if (south) {
+        south->SetNorthNeighbor(chunk);
+    }
+    if (north) {
+        north->SetSouthNeighbor(chunk);
+    }
+}
+
+void TerrainGrid::updateSubscriptions(Urho3D::Scene* scene)
+{
+    if (scene && tiles_file) {
+        SubscribeToEvent(scene, Urho3D::E_SCENEPOSTUPDATE, URHO3D_HANDLER(TerrainGrid, handleScenePostUpdate));
+    } else {
+        UnsubscribeFromEvent(Urho3D::E_SCENEPOSTUPDATE);
+    }
+}
+
+void TerrainGrid::handleScenePostUpdate(Urho3D::StringHash event_type, Urho3D::VariantMap& event_data)
+{
+    (void)event_type;
+    (void)event_data;
+    applyLoadedChunks();
+}
+
+void TerrainGrid::doPrepareChunk(Urho3D::WorkItem const* workitem, unsigned thread_i)
+{
+    (void)thread_i;
+    ChunkPreparer const* preparer = static_cast<ChunkPreparer const*>(workitem);
+    TerrainGrid const* grid = preparer->grid;
+    unsigned heightmap_width = grid->heightmap_width;
+    unsigned textureweight_width = grid->textureweight_width;
+    unsigned components = grid->texs.Size();
+    int x = preparer->chunk_pos.x_;
+    int y = preparer->chunk_pos.y_;
+
+    // Heightmap for this Chunk
+    unsigned char* chunk_heightmap_data = preparer->heightmap_img->GetData();
+    for (unsigned y2 = 0; y2 < heightmap_width; ++ y2) {
+        unsigned ofs = x * (heightmap_width - 1) + ((heightmap_width - y2 - 1) + y * (heightmap_width - 1)) * ((heightmap_width - 1) * grid->grid_size.x_ + 1);
+        for (unsigned x2 = 0; x2 < heightmap_width; ++ x2) {
+            uint16_t height = grid->heightmap[ofs ++];
+            *chunk_heightmap_data ++ = height / 256;
+            *chunk_heightmap_data ++ = height % 256;
+            *chunk_heightmap_data ++ = 0;
+        }
+    }
+
+    if (!preparer->textureweights_img) {
+        return;
+    }
+
+    // Weight texture for material. Rows of a chunk are continuous in the source data.
+    unsigned char* chunk_textureweight_data = preparer->textureweights_img->GetData();
+    unsigned row_size = textureweight_width * components;
+    for (unsigned y2 = 0; y2 < textureweight_width; ++ y2) {
+        unsigned ofs = (x * textureweight_width + ((textureweight_width - y2 - 1) + y * textureweight_width) * textureweight_width * grid->grid_size.x_) * components;
+        memcpy(chunk_textureweight_data, &grid->textureweights[ofs], row_size);
+        chunk_textureweight_data += row_size;
+    }
+}
+
+void TerrainGrid::doLoadChunk(Urho3D::WorkItem const* workitem, unsigned thread_i)
+{
+    (void)thread_i;
+    ChunkLoader const* loader = static_cast<ChunkLoader const*>(workitem);
+    loader->failed = !readTile(loader);
+    {
+        std::lock_guard<std::mutex> lock(loader->done_mutex);
+        loader->done = true;
+    }
+    loader->done_condition.notify_all();
+}
+
+bool TerrainGrid::readTile(ChunkLoader const* loader)
+{
+    TerrainGrid const* grid = loader->grid;
+    unsigned heightmap_width = grid->heightmap_width;
+    unsigned textureweight_width = grid->textureweight_width;
+    unsigned row_size = textureweight_width * grid->tiles_components;
+
+    Urho3D::PODVector<unsigned char> blob;
+    blob.Resize(loader->tile.size);
+    {
+        Urho3D::MutexLock lock(grid->tiles_file_mutex);
+        grid->tiles_file->Seek(grid->tiles_file_begin + loader->tile.offset);
+        if (grid->tiles_file->Read(blob.Buffer(), blob.Size()) != blob.Size()) {
+            return false;
+        }
+    }
+
+    Urho3D::MemoryBuffer blob_buf(blob);
+    Urho3D::VectorBuffer chunk_vbuf;
+    if (!Urho3D::DecompressStream(chunk_vbuf, blob_buf) || chunk_vbuf.GetSize() != heightmap_width * heightmap_width * 2 + textureweight_width * row_size) {
+        return false;
+    }
+    chunk_vbuf.Seek(0);
+
+    // Rows of images are in opposite order
+    unsigned char* heightmap_data = loader->heightmap_img->GetData();
+    for (unsigned y = 0; y < heightmap_width; ++ y) {
+        unsigned char* pixel = heightmap_data + (heightmap_width - y - 1) * heightmap_width * 3;
+        for (unsigned x = 0; x < heightmap_width; ++ x) {
+            uint16_t height = chunk_vbuf.ReadUShort();
+            *pixel ++ = height / 256;
+            *pixel ++ = height % 256;
+            *pixel ++ = 0;
+        }
+    }
+    unsigned char* textureweights_data = loader->textureweights_img->GetData();
+    for (unsigned y = 0; y < textureweight_width; ++ y) {
+        chunk_vbuf.Read(textureweights_data + (textureweight_width - y - 1) * row_size, row_size);
+    }
+    return true;
+}
+
 Urho3D::ResourceRefList TerrainGrid::getTexturesImagesAttr() const
 {
     Urho3D::ResourceRefList texs_images_attr(Urho3D::Image::GetTypeStatic());
@@ -615,6 +1498,24 @@ void TerrainGrid::setTexturesImagesAttr(Urho3D::ResourceRefList const& value)
     }
 }
 
+Urho3D::IntVector2 TerrainGrid::getGridSizeAttr() const
+{
+    // Streamed chunks are not in the attributes, so there is nothing to build from
+    if (tiles_file) {
+        return Urho3D::IntVector2::ZERO;
+    }
+    return grid_size;
+}
+
+void TerrainGrid::setGridSizeAttr(Urho3D::IntVector2 const& value)
+{
+    // Streamed grid gets its size from the tiles
+    if (tiles_file) {
+        return;
+    }
+    grid_size = value;
+}
+
 Urho3D::PODVector<unsigned char> TerrainGrid::getHeightmapAttr() const
 {
     Urho3D::VectorBuffer heightmap_vbuf;
@@ -637,33 +1538,39 @@ void TerrainGrid::setHeightmapAttr(Urho3D::PODVector<unsigned char> const& value
         throw std::runtime_error("Unable to decompress TerrainGrid.heightmap for attribute deserialization!");
     }
     heightmap_vbuf.Seek(0);
-    HeightData old_heightmap;
-    heightmap.Swap(old_heightmap);
-    while (!heightmap_vbuf.IsEof()) {
-        heightmap.Push(heightmap_vbuf.ReadUShort());
-    }
-    // Compare new and old heightdata to find out which chunks have changed
-    if (old_heightmap.Empty()) {
+
+    // If size changes, every chunk needs to be recreated
+    Urho3D::IntVector2 hmap_total_size = getHeightmapSize();
+    unsigned new_size = heightmap_vbuf.GetSize() / 2;
+    if (heightmap.Size() != new_size || new_size != unsigned(hmap_total_size.x_ * hmap_total_size.y_)) {
+        heightmap.Resize(new_size);
+        for (unsigned i = 0; i < new_size; ++ i) {
+            heightmap[i] = heightmap_vbuf.ReadUShort();
+        }
         chunks_not_dirty.Clear();
-    } else {
-        Urho3D::IntVector2 chunk_pos;
-        for (chunk_pos.y_ = 0; chunk_pos.y_ < grid_size.y_; ++ chunk_pos.y_) {
-            for (chunk_pos.x_ = 0; chunk_pos.x_ < grid_size.x_; ++ chunk_pos.x_) {
-                if (chunks_not_dirty.Contains(chunk_pos)) {
-                    unsigned offset_begin = chunk_pos.x_ * (heightmap_width - 1) + chunk_pos.y_ * (heightmap_width - 1) * (grid_size.x_ * (heightmap_width - 1) + 1);
-                    bool removed = false;
-                    for (unsigned z = 0; z < heightmap_width && !removed; ++ z) {
-                        unsigned offset = offset_begin + z * (grid_size.x_ * (heightmap_width - 1) + 1);
-                        for (unsigned x = 0; x < heightmap_width; ++ x) {
-                            if (heightmap[offset] != old_heightmap[offset]) {
-                                chunks_not_dirty.Erase(chunk_pos);
-                                removed = true;
-                                break;
-                            }
-                            ++ offset;
-                        }
-                    }
+        return;
+    }
+
+    // Compare to old heights while reading. Changes are marked separately
+    // for every chunk on the row, so unchanged chunks stay clean.
+    int chunk_squares = heightmap_width - 1;
+    unsigned offset = 0;
+    for (int y = 0; y < hmap_total_size.y_; ++ y) {
+        int changed_begin = -1;
+        int changed_end = -1;
+        for (int x = 0; x < hmap_total_size.x_; ++ x) {
+            uint16_t height = heightmap_vbuf.ReadUShort();
+            if (heightmap[offset] != height) {
+                heightmap[offset] = height;
+                if (changed_begin < 0) {
+                    changed_begin = x;
                 }
+                changed_end = x + 1;
+            }
+            ++ offset;
+            if (changed_begin >= 0 && (x % chunk_squares == chunk_squares - 1 || x == hmap_total_size.x_ - 1)) {
+                markHeightmapDirty(Urho3D::IntRect(changed_begin, y, changed_end, y + 1));
+                changed_begin = -1;
             }
         }
     }
@@ -686,35 +1593,39 @@ void TerrainGrid::setTextureweightsAttr(Urho3D::PODVector<unsigned char> const&
     if (!Urho3D::DecompressStream(textureweights_vbuf, textureweights_compressed_buf)) {
         throw std::runtime_error("Unable to decompress TerrainGrid.textureweights for attribute deserialization!");
     }
-    WeightData old_textureweights;
-    textureweights.Swap(old_textureweights);
-// TODO: Make some kind of fast memory copy!
-    textureweights_vbuf.Seek(0);
-    while (!textureweights_vbuf.IsEof()) {
-        textureweights.Push(textureweights_vbuf.ReadUByte());
-    }
-    // Compare new and old heightdata to find out which chunks have changed
-    if (old_textureweights.Empty()) {
+    unsigned char const* new_textureweights = textureweights_vbuf.GetData();
+    unsigned new_size = textureweights_vbuf.GetSize();
+
+    // If size changes, every chunk needs to be recreated
+    Urho3D::IntVector2 texmap_total_size = getTextureweightsSize();
+    unsigned components = texs.Size();
+    if (textureweights.Size() != new_size || new_size != texmap_total_size.x_ * texmap_total_size.y_ * components) {
+        textureweights.Resize(new_size);
+        if (new_size > 0) {
+            memcpy(&textureweights[0], new_textureweights, new_size);
+        }
         chunks_not_dirty.Clear();
-    } else {
-        Urho3D::IntVector2 chunk_pos;
-        for (chunk_pos.y_ = 0; chunk_pos.y_ < grid_size.y_; ++ chunk_pos.y_) {
-            for (chunk_pos.x_ = 0; chunk_pos.x_ < grid_size.x_; ++ chunk_pos.x_) {
-                if (chunks_not_dirty.Contains(chunk_pos)) {
-                    unsigned offset_begin = (chunk_pos.x_ * textureweight_width + chunk_pos.y_ * textureweight_width * grid_size.x_ * textureweight_width) * 3;
-                    bool removed = false;
-                    for (unsigned z = 0; z < textureweight_width && !removed; ++ z) {
-                        unsigned offset = offset_begin + z * grid_size.x_ * textureweight_width * 3;
-                        for (unsigned x = 0; x < textureweight_width * 3; ++ x) {
-                            if (textureweights[offset] != old_textureweights[offset]) {
-                                chunks_not_dirty.Erase(chunk_pos);
-                                removed = true;
-                                break;
-                            }
-                            ++ offset;
-                        }
-                    }
+        return;
+    }
+
+    // Compare to old weights while copying. Changes are marked separately
+    // for every chunk on the row, so unchanged chunks stay clean.
+    unsigned offset = 0;
+    for (int y = 0; y < texmap_total_size.y_; ++ y) {
+        int changed_begin = -1;
+        int changed_end = -1;
+        for (int x = 0; x < texmap_total_size.x_; ++ x) {
+            if (memcmp(&textureweights[offset], new_textureweights + offset, components) != 0) {
+                memcpy(&textureweights[offset], new_textureweights + offset, components);
+                if (changed_begin < 0) {
+                    changed_begin = x;
                 }
+                changed_end = x + 1;
+            }
+            offset += components;
+            if (changed_begin >= 0 && x % textureweight_width == textureweight_width - 1) {
+                markTextureweightsDirty(Urho3D::IntRect(changed_begin, y, changed_end, y + 1));
+                changed_begin = -1;
             }
         }
     }
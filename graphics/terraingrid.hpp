@@ -1,9 +1,16 @@
 #ifndef URHOEXTRAS_GRAPHICS_TERRAINGRID_HPP
 #define URHOEXTRAS_GRAPHICS_TERRAINGRID_HPP
 
+#include <Urho3D/Container/HashMap.h>
 #include <Urho3D/Container/Vector.h>
+#include <Urho3D/Core/Mutex.h>
+#include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Technique.h>
 #include <Urho3D/Graphics/Terrain.h>
 #include <Urho3D/Graphics/Texture.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/IO/File.h>
 #include <Urho3D/Scene/Component.h>
 #include <cstdint>
 
@@ -29,6 +36,19 @@ public:
 
     void setViewmask(unsigned viewmask);
 
+    // When enabled, drawTo() modifies the heightmaps and weight textures
+    // of existing chunks in place, and only the modified terrain patches
+    // are rebuilt. Weight textures have no mipmaps in this mode.
+    void setPartialUpdates(bool partial);
+
+    // When technique is set, weights of all chunks are stored to one atlas
+    // texture and all chunks share one material, so they can be batched.
+    // The technique must calculate the UV of the weight texture from the
+    // world position: uv = pos.xz * WeightAtlasTransform.xy + WeightAtlasTransform.zw
+    // Rotating the node is not supported. Atlas is as wide as the whole
+    // textureweights, so this is meant for grids of moderate size.
+    void setWeightAtlasTechnique(Urho3D::Technique* technique);
+
     Urho3D::Vector3 getSize() const;
     Urho3D::IntVector2 getHeightmapSize() const;
     Urho3D::IntVector2 getTextureweightsSize() const;
@@ -46,6 +66,33 @@ public:
 
     void forgetSourceData();
 
+    // Writes source data so that every chunk is compressed separately and
+    // an index of them is in the beginning, so chunks can be read one by one.
+    void saveTiles(Urho3D::Serializer& dest) const;
+
+    // Starts streaming chunks from tiles. Only the header and the index are
+    // read, and the file is kept open. Chunks near the streaming foci are
+    // loaded in WorkQueue. The grid can not be modified while streaming,
+    // and the weight atlas is not used.
+    bool loadTiles(Urho3D::File* file);
+
+    // Only chunks within the radius from some of the positions are kept in
+    // memory. Chunks that are farther away are dropped. Positions are in
+    // local space. This has no effect unless tiles are loaded.
+    void setStreamingFoci(Urho3D::PODVector<Urho3D::Vector3> const& foci, float radius);
+
+    bool isStreaming() const;
+
+    // Counters of streaming. Memory use is an estimate of the bytes that
+    // loaded and loading chunks keep in CPU memory. Latency is the time from
+    // requesting a chunk until its Terrain exists, in milliseconds.
+    unsigned getLoadedChunksCount() const;
+    unsigned getLoadingChunksCount() const;
+    unsigned getStreamingMemoryUse() const;
+    float getAverageLoadLatency() const;
+    unsigned getMaxLoadLatency() const;
+    void resetStreamingCounters();
+
     float getHeight(Urho3D::Vector3 const& world_pos) const;
 
     Urho3D::Vector3 getNormal(Urho3D::Vector3 const& world_pos) const;
@@ -60,14 +107,37 @@ public:
 
     void ApplyAttributes() override;
 
+protected:
+
+    void OnNodeSet(Urho3D::Node* node) override;
+    void OnSceneSet(Urho3D::Scene* scene) override;
+    void OnMarkedDirty(Urho3D::Node* node) override;
+
 private:
 
     typedef Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Texture> > Textures;
     typedef Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Image> > TextureImages;
     typedef Urho3D::HashSet<Urho3D::IntVector2> IVec2Set;
+    // Modified areas of chunks, in the coordinates of the chunk
+    typedef Urho3D::HashMap<Urho3D::IntVector2, Urho3D::IntRect> DirtyRects;
 
     typedef Urho3D::PODVector<Urho3D::Terrain*> Chunks;
 
+    // WorkItem that fills the images of a new chunk
+    class ChunkPreparer;
+    // WorkItem that reads a chunk from tiles
+    class ChunkLoader;
+    typedef Urho3D::HashMap<Urho3D::IntVector2, Urho3D::SharedPtr<ChunkLoader> > ChunkLoaders;
+
+    // Chunk in the tiles file. Offset is from the beginning of the tiles.
+    struct Tile
+    {
+        unsigned offset;
+        // If zero, then tile is broken and not loaded
+        unsigned size;
+    };
+    typedef Urho3D::PODVector<Tile> Tiles;
+
     unsigned heightmap_width;
     float heightmap_square_width;
     float heightmap_step;
@@ -86,14 +156,88 @@ private:
 
     unsigned viewmask;
 
+    bool partial_updates;
+
+    Urho3D::SharedPtr<Urho3D::Technique> weight_atlas_technique;
+    Urho3D::SharedPtr<Urho3D::Texture2D> weight_atlas;
+    Urho3D::SharedPtr<Urho3D::Material> weight_atlas_mat;
+
+    // If set, then chunks are streamed from tiles
+    Urho3D::SharedPtr<Urho3D::File> tiles_file;
+    unsigned tiles_file_begin;
+    // Loaders read the file in WorkQueue threads
+    mutable Urho3D::Mutex tiles_file_mutex;
+    Tiles tiles;
+    unsigned tiles_components;
+    // Shared by streamed chunks, which have their own weight textures
+    Urho3D::SharedPtr<Urho3D::Material> streaming_mat;
+    Urho3D::PODVector<Urho3D::Vector3> streaming_foci;
+    float streaming_radius;
+    ChunkLoaders chunks_loading;
+    unsigned loaded_chunks_count;
+    unsigned loads_count;
+    unsigned long long loads_total_latency;
+    unsigned loads_max_latency;
+
     Chunks chunks;
     IVec2Set chunks_not_dirty;
+    DirtyRects heightmap_dirty;
+    DirtyRects textureweights_dirty;
 
     Urho3D::Terrain* getChunkAt(float x, float z) const;
 
+    // Creates the atlas and copies all weights to it
+    void buildWeightAtlas();
+    void updateWeightAtlasTransform();
+
+    // If technique is null, then the default one is used
+    Urho3D::SharedPtr<Urho3D::Material> createBaseMaterial(Urho3D::Technique* technique) const;
+    Urho3D::SharedPtr<Urho3D::Material> createChunkMaterial(Urho3D::Material* base_mat, Urho3D::Image* textureweights_img) const;
+    // Creates node and Terrain of chunk
+    Urho3D::Terrain* createChunk(Urho3D::IntVector2 const& chunk_pos, Urho3D::Image* heightmap_img, Urho3D::Material* mat);
+
+    // Stops streaming and removes streamed chunks
+    void closeTiles();
+
+    // Drops chunks that are too far and starts loading the missing ones
+    void updateStreaming();
+    void applyLoadedChunks();
+    // Returns false if loader is still running and "wait" is false
+    bool cancelChunkLoader(ChunkLoader* loader, bool wait);
+    // Distance from the chunk to the closest streaming focus
+    float getChunkStreamingDistance(Urho3D::IntVector2 const& chunk_pos) const;
+    // Sets neighbors of the chunk and the chunks next to it
+    void updateChunkNeighbors(Urho3D::IntVector2 const& chunk_pos);
+
+    void updateSubscriptions(Urho3D::Scene* scene);
+    void handleScenePostUpdate(Urho3D::StringHash event_type, Urho3D::VariantMap& event_data);
+
+    static void doLoadChunk(Urho3D::WorkItem const* workitem, unsigned thread_i);
+    // Returns false if tile is broken
+    static bool readTile(ChunkLoader const* loader);
+
+    // Source data is only read, so chunks can be prepared in parallel
+    static void doPrepareChunk(Urho3D::WorkItem const* workitem, unsigned thread_i);
+
+    // Marks area of the whole heightmap or textureweights modified.
+    // Modified parts of chunks are rebuilt by buildFromBuffers().
+    void markHeightmapDirty(Urho3D::IntRect const& rect);
+    void markTextureweightsDirty(Urho3D::IntRect const& rect);
+
+    static void mergeDirtyRect(DirtyRects& rects, Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& rect);
+
+    // Copy area of source data to existing chunk. Rectangle
+    // is in the coordinates of the heightmap of the chunk.
+    void updateChunkHeightmap(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& rect);
+    // Same, but rectangle is in the coordinates of textureweights of the chunk
+    void updateChunkTextureweights(Urho3D::IntVector2 const& chunk_pos, Urho3D::IntRect const& rect);
+
     Urho3D::ResourceRefList getTexturesImagesAttr() const;
     void setTexturesImagesAttr(Urho3D::ResourceRefList const& value);
 
+    Urho3D::IntVector2 getGridSizeAttr() const;
+    void setGridSizeAttr(Urho3D::IntVector2 const& value);
+
     Urho3D::PODVector<unsigned char> getHeightmapAttr() const;
     void setHeightmapAttr(Urho3D::PODVector<unsigned char>const& value);
 
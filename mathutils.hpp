@@ -61,6 +61,16 @@ inline void nearestPointToLine(Urho3D::Vector2 const& point,
                                Urho3D::Vector2 const& line_pos1, Urho3D::Vector2 const& line_pos2,
                                Urho3D::Vector2* nearest_point = nullptr, float* m = nullptr, float* dst_to_point = nullptr);
 
+// Returns the point of triangle that is nearest to given point
+inline Urho3D::Vector3 nearestPointAtTriangle(Urho3D::Vector3 const& point,
+                                              Urho3D::Vector3 const& tri_pos1, Urho3D::Vector3 const& tri_pos2, Urho3D::Vector3 const& tri_pos3);
+
+// Calculates nearest points between two line segments. Unlike the
+// functions above, segments end at their positions.
+inline void nearestPointsBetweenSegments(Urho3D::Vector3& result1, Urho3D::Vector3& result2,
+                                         Urho3D::Vector3 const& seg1_pos1, Urho3D::Vector3 const& seg1_pos2,
+                                         Urho3D::Vector3 const& seg2_pos1, Urho3D::Vector3 const& seg2_pos2);
+
 // Returns distance between two infinite lines
 inline float distanceBetweenLines(Urho3D::Vector3 const& begin1, Urho3D::Vector3 const& dir1,
                                   Urho3D::Vector3 const& begin2, Urho3D::Vector3 const& dir2,
@@ -240,6 +250,95 @@ inline void nearestPointToLine(Urho3D::Vector2 const& point,
 	}
 }
 
+inline Urho3D::Vector3 nearestPointAtTriangle(Urho3D::Vector3 const& point,
+                                              Urho3D::Vector3 const& tri_pos1, Urho3D::Vector3 const& tri_pos2, Urho3D::Vector3 const& tri_pos3)
+{
+	// Find out which feature of the triangle is nearest by
+	// checking the Voronoi regions of corners and edges.
+	Urho3D::Vector3 edge12 = tri_pos2 - tri_pos1;
+	Urho3D::Vector3 edge13 = tri_pos3 - tri_pos1;
+	Urho3D::Vector3 to_point1 = point - tri_pos1;
+	float d1 = edge12.DotProduct(to_point1);
+	float d2 = edge13.DotProduct(to_point1);
+	if (d1 <= 0 && d2 <= 0) {
+		return tri_pos1;
+	}
+	Urho3D::Vector3 to_point2 = point - tri_pos2;
+	float d3 = edge12.DotProduct(to_point2);
+	float d4 = edge13.DotProduct(to_point2);
+	if (d3 >= 0 && d4 <= d3) {
+		return tri_pos2;
+	}
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+		return tri_pos1 + edge12 * (d1 / (d1 - d3));
+	}
+	Urho3D::Vector3 to_point3 = point - tri_pos3;
+	float d5 = edge12.DotProduct(to_point3);
+	float d6 = edge13.DotProduct(to_point3);
+	if (d6 >= 0 && d5 <= d6) {
+		return tri_pos3;
+	}
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+		return tri_pos1 + edge13 * (d2 / (d2 - d6));
+	}
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+		return tri_pos2 + (tri_pos3 - tri_pos2) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	}
+	// Point is above the face
+	float denom = 1 / (va + vb + vc);
+	return tri_pos1 + edge12 * (vb * denom) + edge13 * (vc * denom);
+}
+
+inline void nearestPointsBetweenSegments(Urho3D::Vector3& result1, Urho3D::Vector3& result2,
+                                         Urho3D::Vector3 const& seg1_pos1, Urho3D::Vector3 const& seg1_pos2,
+                                         Urho3D::Vector3 const& seg2_pos1, Urho3D::Vector3 const& seg2_pos2)
+{
+	Urho3D::Vector3 dir1 = seg1_pos2 - seg1_pos1;
+	Urho3D::Vector3 dir2 = seg2_pos2 - seg2_pos1;
+	Urho3D::Vector3 diff = seg1_pos1 - seg2_pos1;
+	float dp_d1_d1 = dir1.DotProduct(dir1);
+	float dp_d2_d2 = dir2.DotProduct(dir2);
+	float dp_d2_diff = dir2.DotProduct(diff);
+	float m1, m2;
+	if (dp_d1_d1 <= Urho3D::M_EPSILON && dp_d2_d2 <= Urho3D::M_EPSILON) {
+		m1 = 0;
+		m2 = 0;
+	} else if (dp_d1_d1 <= Urho3D::M_EPSILON) {
+		m1 = 0;
+		m2 = Urho3D::Clamp(dp_d2_diff / dp_d2_d2, 0.0f, 1.0f);
+	} else {
+		float dp_d1_diff = dir1.DotProduct(diff);
+		if (dp_d2_d2 <= Urho3D::M_EPSILON) {
+			m2 = 0;
+			m1 = Urho3D::Clamp(-dp_d1_diff / dp_d1_d1, 0.0f, 1.0f);
+		} else {
+			float dp_d1_d2 = dir1.DotProduct(dir2);
+			float denom = dp_d1_d1 * dp_d2_d2 - dp_d1_d2 * dp_d1_d2;
+			// If segments are parallel, then any point will do
+			if (denom != 0) {
+				m1 = Urho3D::Clamp((dp_d1_d2 * dp_d2_diff - dp_d1_diff * dp_d2_d2) / denom, 0.0f, 1.0f);
+			} else {
+				m1 = 0;
+			}
+			m2 = (dp_d1_d2 * m1 + dp_d2_diff) / dp_d2_d2;
+			// If nearest point is outside the second segment,
+			// then clamp it and find the first point again.
+			if (m2 < 0) {
+				m2 = 0;
+				m1 = Urho3D::Clamp(-dp_d1_diff / dp_d1_d1, 0.0f, 1.0f);
+			} else if (m2 > 1) {
+				m2 = 1;
+				m1 = Urho3D::Clamp((dp_d1_d2 - dp_d1_diff) / dp_d1_d1, 0.0f, 1.0f);
+			}
+		}
+	}
+	result1 = seg1_pos1 + dir1 * m1;
+	result2 = seg2_pos1 + dir2 * m2;
+}
+
 
 inline float distanceBetweenLines(Urho3D::Vector3 const& begin1, Urho3D::Vector3 const& dir1,
                                   Urho3D::Vector3 const& begin2, Urho3D::Vector3 const& dir2,